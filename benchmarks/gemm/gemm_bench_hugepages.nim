@@ -0,0 +1,109 @@
+# Apache v2 License
+# Mamy Ratsimbazafy
+
+# Effect of huge pages on GEMM
+#
+# The matrices and the packing buffers are allocated with 4 KiB pages,
+# transparent huge pages and reserved huge pages (see laser/private/memory).
+# Packing a transposed A reads one element per row of A and so touches a different
+# page for each element with 4 KiB pages: this is the TLB-bound case.
+#
+# Usage:
+#   nim c -r -d:release -d:openmp benchmarks/gemm/gemm_bench_hugepages.nim
+#
+# Reserved huge pages must be allocated beforehand, for example
+#   echo 1024 | sudo tee /proc/sys/vm/nr_hugepages
+# otherwise they fall back to transparent huge pages.
+# Transparent huge pages must be in "always" or "madvise" mode.
+#
+# DTLB misses can be compared with
+#   perf stat -e dTLB-load-misses,dTLB-loads ./gemm_bench_hugepages
+
+import
+  random, times, stats, strformat, math, strutils,
+  ./gemm_common,
+  ../../laser/private/memory,
+  ../../laser/primitives/matrix_multiplication/[gemm, gemm_tiling]
+
+const
+  M     = 16*6*40
+  K     = 16*6*40
+  N     = 16*6*40
+  NbSamples = 10
+
+const
+  ashape: MatrixShape = (M, K)
+  bshape: MatrixShape = (K, N)
+
+let req_ops = gemm_required_ops(ashape, bshape)
+
+template printStats(name: string) {.dirty.} =
+  echo "\n" & name
+  echo &"Collected {stats.n} samples in {global_stop - global_start:>4.3f} seconds"
+  echo &"Average time: {stats.mean * 1000 :>4.3f} ms"
+  echo &"Stddev  time: {stats.standardDeviationS * 1000 :>4.3f} ms"
+  echo &"Min     time: {stats.min * 1000 :>4.3f} ms"
+  echo &"Max     time: {stats.max * 1000 :>4.3f} ms"
+  echo &"Perf:         {req_ops.float / stats.mean / float(10^9):>4.3f} GFLOP/s"
+
+template bench(name: string, body: untyped) {.dirty.}=
+  block:
+    var stats: RunningStat
+    let global_start = epochTime()
+    for _ in 0 ..< NbSamples:
+      let start = epochTime()
+      body
+      let stop = epochTime()
+      stats.push stop - start
+    let global_stop = epochTime()
+    printStats(name)
+
+proc randomMatrix(size: int): ptr UncheckedArray[float32] =
+  result = cast[ptr UncheckedArray[float32]](allocLarge(size * sizeof(float32)))
+  for i in 0 ..< size:
+    result[i] = rand(1'f32) - 0.5'f32
+
+proc benchHugePages(pages: HugePages) =
+  LaserHugePages = pages
+  # The cached packing buffers are reallocated with the new pages
+  gemm_release_workspace()
+
+  let a = randomMatrix(M*K)
+  let b = randomMatrix(K*N)
+  let c = cast[ptr UncheckedArray[float32]](allocLarge(M*N * sizeof(float32), zero = true))
+
+  bench(&"Laser GEMM with {pages}, row-major A"):
+    gemm_strided(
+      M, N, K,
+      1'f32,  a[0].addr, K, 1,
+              b[0].addr, N, 1,
+      0'f32,  c[0].addr, N, 1
+    )
+
+  bench(&"Laser GEMM with {pages}, transposed A"):
+    gemm_strided(
+      M, N, K,
+      1'f32,  a[0].addr, 1, M,
+              b[0].addr, N, 1,
+      0'f32,  c[0].addr, N, 1
+    )
+
+  deallocLarge(a)
+  deallocLarge(b)
+  deallocLarge(c)
+
+when isMainModule:
+  randomize(42) # For reproducibility
+  echo &"A matrix shape: (M: {M}, K: {K})"
+  echo &"B matrix shape: (K: {K}, N: {N})"
+  echo &"Output shape: (M: {M}, N: {N})"
+  echo &"Required number of operations: {req_ops.float / float(10^6):>9.3f} millions"
+  when defined(linux):
+    try:
+      echo "Transparent huge pages: ",
+        readFile("/sys/kernel/mm/transparent_hugepage/enabled").strip
+    except IOError:
+      echo "Transparent huge pages: not available"
+
+  for pages in HugePages:
+    benchHugePages(pages)
@@ -367,5 +367,7 @@ func cpuinfo_has_x86_sse4_1*(): bool {.cpuinfo.}
 func cpuinfo_has_x86_avx*(): bool {.cpuinfo.}
 func cpuinfo_has_x86_avx2*(): bool {.cpuinfo.}
 func cpuinfo_has_x86_avx512f*(): bool {.cpuinfo.}
+func cpuinfo_has_x86_avx512bw*(): bool {.cpuinfo.}
+func cpuinfo_has_x86_avx512vnni*(): bool {.cpuinfo.}
 
 func cpuinfo_has_x86_fma3*(): bool {.cpuinfo.}
@@ -0,0 +1,122 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+# ############################################################
+#
+#         Half-precision storage types: fp16 and bfloat16
+#
+# ############################################################
+
+# Those types are storage-only: computations are done in float32
+# after widening, for example when packing matrices in GEMM.
+#
+#   - Float16:  IEEE 754 binary16, 1 sign bit, 5 exponent bits, 10 mantissa bits
+#   - BFloat16: the upper half of a float32, 1 sign bit, 8 exponent bits, 7 mantissa bits
+#
+# Narrowing conversions round to nearest, ties to even.
+
+type
+  Float16* = distinct uint16
+  BFloat16* = distinct uint16
+
+func toFloat32*(x: Float16): float32 =
+  ## Widen a fp16 to float32 (exact)
+  let h = uint32(x)
+  let sign = (h and 0x8000'u32) shl 16
+  var exp = (h shr 10) and 0x1F'u32
+  var mant = h and 0x3FF'u32
+
+  var bits: uint32
+  if exp == 0x1F:                       # Inf or NaN
+    bits = sign or 0x7F80_0000'u32 or (mant shl 13)
+  elif exp != 0:                        # Normal
+    bits = sign or ((exp + 112) shl 23) or (mant shl 13)
+  elif mant == 0:                       # ±0
+    bits = sign
+  else:                                 # Subnormal, normalize it
+    exp = 113
+    while (mant and 0x400'u32) == 0:
+      mant = mant shl 1
+      dec exp
+    bits = sign or (exp shl 23) or ((mant and 0x3FF'u32) shl 13)
+  result = cast[float32](bits)
+
+func toFloat16*(x: float32): Float16 =
+  ## Narrow a float32 to fp16
+  let f = cast[uint32](x)
+  let sign = (f shr 16) and 0x8000'u32
+  let exp = int((f shr 23) and 0xFF'u32)
+  var mant = f and 0x7F_FFFF'u32
+
+  if exp == 0xFF:                       # Inf or NaN (quiet)
+    let nan = if mant != 0: 0x200'u32 else: 0'u32
+    return Float16(uint16(sign or 0x7C00'u32 or nan))
+
+  let e = exp - 127 + 15
+  if e >= 0x1F:                         # Overflow to Inf
+    return Float16(uint16(sign or 0x7C00'u32))
+
+  var h: uint32
+  var rem, half: uint32
+  if e <= 0:                            # Subnormal or underflow to ±0
+    if e < -10:
+      return Float16(uint16(sign))
+    mant = mant or 0x80_0000'u32
+    let shift = uint32(14 - e)
+    h = mant shr shift
+    rem = mant and ((1'u32 shl shift) - 1)
+    half = 1'u32 shl (shift - 1)
+  else:
+    h = (uint32(e) shl 10) or (mant shr 13)
+    rem = mant and 0x1FFF'u32
+    half = 0x1000'u32
+
+  # A carry propagates into the exponent, up to Inf.
+  if rem > half or (rem == half and (h and 1) != 0):
+    inc h
+  result = Float16(uint16(sign or h))
+
+func toFloat32*(x: BFloat16): float32 {.inline.} =
+  ## Widen a bfloat16 to float32 (exact)
+  cast[float32](uint32(x) shl 16)
+
+func toBFloat16*(x: float32): BFloat16 =
+  ## Narrow a float32 to bfloat16
+  let f = cast[uint32](x)
+  if (f and 0x7FFF_FFFF'u32) > 0x7F80_0000'u32: # NaN (quiet)
+    return BFloat16(uint16(f shr 16) or 0x40'u16)
+  result = BFloat16(uint16((f + 0x7FFF'u32 + ((f shr 16) and 1)) shr 16))
+
+func `==`*(a, b: Float16): bool {.borrow.}
+func `==`*(a, b: BFloat16): bool {.borrow.}
+
+func `$`*(x: Float16): string = $x.toFloat32
+func `$`*(x: BFloat16): string = $x.toFloat32
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  import math
+
+  block: # fp16
+    for x in [0'f32, -0'f32, 1'f32, -2.5'f32, 65504'f32, 6.103515625e-05'f32, 5.9604644775390625e-08'f32]:
+      doAssert x.toFloat16.toFloat32 == x, $x
+    doAssert 65520'f32.toFloat16.toFloat32 == Inf         # Rounds up to Inf
+    doAssert 1.00048828125'f32.toFloat16.toFloat32 == 1'f32 # Tie to even
+    doAssert 2.98023223876953125e-08'f32.toFloat16.toFloat32 == 0'f32
+    doAssert NaN.float32.toFloat16.toFloat32.classify == fcNaN
+
+  block: # bfloat16
+    for x in [0'f32, 1'f32, -3'f32, 1.5'f32, 3.3895313892515355e38'f32]:
+      doAssert x.toBFloat16.toFloat32 == x, $x
+    doAssert 1.00390625'f32.toBFloat16.toFloat32 == 1'f32   # Tie to even
+    doAssert 1.01171875'f32.toBFloat16.toFloat32 == 1.015625'f32
+    doAssert NaN.float32.toBFloat16.toFloat32.classify == fcNaN
+
+  echo "SUCCESS\n"
@@ -39,6 +39,7 @@ when defined(openmp):
   proc omp_get_thread_num*(): cint {.omp.}
   proc omp_set_nested*(x: cint) {.omp.}
   proc omp_get_nested*(): cint {.omp.}
+  proc omp_get_num_places*(): cint {.omp.}
 
 else:
   template omp_set_num_threads*(x: cint) = discard
@@ -47,6 +48,7 @@ else:
   template omp_get_thread_num*(): cint = 0
   template omp_set_nested*(x: cint) = discard
   template omp_get_nested*(): cint = cint 0
+  template omp_get_num_places*(): cint = cint 0
 
 # TODO tuning for architectures
 # https://github.com/zy97140/omp-benchmark-for-pytorch
@@ -123,6 +125,17 @@ template omp_parallel_if*(condition: bool, body: untyped) =
   {.emit: ["#pragma omp parallel if (",predicate,")"].}
   block: body
 
+template omp_parallel_spread*(num_threads: Natural, body: untyped) =
+  ## Starts an OpenMP parallel section with `num_threads` threads
+  ## spread as far apart as possible over the OMP_PLACES.
+  ##
+  ## For example with `OMP_PLACES=sockets` and one thread per socket
+  ## each thread and its nested parallel sections stay on their own socket.
+  ## Nested parallelism must be enabled with `omp_set_nested(1)`.
+  let nb_threads = cint(num_threads) # Make symbol valid and ensure it's a lvalue
+  {.emit: ["#pragma omp parallel num_threads(",nb_threads,") proc_bind(spread)"].}
+  block: body
+
 template omp_for*(
     index: untyped,
     length: Natural,
@@ -4,12 +4,12 @@
 # This file may not be copied, modified, or distributed except according to those terms.
 
 import photon_jit/photon_types
-export JitFunction, Assembler, call, hash, Label, initLabel, label
+export JitFunction, Assembler, call, entry_point, hash, Label, initLabel, label
 
 import photon_jit/x86_64/x86_64_base
 export
   X86_64, RegX86_64, RegX86_32, RegX86_16, # TODO: RegX86_8, RegX86_8_REX
   gen_x86_64
 
-import photon_jit/x86_64/[x86_64_ops, x86_64_ops_call_stack]
-export x86_64_ops, x86_64_ops_call_stack
+import photon_jit/x86_64/[x86_64_ops, x86_64_ops_call_stack, x86_64_ops_vex]
+export x86_64_ops, x86_64_ops_call_stack, x86_64_ops_vex
@@ -92,6 +92,12 @@ proc call*(fn: JitFunction) {.inline, sideeffect.} =
   let f = cast[proc(){.nimcall.}](fn.adr)
   f()
 
+func entry_point*(fn: JitFunction): pointer {.inline.} =
+  ## Address of the generated code, to be cast to a proc type
+  ## matching the calling convention of the code.
+  ## It is valid as long as `fn` is alive.
+  fn.adr
+
 # ############################################################
 #
 #               Clobbered registers routines
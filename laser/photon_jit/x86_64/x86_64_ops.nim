@@ -64,6 +64,16 @@ op_generator:
     ## Compare 8-bit immediate with byte at memory location stored in adr register
     [adr, imm8]:  [           0x80, modrm(Indirect, opcode_ext = 7, rm = adr[0]), imm8]
 
+  op ADD:
+    ## Add 64-bit register to another register
+    [dst64, src64]: [rex(w=1), 0x01, modrm(Direct, reg = src64, rm = dst64)]
+    ## Add sign-extended 32-bit immediate to a 64-bit register
+    [dst64, imm32]: [rex(w=1), 0x81, modrm(Direct, opcode_ext = 0, rm = dst64)] & imm32
+
+  op TEST:
+    ## Set the zero and sign flags from the bitwise and of 2 registers
+    [dst64, src64]: [rex(w=1), 0x85, modrm(Direct, reg = src64, rm = dst64)]
+
   op JZ:
     ## Jump to label if zero flag is set
     [label]: [0x0F, 0x84]
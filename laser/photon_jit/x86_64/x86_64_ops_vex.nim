@@ -0,0 +1,214 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../photon_types,
+  ./x86_64_base
+
+# ################################################################
+#
+#                 AVX and FMA ops (VEX encoded)
+#
+# ################################################################
+
+# Unlike the ops in "x86_64_ops", registers are runtime parameters:
+# numerical kernels allocate their vector registers in loops
+# depending on runtime shapes, for example an accumulator per row of C.
+#
+# Only the 256-bit (YMM) forms and memory operands [base + disp32]
+# are supported.
+
+type
+  RegYMM* = enum
+    ymm0, ymm1, ymm2, ymm3, ymm4, ymm5, ymm6, ymm7,
+    ymm8, ymm9, ymm10, ymm11, ymm12, ymm13, ymm14, ymm15
+
+  Address* = object
+    ## Memory operand [base + disp]
+    base*: RegX86_64
+    disp*: int32
+
+  VexMap = enum
+    ## Opcode map selected by VEX.mmmmm
+    Map0F   = 0b00001
+    Map0F38 = 0b00010
+    Map0F3A = 0b00011
+
+  VexPrefix = enum
+    ## Legacy prefix implied by VEX.pp
+    NoPrefix = 0b00
+    Pre66    = 0b01
+    PreF3    = 0b10
+    PreF2    = 0b11
+
+func mem*(base: RegX86_64, disp = 0): Address {.inline.} =
+  ## Memory operand [base + disp]
+  Address(base: base, disp: int32 disp)
+
+# VEX 3-byte prefix
+#   C4 | R̄ X̄ B̄ m-mmmm | W v̄v̄v̄v̄ L pp
+#   - R̄, X̄, B̄: inverted REX.R, REX.X, REX.B
+#   - v̄v̄v̄v̄:  inverted extra source register, 1111 if unused
+#   - L:     0 for 128-bit, 1 for 256-bit
+#
+# The 2-byte C5 form is shorter but only valid with map 0F, W = 0, X = B = 0,
+# we always use the 3-byte form.
+
+func vex(
+      reg, rm: int, map: VexMap,
+      w: range[0..1], vvvv: int, L: range[0..1],
+      pp: VexPrefix
+    ): array[3, byte] {.inline.} =
+  result[0] = 0xC4
+  result[1] = byte(
+    ((not (reg shr 3)) and 1) shl 7 or
+    1 shl 6 or # No index register
+    ((not (rm shr 3)) and 1) shl 5 or
+    ord(map)
+  )
+  result[2] = byte(
+    w shl 7 or
+    ((not vvvv) and 0b1111) shl 3 or
+    L shl 2 or
+    ord(pp)
+  )
+
+func modrm_mem(a: var Assembler[X86_64], reg: int, adr: Address) {.inline.} =
+  ## ModRM [base + disp32]
+  let base = ord(adr.base) and 0b111
+  a.code.add byte(ord(Indirect_disp32) shl 6 or (reg and 0b111) shl 3 or base)
+  if base == 0b100:
+    # rsp and r12 in ModRM.rm trigger SIB addressing,
+    # SIB with no index and the same base
+    a.code.add byte 0x24
+  a.code.add cast[array[4, byte]](adr.disp)
+
+func modrm_reg(a: var Assembler[X86_64], reg, rm: int) {.inline.} =
+  a.code.add byte(ord(Direct) shl 6 or (reg and 0b111) shl 3 or (rm and 0b111))
+
+func vex_op(
+      a: var Assembler[X86_64],
+      map: VexMap, w: range[0..1], pp: VexPrefix, opcode: byte,
+      reg: RegYMM, vvvv: RegYMM, rm: RegYMM
+    ) {.inline.} =
+  a.code.add vex(ord(reg), ord(rm), map, w, ord(vvvv), L = 1, pp)
+  a.code.add opcode
+  a.modrm_reg(ord(reg), ord(rm))
+
+func vex_op(
+      a: var Assembler[X86_64],
+      map: VexMap, w: range[0..1], pp: VexPrefix, opcode: byte,
+      reg: RegYMM, vvvv: RegYMM, adr: Address
+    ) {.inline.} =
+  a.code.add vex(ord(reg), ord(adr.base), map, w, ord(vvvv), L = 1, pp)
+  a.code.add opcode
+  a.modrm_mem(ord(reg), adr)
+
+# Unused v̄v̄v̄v̄ must be 1111, i.e. register 0 once inverted
+const NoVvvv = ymm0
+
+# ################################################################
+#
+#                    General purpose registers
+#
+# ################################################################
+
+func mov*(a: var Assembler[X86_64], dst: RegX86_64, src: Address) {.inline.} =
+  ## Load 64-bit from memory into a register
+  a.code.add byte(0x48 or (ord(dst) shr 3) shl 2 or (ord(src.base) shr 3))
+  a.code.add byte 0x8B
+  a.modrm_mem(ord(dst), src)
+
+# ################################################################
+#
+#                        Data movement
+#
+# ################################################################
+
+func vmovups*(a: var Assembler[X86_64], dst: RegYMM, src: Address) {.inline.} =
+  ## Load 8 packed float32 from unaligned memory
+  a.vex_op(Map0F, 0, NoPrefix, 0x10, dst, NoVvvv, src)
+
+func vmovups*(a: var Assembler[X86_64], dst: Address, src: RegYMM) {.inline.} =
+  ## Store 8 packed float32 to unaligned memory
+  a.vex_op(Map0F, 0, NoPrefix, 0x11, src, NoVvvv, dst)
+
+func vmovupd*(a: var Assembler[X86_64], dst: RegYMM, src: Address) {.inline.} =
+  ## Load 4 packed float64 from unaligned memory
+  a.vex_op(Map0F, 0, Pre66, 0x10, dst, NoVvvv, src)
+
+func vmovupd*(a: var Assembler[X86_64], dst: Address, src: RegYMM) {.inline.} =
+  ## Store 4 packed float64 to unaligned memory
+  a.vex_op(Map0F, 0, Pre66, 0x11, src, NoVvvv, dst)
+
+func vmaskmovps*(a: var Assembler[X86_64], dst, mask: RegYMM, src: Address) {.inline.} =
+  ## Load the float32 lanes whose mask sign bit is set, zero the others
+  a.vex_op(Map0F38, 0, Pre66, 0x2C, dst, mask, src)
+
+func vmaskmovps*(a: var Assembler[X86_64], dst: Address, mask, src: RegYMM) {.inline.} =
+  ## Store the float32 lanes whose mask sign bit is set
+  a.vex_op(Map0F38, 0, Pre66, 0x2E, src, mask, dst)
+
+func vmaskmovpd*(a: var Assembler[X86_64], dst, mask: RegYMM, src: Address) {.inline.} =
+  ## Load the float64 lanes whose mask sign bit is set, zero the others
+  a.vex_op(Map0F38, 0, Pre66, 0x2D, dst, mask, src)
+
+func vmaskmovpd*(a: var Assembler[X86_64], dst: Address, mask, src: RegYMM) {.inline.} =
+  ## Store the float64 lanes whose mask sign bit is set
+  a.vex_op(Map0F38, 0, Pre66, 0x2F, src, mask, dst)
+
+func vbroadcastss*(a: var Assembler[X86_64], dst: RegYMM, src: Address) {.inline.} =
+  ## Broadcast a float32 from memory to all lanes
+  a.vex_op(Map0F38, 0, Pre66, 0x18, dst, NoVvvv, src)
+
+func vbroadcastsd*(a: var Assembler[X86_64], dst: RegYMM, src: Address) {.inline.} =
+  ## Broadcast a float64 from memory to all lanes
+  a.vex_op(Map0F38, 0, Pre66, 0x19, dst, NoVvvv, src)
+
+# ################################################################
+#
+#                          Arithmetic
+#
+# ################################################################
+
+func vxorps*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst = src1 xor src2, vxorps with the same register zeroes it
+  a.vex_op(Map0F, 0, NoPrefix, 0x57, dst, src1, src2)
+
+func vaddps*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst = src1 + src2 for 8 float32
+  a.vex_op(Map0F, 0, NoPrefix, 0x58, dst, src1, src2)
+
+func vaddpd*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst = src1 + src2 for 4 float64
+  a.vex_op(Map0F, 0, Pre66, 0x58, dst, src1, src2)
+
+func vmulps*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst = src1 * src2 for 8 float32
+  a.vex_op(Map0F, 0, NoPrefix, 0x59, dst, src1, src2)
+
+func vmulpd*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst = src1 * src2 for 4 float64
+  a.vex_op(Map0F, 0, Pre66, 0x59, dst, src1, src2)
+
+func vfmadd231ps*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst += src1 * src2 for 8 float32 (FMA3)
+  a.vex_op(Map0F38, 0, Pre66, 0xB8, dst, src1, src2)
+
+func vfmadd231pd*(a: var Assembler[X86_64], dst, src1, src2: RegYMM) {.inline.} =
+  ## dst += src1 * src2 for 4 float64 (FMA3)
+  a.vex_op(Map0F38, 1, Pre66, 0xB8, dst, src1, src2)
+
+# ################################################################
+#
+#                            State
+#
+# ################################################################
+
+func vzeroupper*(a: var Assembler[X86_64]) {.inline.} =
+  ## Zero the upper 128 bits of all YMM registers.
+  ## Must be executed before returning to SSE code
+  ## to avoid AVX-SSE transition penalties.
+  a.code.add [byte 0xC5, 0xF8, 0x77]
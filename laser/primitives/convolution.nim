@@ -0,0 +1,172 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ./matrix_multiplication/gemm
+
+# ############################################################
+#
+#         2D convolution with im2col fused in GEMM
+#
+# ############################################################
+
+# The convolution of each image of a NCHW batch is the matrix multiplication
+#   output[C_out, outH*outW] = kernel[C_out, C_in*kH*kW] * im2col[C_in*kH*kW, outH*outW]
+#
+# The im2col matrix is kH*kW times larger than the image
+# (9x for a 3x3 kernel with stride 1) and is not materialized:
+# the packing of B of the GEMM reads the sliding windows from the image
+# (see Im2ColView and gemm_im2col).
+# 1x1 convolutions with stride 1 and no padding are a plain GEMM on the image.
+#
+# The bias and activation are fused in the GEMM epilogue.
+# Dilation and groups are not supported.
+
+type
+  TensorShape* = tuple[n, c, h, w: int]          # BatchSize, Channel/Color, Height, Width
+  KernelShape* = tuple[c_out, c_in, kH, kW: int] # Channel out, Channel in, kernel height, kernel width
+  Padding* = tuple[h, w: int]
+  Strides* = tuple[h, w: int]
+
+func conv2d_out_shape*(
+      ishape: TensorShape,
+      kshape: KernelShape,
+      padding: Padding,
+      strides: Strides
+    ): TensorShape =
+  ## Shape of the output of a convolution without dilation
+  result.n = ishape.n
+  result.c = kshape.c_out
+  result.h = 1 + (ishape.h + 2*padding.h - kshape.kH) div strides.h
+  result.w = 1 + (ishape.w + 2*padding.w - kshape.kW) div strides.w
+
+proc conv2d*[T: SomeFloat](
+      output: ptr T,
+      input: ptr T,
+      ishape: TensorShape,
+      kernel: ptr T,
+      kshape: KernelShape,
+      padding: Padding = (0, 0),
+      strides: Strides = (1, 1),
+      bias: ptr T = nil,
+      activation = actNone
+    ) =
+  ## Compute output = activation(conv2d(input, kernel) + bias)
+  ## with:
+  ##   - input [N, C_in, H, W] contiguous
+  ##   - kernel [C_out, C_in, kH, kW] contiguous
+  ##   - bias [C_out] or nil
+  ##   - output [N, C_out, outH, outW] contiguous, see conv2d_out_shape
+  doAssert ishape.c == kshape.c_in, "The input and kernel channels must match"
+  doAssert strides.h > 0 and strides.w > 0, "Strides must be positive"
+  doAssert padding.h >= 0 and padding.w >= 0, "Padding must not be negative"
+  doAssert ishape.h + 2*padding.h >= kshape.kH and ishape.w + 2*padding.w >= kshape.kW,
+    "The kernel is larger than the padded input"
+
+  let oshape = conv2d_out_shape(ishape, kshape, padding, strides)
+  let
+    M = kshape.c_out
+    N = oshape.h * oshape.w
+    K = kshape.c_in * kshape.kH * kshape.kW
+    image_size = ishape.c * ishape.h * ishape.w
+    is1x1 = kshape.kH == 1 and kshape.kW == 1 and
+            strides.h == 1 and strides.w == 1 and
+            padding.h == 0 and padding.w == 0
+
+  let epilogue = if bias.isNil: activationEpilogue[T](activation)
+                 else: rowBiasEpilogue(bias, activation)
+
+  let pinput = cast[ptr UncheckedArray[T]](input)
+  let poutput = cast[ptr UncheckedArray[T]](output)
+
+  for n in 0 ..< ishape.n:
+    let image = pinput[n * image_size].addr
+    let res = poutput[n * M * N].addr
+    if is1x1:
+      # The image is the [C_in, H*W] B matrix
+      gemm_strided(
+        M, N, K,
+        1.T, kernel, K, 1,
+             image, N, 1,
+        0.T, res, N, 1,
+        epilogue
+      )
+    else:
+      let im2col = image.toIm2ColView(
+        ishape.h, ishape.w,
+        kshape.kH, kshape.kW,
+        padding.h, padding.w,
+        strides.h, strides.w
+      )
+      gemm_im2col(
+        M, N, K,
+        1.T, kernel, K, 1,
+             im2col,
+        0.T, res, N, 1,
+        epilogue
+      )
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  proc conv2d_naive[T](
+        output: var seq[T], input, kernel, bias: seq[T],
+        ishape: TensorShape, kshape: KernelShape,
+        padding: Padding, strides: Strides) =
+    let oshape = conv2d_out_shape(ishape, kshape, padding, strides)
+    output.setLen oshape.n * oshape.c * oshape.h * oshape.w
+    for n in 0 ..< ishape.n:
+      for co in 0 ..< kshape.c_out:
+        for oh in 0 ..< oshape.h:
+          for ow in 0 ..< oshape.w:
+            var acc = bias[co]
+            for ci in 0 ..< ishape.c:
+              for kr in 0 ..< kshape.kH:
+                for kc in 0 ..< kshape.kW:
+                  let ih = oh * strides.h - padding.h + kr
+                  let iw = ow * strides.w - padding.w + kc
+                  if ih in 0 ..< ishape.h and iw in 0 ..< ishape.w:
+                    acc += input[((n*ishape.c + ci)*ishape.h + ih)*ishape.w + iw] *
+                           kernel[((co*kshape.c_in + ci)*kshape.kH + kr)*kshape.kW + kc]
+            output[((n*oshape.c + co)*oshape.h + oh)*oshape.w + ow] = max(acc, 0)
+
+  template check(ishape: TensorShape, kshape: KernelShape, padding: Padding, strides: Strides) =
+    block:
+      echo "  input ", ishape, ", kernel ", kshape, ", padding ", padding, ", strides ", strides
+      var input = newSeq[float32](ishape.n * ishape.c * ishape.h * ishape.w)
+      var kernel = newSeq[float32](kshape.c_out * kshape.c_in * kshape.kH * kshape.kW)
+      var bias = newSeq[float32](kshape.c_out)
+      for i in 0 ..< input.len:
+        input[i] = float32((i * 7) mod 11) - 5
+      for i in 0 ..< kernel.len:
+        kernel[i] = float32((i * 5) mod 7) - 3
+      for i in 0 ..< bias.len:
+        bias[i] = float32(i mod 3) - 1
+
+      var expected: seq[float32]
+      conv2d_naive(expected, input, kernel, bias, ishape, kshape, padding, strides)
+
+      var output = newSeq[float32](expected.len)
+      conv2d(
+        output[0].addr,
+        input[0].addr, ishape,
+        kernel[0].addr, kshape,
+        padding, strides,
+        bias[0].addr, actRelu
+      )
+      doAssert output == expected
+
+  block:
+    echo "\n## conv2d with im2col fused in the packing of B"
+    check((2, 3, 17, 19), (8, 3, 3, 3), (1, 1), (1, 1))   # 3x3 "same"
+    check((1, 16, 28, 28), (32, 16, 3, 3), (1, 1), (2, 2)) # 3x3 stride 2
+    check((1, 4, 15, 13), (24, 4, 5, 3), (0, 2), (1, 2))   # rectangular kernel
+    check((2, 32, 7, 7), (64, 32, 1, 1), (0, 0), (1, 1))   # 1x1, plain GEMM
+    check((1, 8, 20, 20), (16, 8, 7, 7), (3, 3), (2, 2))   # 7x7 stem
+    echo "SUCCESS\n"
@@ -4,9 +4,24 @@
 # This file may not be copied, modified, or distributed except according to those terms.
 
 import
-  ../../cpuinfo, ../../compiler_optim_hints, ../../openmp,
+  ../../cpuinfo, ../../compiler_optim_hints, ../../openmp, ../../float16,
+  ../../private/[align_unroller, memory],
   ./gemm_tiling, ./gemm_utils, ./gemm_packing,
-  ./gemm_ukernel_dispatch
+  ./gemm_ukernel_dispatch, ./gemm_ukernel_generic, ./gemm_ukernel_jit,
+  ./gemm_small, ./gemm_gemv, ./gemm_instrumentation
+
+export
+  Epilogue, Activation,
+  actNone, actRelu, actTanh, actSigmoid,
+  activationEpilogue, rowBiasEpilogue, colBiasEpilogue,
+  Prologue, PrologueKind,
+  proNone, proScale, proReluGrad, proTanhGrad, proSigmoidGrad, proCustom,
+  scalePrologue, reluGradPrologue, tanhGradPrologue, sigmoidGradPrologue, customPrologue,
+  Float16, BFloat16, toFloat32, toFloat16, toBFloat16,
+  UInt4, Im2ColView, toIm2ColView
+
+export gemm_instrumentation
+export ukernel_available, gemm_cpu_simd, dispatch_cpu_simd
 
 withCompilerOptimHints()
 
@@ -20,13 +35,26 @@ withCompilerOptimHints()
 #  - Arbitrary stride support
 #  - Efficient implementation (within 90% of the speed of OpenBLAS, more tuning to expect)
 #  - Parallel and scale linearly with number of cores
+#  - Socket-level partitioning of N on multi-socket systems (see gemm_impl_sockets)
+#  - Split-K parallelization when M and N are small and K is large (see gemm_impl_splitk)
+#  - Packing of the next panel of B overlapped with compute on many-core CPUs (see pack_B_threads)
+#  - Wide and tall microkernels for C with few rows or few columns (see x86_ukernel_shape)
+#  - Small matrix multiply optimisation (no packing, see gemm_small)
+#  - Matrix-vector multiply for M = 1 or N = 1 (see gemm_gemv)
+#  - Batched matrix multiplication (see gemm_batched)
+#  - Grouped matrix multiplication with a different M per group (see gemm_grouped)
+#  - fp16 and bfloat16 storage of A and B with float32 accumulation
+#  - int8 and 4-bit weights with per-group scales and zero points, dequantized while packing B
+#  - im2col fused in the packing of B for convolutions (see gemm_im2col)
+#  - Persisted autotuning of the microkernel, blocking and parallelization threshold (see gemm_autotune)
+#  - JIT-generated microkernels for the edge tiles with -d:GEMM_JIT (see gemm_ukernel_jit)
+#  - Bitwise reproducible results independent of the thread count (see gemm_set_deterministic)
+#  - Per-thread cycles of packing, microkernels and barriers with -d:GEMM_INSTRUMENT (see gemm_instrumentation)
 #
 # Future
 #  - Implementation extended to integers
 #  - ARM Neon optimisation
-#  - Small matrix multiply optimisation
 #  - Pre-packing to when computing using the same matrix
-#  - batched matrix multiplication
 
 # Terminology
 #   - M, Matrix: Both dimension are large or unknown
@@ -49,10 +77,15 @@ proc gebp_mkernel*[T; ukernel: static MicroKernel](
       mc, nc, kc: int,
       alpha: T, packA, packB: ptr UncheckedArray[T],
       beta: T,
-      mcncC: MatrixView[T]
+      mcncC: MatrixView[T],
+      epilogue: Epilogue[T],
+      jit = JitEdgeKernels[T]()
     ) =
   ## Macro kernel, multiply:
   ##  - a block A[mc, kc] * panel B[kc, N]
+  ##
+  ## `epilogue` must be a no-op except on the last pc iteration
+  ## `jit` are the kernels of the edge tiles if compiled with -d:GEMM_JIT
 
   # Since nr is small this the the good place to parallelize
   # See: Anatomy of High-Performance Many-Threaded Matrix Multiplication
@@ -79,6 +112,7 @@ proc gebp_mkernel*[T; ukernel: static MicroKernel](
     for ir in countup(0, mc-1, MR):
       let mr = min(mc - ir, MR)
       let c_aux = mcncC.stride(ir, jr)               # C[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr]
+      let epi_aux = epilogue.stride(ir, jr)          # bias[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr]
 
       let upanel_b = packB + jr*kc
       prefetch(upanel_b, Read, ModerateTemporalLocality)
@@ -87,18 +121,32 @@ proc gebp_mkernel*[T; ukernel: static MicroKernel](
       
       if nr == NR and mr == MR:
         # General case
-        gebb_ukernel[T, ukernel](                    # GEBB microkernel + epilogue
-                kc,                                  #   C[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr] =
-          alpha, upanel_a, upanel_b,                 #    αA[ic+ir:ic+ir+mr, pc:pc+kc] *
-          beta, c_aux                                #     B[pc:pc+kc, jc+jr:jc+jr+nr] +
-        )                                            #    βC[ic:ic+mc, jc:jc+nc]
+        gemm_timed(gpUKernel):
+          gebb_ukernel[T, ukernel](                  # GEBB microkernel + epilogue
+                  kc,                                #   C[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr] =
+            alpha, upanel_a, upanel_b,               #    αA[ic+ir:ic+ir+mr, pc:pc+kc] *
+            beta, c_aux,                             #     B[pc:pc+kc, jc+jr:jc+jr+nr] +
+            epi_aux                                  #    βC[ic:ic+mc, jc:jc+nc]
+          )
       else:
         # Matrix edges
-        gebb_ukernel_edge[T, ukernel](               # GEBB microkernel + epilogue
-          mr, nr, kc,                                #   C[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr] =
-          alpha, upanel_a, upanel_b,                 #    αA[ic+ir:ic+ir+mr, pc:pc+kc] *
-          beta, c_aux                                #     B[pc:pc+kc, jc+jr:jc+jr+nr] +
-        )                                            #    βC[ic:ic+mc, jc:jc+nc]
+        gemm_timed(gpUKernelEdge):
+          when defined(GEMM_JIT):
+            let jitted = jit.gebb_ukernel_edge_jit(
+                mr, nr, kc,
+                alpha, upanel_a, upanel_b,
+                beta, c_aux,
+                epi_aux
+              )
+          else:
+            const jitted = false
+          if not jitted:
+            gebb_ukernel_edge[T, ukernel](           # GEBB microkernel + epilogue
+              mr, nr, kc,                            #   C[ic+ir:ic+ir+mr, jc+jr:jc+jr+nr] =
+              alpha, upanel_a, upanel_b,             #    αA[ic+ir:ic+ir+mr, pc:pc+kc] *
+              beta, c_aux,                           #     B[pc:pc+kc, jc+jr:jc+jr+nr] +
+              epi_aux                                #    βC[ic:ic+mc, jc:jc+nc]
+            )
 
 # ###########################################################################################
 #
@@ -106,30 +154,71 @@ proc gebp_mkernel*[T; ukernel: static MicroKernel](
 #
 # ###########################################################################################
 
-proc gemm_impl[T; ukernel: static MicroKernel](
+# Packing ~B is memory-bound and is done by all threads between two ic loops,
+# with a barrier before and after: this is a serial bubble per (jc, pc) iteration.
+# With many cores, the time of the ic loop decreases with the number of threads
+# but packing does not scale as well and the bubble becomes a noticeable part of the GEMM.
+#
+# When there are enough threads and (jc, pc) iterations, a second panel of ~B
+# is allocated and a few threads pack the next panel while the others compute.
+
+const
+  PackBPipelineMinThreads = 4
+    ## Minimum number of threads to pipeline the packing of ~B
+  PackBFlopsPerElement = 32
+    ## Flops a core computes in the time it packs an element of ~B,
+    ## about 2 FMA of 8 lanes per cycle and 1 element per cycle.
+
+proc pack_B_pipelined(
+      ukernel: static MicroKernel,
+      T: typedesc,
+      M, N, K, nb_threads: int
+    ): bool =
+  ## Returns true if gemm_impl with `nb_threads` threads
+  ## can pipeline the packing of ~B, which requires a second panel.
+  when defined(openmp) and not defined(GEMM_NO_PACK_PIPELINE):
+    let PT = ukernel.parallel_threshold(T)
+    if nb_threads < PackBPipelineMinThreads or M*N*K <= PT*PT*PT:
+      return false
+    let (_, nc, kc) = ukernel.partitionMNK(T, M, N, K)
+    result = get_num_tiles(N, nc) * get_num_tiles(K, kc) >= 2
+
+proc pack_B_threads(M, nb_threads: int): int =
+  ## Number of threads that pack the next panel of ~B,
+  ## 0 if packing is not pipelined.
+  ##
+  ## Packing a panel [kc, nc] costs about kc*nc*PackBFlopsPerElement flops of a core
+  ## and the ic loop 2*M*kc*nc flops, the threads are split in that ratio.
+  if nb_threads < PackBPipelineMinThreads:
+    return 0
+  result = get_num_tiles(nb_threads * PackBFlopsPerElement, 2*M + PackBFlopsPerElement)
+  result = min(result, nb_threads div 2)
+
+proc gemm_impl*[T; ukernel: static MicroKernel; TA, TB](
       M, N, K: int,
-      alpha: T, vA: MatrixView[T], vB: MatrixView[T],
+      alpha: T, vA: MatrixView[TA], vB: MatrixView[TB] or QuantizedMatrixView[TB] or Im2ColView[TB],
       beta: T, vC: MatrixView[T],
-      tiles: Tiles[T]
+      tiles: Tiles[T],
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T],
+      jit = JitEdgeKernels[T]()
     ) =
+  ## A and B are stored as TA and TB and packed as T.
+  ## They differ from T only for half-precision storage
+  ## and for quantized B (see gemm_packing).
+  ## B may also be the im2col matrix of an image for convolutions.
+  ##
+  ## `jit` must be created by the calling thread, see gemm_ukernel_jit
 
   # ####################################################################
   # Loop partitioning
   #   - We parallelize around ic loop (partitions M dimension)
   #   - and jr loop (partitions N dimension)
   #
-  # Currently the first loop nc = N is not partitioned.
-  # According to BLIS paper, it should be partitioned at socket level.
-  # This can be done with OpenMP using
-  #
-  #   omp_set_nested(1);  
-  #   n_sockets = omp_get_num_places();
-  #   #pragma omp parallel num_threads(n_sockets) proc_bind(spread)
-  #   {
-  #       n_procs = omp_get_place_num_procs(omp_get_num_places());
-  #       #pragma omp parallel num_threads(n_procs) proc_bind(close)
-  #       doStuff();
-  #   }
+  # The first loop jc is partitioned so that the packed panel of B
+  # fits in the L3 cache but it is not parallelized here.
+  # According to BLIS paper, it should be partitioned at socket level,
+  # this is done by gemm_impl_sockets which calls gemm_impl once per socket.
 
   # Hyperthreading will pollute the L1, L2 caches and the TLB
   # as we intentionally choose parameters so that about
@@ -137,43 +226,408 @@ proc gemm_impl[T; ukernel: static MicroKernel](
   # But somehow fixing num_threads to anything other than my number of logical threads
   # kills my perf (and even also OpenBLAS when it's run at the same time)
 
-  const PT = ukernel.extract_pt
+  const NR = ukernel.nr
+  let PT = ukernel.parallel_threshold(T)
   let parallelize = M*N*K > PT*PT*PT
   # let nb_threads = cpuinfo_get_cores_count() # get physical cores
 
-  # ####################################################################
-  # 1. for jc = 0,...,n−1 in steps of nc
-  let nc = N                                          # B[0:K, jc:jc+nc]
-                                                      # C[0:M, jc:jc+nc]
-  # ######################################
-  # 2.   for pc = 0,...,k−1 in steps of kc
-  for pc in countup(0, K-1, tiles.kc):
-    prefetch(tiles.b, Write, LowTemporalLocality)
-    let kc = min(K - pc, tiles.kc) # Deal with edges  # A[0:M, pc:pc+kc]
-
-    let kcncB = vB.stride(pc, 0)                      # B[pc:pc+kc, jc:jc+nc]
-    pack_B_kc_nc[T, ukernel](tiles.b, kc, nc, kcncB)  # PackB panel [kc, nc] (nc is large or unknown)
+  # A single parallel region spans the jc and pc loops.
+  # All threads go through them, B is packed cooperatively
+  # then each thread packs A and runs the macrokernel for its ic blocks.
+  # Barriers:
+  #   - after packing B, so that ~B is complete before use,
+  #   - after the ic loop, so that ~B is not repacked while in use.
+  # Compared to a parallel region per pc iteration this avoids repeated fork/join
+  # and nested parallel regions when packing B.
+  #
+  # If Tiles has a second panel of ~B, packing is pipelined instead (see pack_B_threads).
+
+  template gebp_ic(icb, jc, nc, pc, kc: int, packB: ptr UncheckedArray[T]) =
+    # ####################################
+    # 3. for ic = 0,...,m−1 in steps of mc
+    let packA = tiles.a + icb * tiles.upanelA_size
+    prefetch(packA, Write, LowTemporalLocality)
+    let ic = icb * tiles.mc
+    let mc = min(M-ic, tiles.mc)                          # C[ic:ic+mc, jc:jc+nc]
+
+    let mckcA = vA.stride(ic, pc)                         # A[ic:ic+mc, pc:pc+kc]
+    gemm_timed(gpPackA):
+      pack_A_mc_kc[T, ukernel](                           # PackA block [mc, kc]
+        packA, mc, kc, mckcA,
+        prologueA.stride(ic, pc)
+      )
 
     # First time writing to C, we scale it, otherwise accumulate
-    let beta = if pc == 0: beta else: 1.T
-
-    omp_parallel_if(parallelize):
-      # ####################################
-      # 3. for ic = 0,...,m−1 in steps of mc
-      omp_for(icb, tiles.ic_num_tasks, use_simd=false, nowait=true):
-        let packA = tiles.a + icb * tiles.upanelA_size
-        prefetch(packA, Write, LowTemporalLocality)
-        let ic = icb * tiles.mc
-        let mc = min(M-ic, tiles.mc)                    # C[ic:ic+mc, jc:jc+nc]
-
-        let mckcA = vA.stride(ic, pc)                   # A[ic:ic+mc, pc:pc+kc]
-        pack_A_mc_kc[T, ukernel](packA, mc, kc, mckcA)  # PackA block [mc, kc]
-
-        gebp_mkernel[T, ukernel](                       # GEBP macrokernel:
-            mc, nc, kc,                                 #   C[ic:ic+mc, jc:jc+nc] =
-            alpha, packA, tiles.b,                      #    αA[ic:ic+mc, pc:pc+kc] * B[pc:pc+kc, jc:jc+nc] +   
-            beta, vC.stride(ic, 0)                      #    βC[ic:ic+mc, jc:jc+nc]                                     
-          )
+    let beta_ic = if pc == 0: beta else: 1.T
+    # Last time writing to C, we apply the fused bias and activation
+    let epi_ic = if pc + kc == K: epilogue.stride(ic, jc)
+                 else: Epilogue[T]()
+
+    gebp_mkernel[T, ukernel](                             # GEBP macrokernel:
+        mc, nc, kc,                                       #   C[ic:ic+mc, jc:jc+nc] =
+        alpha, packA, packB,                              #    αA[ic:ic+mc, pc:pc+kc] * B[pc:pc+kc, jc:jc+nc] +
+        beta_ic, vC.stride(ic, jc),                       #    βC[ic:ic+mc, jc:jc+nc]
+        epi_ic,                                           #   then C = activation(C + bias)
+        jit
+      )
+
+  omp_parallel_if(parallelize):
+    let nb_packers = if tiles.b_next.isNil: 0
+                     else: pack_B_threads(M, omp_get_num_threads().int)
+
+    if nb_packers == 0:
+      # ####################################################################
+      # 1. for jc = 0,...,n−1 in steps of nc
+      for jc in countup(0, N-1, tiles.nc):
+        let nc = min(N - jc, tiles.nc)                    # B[0:K, jc:jc+nc]
+                                                          # C[0:M, jc:jc+nc]
+        # ######################################
+        # 2.   for pc = 0,...,k−1 in steps of kc
+        for pc in countup(0, K-1, tiles.kc):
+          prefetch(tiles.b, Write, LowTemporalLocality)
+          let kc = min(K - pc, tiles.kc) # Deal with edges  # A[0:M, pc:pc+kc]
+
+          let kcncB = vB.stride(pc, jc)                   # B[pc:pc+kc, jc:jc+nc]
+          gemm_timed(gpPackB):
+            pack_B_kc_nc[T, ukernel](                     # PackB panel [kc, nc] (nc is large or unknown)
+              tiles.b, kc, nc, kcncB,                     #   shared by all threads
+              prologueB.stride(pc, jc)
+            )
+          gemm_timed(gpBarrier):
+            omp_barrier()
+
+          omp_for(icb, tiles.ic_num_tasks, use_simd=false, nowait=true):
+            gebp_ic(icb, jc, nc, pc, kc, tiles.b)
+          gemm_timed(gpBarrier):
+            omp_barrier()
+    else:
+      # ####################################################################
+      # Software-pipelined packing of ~B
+      #   The (jc, pc) iterations are flattened into steps.
+      #   During step s, `nb_packers` threads pack the panel of step s+1
+      #   while the others run the ic loop on the panel of step s.
+      #   Panels alternate between tiles.b and tiles.b_next
+      #   and the barrier at the end of each step swaps their roles.
+      let tid = omp_get_thread_num().int
+      let nb_threads = omp_get_num_threads().int
+      let pc_num_iter = get_num_tiles(K, tiles.kc)
+      let nb_steps = get_num_tiles(N, tiles.nc) * pc_num_iter
+
+      template step_panel(step: int): ptr UncheckedArray[T] =
+        if (step and 1) == 0: tiles.b else: tiles.b_next
+
+      template pack_step(step, packer, nb_packers: int) =
+        # Each packer packs a contiguous range of micropanels of ~B
+        let jc = (step div pc_num_iter) * tiles.nc
+        let pc = (step mod pc_num_iter) * tiles.kc
+        let nc = min(N - jc, tiles.nc)
+        let kc = min(K - pc, tiles.kc)
+        let nb_upanels = get_num_tiles(nc, NR)
+        let j0 = (nb_upanels * packer div nb_packers) * NR
+        let j1 = min(nc, (nb_upanels * (packer+1) div nb_packers) * NR)
+        if j0 < j1:
+          let packB = step_panel(step) + j0*kc
+          prefetch(packB, Write, LowTemporalLocality)
+          # Serial packing, the other threads of the region are busy
+          gemm_timed(gpPackB):
+            pack_B_kc_nc_serial[T, ukernel](
+              packB, kc, j1 - j0, vB.stride(pc, jc+j0),
+              prologueB.stride(pc, jc+j0)
+            )
+
+      # The first panel is packed by all threads
+      pack_step(0, tid, nb_threads)
+      gemm_timed(gpBarrier):
+        omp_barrier()
+
+      for step in 0 ..< nb_steps:
+        # There is nothing left to pack on the last step
+        let nb_workers = if step == nb_steps-1: nb_threads
+                         else: nb_threads - nb_packers
+        if tid >= nb_workers:
+          pack_step(step+1, tid - nb_workers, nb_packers)
+        else:
+          let jc = (step div pc_num_iter) * tiles.nc
+          let pc = (step mod pc_num_iter) * tiles.kc
+          let nc = min(N - jc, tiles.nc)
+          let kc = min(K - pc, tiles.kc)
+          for icb in countup(tid, tiles.ic_num_tasks-1, nb_workers):
+            gebp_ic(icb, jc, nc, pc, kc, step_panel(step))
+        gemm_timed(gpBarrier):
+          omp_barrier()
+
+proc socket_partition(
+      ukernel: static MicroKernel,
+      T: typedesc,
+      M, N, K: int
+    ): tuple[nb_sockets, socket_nc: int] =
+  ## Returns the number of sockets that the N dimension is split on
+  ## and the number of columns per socket, a multiple of NR.
+  ## nb_sockets is 1 if the GEMM is not partitioned.
+  const NR = ukernel.nr
+  let PT = ukernel.parallel_threshold(T)
+
+  let nb_sockets = cpuinfo_get_packages_count().int
+  let nb_threads = omp_get_max_threads().int
+
+  if not defined(openmp) or
+      nb_sockets <= 1 or omp_get_num_places() < nb_sockets or
+      nb_threads < nb_sockets or
+      N < nb_sockets * NR or M*N*K <= nb_sockets*PT*PT*PT:
+    return (1, N)
+
+  result = (nb_sockets, round_step_up(get_num_tiles(N, nb_sockets), NR))
+
+# ############################################################
+#
+#                    Split-K parallel GEMM
+#
+# ############################################################
+
+# When M and N are small and K is large, for example weight gradients
+# dW = Xᵀ * dY over a large batch, the ic and jr loops have less work
+# than there are threads. The K dimension is then split across threads:
+#   - each thread computes the partial product of its K slice
+#     into a private accumulator, packing its own A and B,
+#   - the accumulators are summed into C by all threads
+#     and the epilogue is applied at that time.
+
+const
+  SplitKMinDepth = 256
+    ## Minimum depth of a K slice so that the reduction of its M*N partial sums
+    ## stays small compared to its M*N*K multiply-adds.
+  SplitKTasksPerThread = 4
+    ## Split K if there are less MR*NR tiles of C than this per thread
+  SplitKReduceTile = 256
+    ## Columns of C reduced at once
+
+proc splitk_partition(
+      ukernel: static MicroKernel,
+      T: typedesc,
+      M, N, K: int
+    ): tuple[nb_splits, split_k: int] =
+  ## Returns the number of K slices and their depth.
+  ## nb_splits is 1 if the GEMM is not split.
+  const
+    MR = ukernel.mr
+    NR = ukernel.nr
+
+  let PT = ukernel.parallel_threshold(T)
+  let nb_threads = omp_get_max_threads().int
+
+  # The summation order of the slices depends on the number of threads
+  if not defined(openmp) or gemm_deterministic(T).enabled or
+      nb_threads <= 1 or M*N*K <= PT*PT*PT or
+      get_num_tiles(M, MR) * get_num_tiles(N, NR) >= SplitKTasksPerThread * nb_threads:
+    return (1, K)
+
+  let nb_splits = min(nb_threads, K div SplitKMinDepth)
+  if nb_splits <= 1:
+    return (1, K)
+
+  let split_k = get_num_tiles(K, nb_splits)
+  result = (get_num_tiles(K, split_k), split_k)
+
+proc splitk_mem_required(
+      ukernel: static MicroKernel,
+      T: typedesc,
+      M, N, split_k: int
+    ): int =
+  ## Workspace of one K slice: packing buffers and private accumulator
+  result = ukernel.tiles_mem_required(T, M, N, split_k) +
+    round_step_up(T.sizeof * M * N, LASER_MEM_ALIGN)
+
+proc gemm_impl_splitk[T; ukernel: static MicroKernel; TA, TB](
+      M, N, K: int,
+      alpha: T, vA: MatrixView[TA], vB: MatrixView[TB] or QuantizedMatrixView[TB] or Im2ColView[TB],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T],
+      nb_splits, split_k: int,
+      workspace: pointer,
+      jit: JitEdgeKernels[T]
+    ) =
+  ## Split-K GEMM: C = activation(αA*B + βC + bias)
+  ## with the K dimension split in `nb_splits` slices of `split_k`.
+  ##
+  ## `workspace` must hold `nb_splits * splitk_mem_required(ukernel, T, M, N, split_k)` bytes.
+  let split_mem = ukernel.splitk_mem_required(T, M, N, split_k)
+  let tiles_mem = ukernel.tiles_mem_required(T, M, N, split_k)
+
+  template accumulator(s: int): ptr UncheckedArray[T] =
+    cast[ptr UncheckedArray[T]](
+      cast[ByteAddress](workspace) +% s * split_mem +% tiles_mem
+    )
+
+  # Each slice is computed by a single thread,
+  # the parallel regions of gemm_impl must not be nested.
+  let nested = omp_get_nested()
+  omp_set_nested(0)
+
+  let nb_col_tiles = get_num_tiles(N, SplitKReduceTile)
+
+  omp_parallel_if(true):
+    # 1. Partial products, barrier at the end
+    omp_for(s, nb_splits, use_simd=false, nowait=false):
+      let pc = s * split_k
+      let kc = min(K - pc, split_k)                       # A[0:M, pc:pc+kc], B[pc:pc+kc, 0:N]
+      let tiles = ukernel.initTiles(
+        T, M, N, kc,
+        cast[pointer](cast[ByteAddress](workspace) +% s * split_mem)
+      )
+      gemm_impl[T, ukernel, TA, TB](
+        M, N, kc,
+        alpha, vA.stride(0, pc), vB.stride(pc, 0),
+        0.T, accumulator(s).toMatrixView(N, 1),
+        tiles, Epilogue[T](),
+        prologueA.stride(0, pc), prologueB.stride(pc, 0),
+        jit
+      )
+
+    # 2. Reduction of the accumulators into C
+    omp_for(t, M * nb_col_tiles, use_simd=false, nowait=true):
+      let i = t div nb_col_tiles
+      let j0 = (t mod nb_col_tiles) * SplitKReduceTile
+      let nc = min(N - j0, SplitKReduceTile)
+      for j in j0 ..< j0 + nc:
+        var sum = accumulator(0)[i*N + j]
+        for s in 1 ..< nb_splits:
+          sum += accumulator(s)[i*N + j]
+        if beta == 0.T:
+          vC[i, j] = sum
+        else:
+          vC[i, j] = beta * vC[i, j] + sum
+      if not epilogue.isNoOp:
+        gebb_ukernel_fused_epilogue(
+          vC.stride(i, j0), 1, nc,
+          epilogue.stride(i, j0)
+        )
+
+  omp_set_nested(nested)
+
+# ############################################################
+#
+#                 Top-level partitioning
+#
+# ############################################################
+
+proc gemm_mem_required_impl*(
+      ukernel: static MicroKernel,
+      T: typedesc,
+      M, N, K: int
+    ): int =
+  let (nb_splits, split_k) = ukernel.splitk_partition(T, M, N, K)
+  if nb_splits > 1:
+    return nb_splits * ukernel.splitk_mem_required(T, M, N, split_k)
+
+  let (nb_sockets, socket_nc) = ukernel.socket_partition(T, M, N, K)
+  let threads_per_socket = omp_get_max_threads().int div nb_sockets
+  let double_buffer_B = ukernel.pack_B_pipelined(T, M, socket_nc, K, threads_per_socket)
+  result = nb_sockets * ukernel.tiles_mem_required(T, M, socket_nc, K, double_buffer_B)
+
+proc gemm_impl_sockets[T; ukernel: static MicroKernel; TA, TB](
+      M, N, K: int,
+      alpha: T, vA: MatrixView[TA], vB: MatrixView[TB] or QuantizedMatrixView[TB] or Im2ColView[TB],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T],
+      workspace: pointer
+    ) =
+  ## Two-level parallel GEMM for multi-socket systems:
+  ##   - the N dimension (jc loop) is split across sockets
+  ##   - each socket packs its own panels of B and A
+  ##     and parallelizes the ic and jr loops with its own cores.
+  ##
+  ## Threads are bound to sockets only if OpenMP places are defined,
+  ## for example `OMP_PLACES=sockets OMP_PROC_BIND=spread,close`.
+  ## Otherwise or on single-socket systems this is gemm_impl.
+  ##
+  ## Shapes with too few M*N tiles per thread and a large K
+  ## are dispatched to the split-K GEMM instead.
+  ##
+  ## `workspace` must hold `gemm_mem_required_impl(ukernel, T, M, N, K)` bytes.
+
+  # The BLIS paper recommends
+  #
+  #   omp_set_nested(1);
+  #   n_sockets = omp_get_num_places();
+  #   #pragma omp parallel num_threads(n_sockets) proc_bind(spread)
+  #   {
+  #       n_procs = omp_get_place_num_procs(omp_get_num_places());
+  #       #pragma omp parallel num_threads(n_procs) proc_bind(close)
+  #       doStuff();
+  #   }
+  #
+  # The socket count comes from cpuinfo as OMP_PLACES may be cores or threads.
+  #
+  # Memory is placed on the NUMA node of the thread that first writes to it
+  # (Linux first-touch policy). Panels of B and A are only written by the threads
+  # of their socket so they end up in node-local memory.
+  # A cached workspace keeps its placement as long as the socket split is the same.
+
+  # Edge tiles are M mod MR and N mod NR in all partitionings
+  # and JIT kernels must be generated outside of OpenMP threads.
+  when defined(GEMM_JIT):
+    let jit = jit_edge_kernels[T, ukernel](M, N, alpha)
+  else:
+    let jit = JitEdgeKernels[T]()
+
+  let (nb_splits, split_k) = ukernel.splitk_partition(T, M, N, K)
+  if nb_splits > 1:
+    gemm_impl_splitk[T, ukernel, TA, TB](
+      M, N, K,
+      alpha, vA, vB,
+      beta, vC,
+      epilogue,
+      prologueA, prologueB,
+      nb_splits, split_k,
+      workspace, jit
+    )
+    return
+
+  let (nb_sockets, socket_nc) = ukernel.socket_partition(T, M, N, K)
+  let threads_per_socket = omp_get_max_threads().int div nb_sockets
+  let double_buffer_B = ukernel.pack_B_pipelined(T, M, socket_nc, K, threads_per_socket)
+
+  if nb_sockets == 1:
+    let tiles = ukernel.initTiles(T, M, N, K, workspace, double_buffer_B)
+    gemm_impl[T, ukernel, TA, TB](
+      M, N, K,
+      alpha, vA, vB,
+      beta, vC,
+      tiles, epilogue,
+      prologueA, prologueB,
+      jit
+    )
+    return
+
+  let socket_mem = ukernel.tiles_mem_required(T, M, socket_nc, K, double_buffer_B)
+
+  let nested = omp_get_nested()
+  omp_set_nested(1)
+
+  omp_parallel_spread(nb_sockets):
+    let s = omp_get_thread_num().int
+    let jc = s * socket_nc
+    let nc = min(N - jc, socket_nc)                     # C[0:M, jc:jc+nc]
+    if nc > 0:
+      let tiles = ukernel.initTiles(
+        T, M, nc, K,
+        cast[pointer](cast[ByteAddress](workspace) +% s * socket_mem),
+        double_buffer_B
+      )
+      # Nested regions in gemm_impl use the cores of this socket
+      omp_set_num_threads(threads_per_socket.cint)
+      gemm_impl[T, ukernel, TA, TB](
+        M, nc, K,
+        alpha, vA, vB.stride(0, jc),
+        beta, vC.stride(0, jc),
+        tiles, epilogue.stride(0, jc),
+        prologueA, prologueB.stride(0, jc),
+        jit
+      )
+
+  omp_set_nested(nested)
 
 # ############################################################
 #
@@ -181,6 +635,146 @@ proc gemm_impl[T; ukernel: static MicroKernel](
 #
 # ############################################################
 
+proc gemm_set_deterministic*(
+      T: typedesc,
+      simd = gemm_cpu_simd(T),
+      kc = GEMM_DETERMINISTIC_KC) =
+  ## Make GEMMs on T bitwise reproducible: results do not depend
+  ## on the number of threads nor on the CPU as long as it supports `simd`.
+  ##
+  ## The microkernel ISA `simd` and the depth `kc` of the partial products
+  ## are pinned and split-K is disabled.
+  ## Pass the same `simd` on all machines that must agree.
+  ##
+  ## Raises ValueError if there is no `simd` microkernel for T
+  ## or if the CPU does not support it.
+  ## This must not be called while a GEMM is running.
+  if not ukernel_available(T, simd):
+    raise newException(ValueError, "There is no " & $simd & " GEMM microkernel for " & $T)
+  if not cpu_supports(simd):
+    raise newException(ValueError, "This CPU does not support " & $simd)
+  doAssert kc > 0, "kc must be positive"
+  LaserGemmDeterministic[tuning_type(T)] = GemmDeterministic(
+    enabled: true, simd: simd, kc: kc
+  )
+
+proc gemm_unset_deterministic*(T: typedesc) =
+  ## Disable the deterministic mode of GEMMs on T
+  LaserGemmDeterministic[tuning_type(T)] = GemmDeterministic()
+
+template dispatch_ukernel_shape*(
+      cpu_features: static CPUFeatureX86, T: typedesc,
+      c_unit_stride: static bool, M, N: int, apply: untyped) =
+  ## Expands `apply(ukernel)` with the register tile shape suited
+  ## to a M*N C and its stride (see x86_ukernel_shape), `apply` must return.
+  ## The wide and tall shapes are only instantiated
+  ## for SIMD float32 and float64 microkernels on x86-64.
+  when defined(amd64) and cpu_features != x86_Generic and T is SomeFloat:
+    case x86_ukernel_shape(cpu_features, T, M, N, c_unit_stride)
+    of ukWide:
+      const ukernel = cpu_features.x86_ukernel(T, c_unit_stride, ukWide)
+      apply(ukernel)
+    of ukTall:
+      const ukernel = cpu_features.x86_ukernel(T, c_unit_stride, ukTall)
+      apply(ukernel)
+    of ukDefault:
+      discard
+  const ukernel = cpu_features.x86_ukernel(T, c_unit_stride)
+  apply(ukernel)
+
+proc gemm_mem_required*(T: typedesc, M, N, K: int): int =
+  ## Returns the size in bytes of the workspace to pass to `gemm_strided`
+  ## for a M*N*K matrix multiplication.
+  ## It depends on the detected CPU features, cache sizes and sockets
+  ## and on the number of OpenMP threads at the time of the call.
+
+  # Matrix-vector shapes use the GEMV kernels, or the packed GEMM with prologues
+  let gemv_size = if is_gemv(M, N): gemv_mem_required(T, M, N, K)
+                  else: 0
+
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    type A = T # workaround "Cannot evaluate at compile-time"
+    template apply(ukernel: MicroKernel): untyped {.dirty.} =
+      return max(gemv_size, ukernel.gemm_mem_required_impl(A, M, N, K))
+    # c_unit_stride does not change the packing buffers
+    dispatch_ukernel_shape(cpu_features, A, false, M, N, apply)
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+proc gemm_scale_epilogue*[T](
+      M, N: int,
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]) =
+  ## C = activation(βC + bias), the result of a GEMM with α = 0 or K = 0.
+  ## C is not read if β = 0 as in the reference BLAS.
+  for i in 0 ..< M:
+    for j in 0 ..< N:
+      vC[i, j] = if beta == 0.T: 0.T else: beta * vC[i, j]
+  if not epilogue.isNoOp:
+    gebb_ukernel_fused_epilogue(vC, M, N, epilogue)
+
+proc gemm_packed_dispatch[T; TA, TB](
+      M, N, K: int,
+      alpha: T, vA: MatrixView[TA], vB: MatrixView[TB] or QuantizedMatrixView[TB] or Im2ColView[TB],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T],
+      workspace: pointer, workspace_size: int) =
+  ## Packed GEMM entry point of all storage types of A and B:
+  ## selects the microkernel and its shape, carves the packing buffers
+  ## from `workspace` or from the workspace cached by the calling thread
+  ## and runs gemm_impl_sockets.
+  ##
+  ## A non-nil `workspace` must be aligned on LASER_MEM_ALIGN
+  ## and hold at least `gemm_mem_required(T, M, N, K)` bytes.
+
+  # αAB does not contribute and K = 0 would give an empty kc
+  if alpha == 0.T or K == 0:
+    gemm_scale_epilogue(M, N, beta, vC, epilogue)
+    return
+
+  # Cache hierarchy:
+  #   - block C: mr*nr registers
+  #   - block B: kc*nr L1 cache
+  #   - block A: mc*kc L2 cache
+  #   - panel B: kc*nc L3 cache
+
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    template apply(ukernel: MicroKernel): untyped {.dirty.} =
+      let mem_required = ukernel.gemm_mem_required_impl(T, M, N, K)
+      var ws = workspace
+      var ws_alloc: pointer
+      if ws.isNil:
+        when defined(GEMM_NO_CACHED_WORKSPACE):
+          ws_alloc = allocShared(mem_required + LASER_MEM_ALIGN - 1)
+          ws = align_raw_data(byte, ws_alloc)
+        else:
+          ws = gemm_cached_workspace(mem_required)
+      else:
+        doAssert workspace_size >= mem_required,
+          "The workspace must hold at least gemm_mem_required(T, M, N, K) bytes"
+        doAssert (cast[int](ws) and (LASER_MEM_ALIGN - 1)) == 0,
+          "The workspace must be aligned on LASER_MEM_ALIGN"
+
+      gemm_timed_call(M, N, K):
+        gemm_impl_sockets[T, ukernel, TA, TB](
+          M, N, K,
+          alpha, vA, vB,
+          beta, vC,
+          epilogue,
+          prologueA, prologueB,
+          ws
+        )
+      if not ws_alloc.isNil:
+        deallocShared(ws_alloc)
+      return
+    if vC.colStride == 1:
+      dispatch_ukernel_shape(cpu_features, T, true, M, N, apply)
+    else:
+      dispatch_ukernel_shape(cpu_features, T, false, M, N, apply)
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
 proc gemm_strided*[T: SomeNumber](
       M, N, K: int,
       alpha: T,
@@ -190,11 +784,28 @@ proc gemm_strided*[T: SomeNumber](
       rowStrideB, colStrideB: int,
       beta: T,
       C: ptr T,
-      rowStrideC, colStrideC: int) =
-
-    # TODO: shortcut alpha = 0 or K = 0
-    # TODO: elementwise epilogue fusion like relu/tanh/sigmoid
-    # TODO: shortcut for small gemm
+      rowStrideC, colStrideC: int,
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T],
+      workspace: pointer, workspace_size: int) =
+    ## Compute C = activation(α f(A)*g(B) + βC + bias)
+    ## with:
+    ##   - f and g the elementwise transforms described by
+    ##     `prologueA` and `prologueB` applied while packing A and B
+    ##   - the bias and activation described by `epilogue`
+    ##     applied on each C tile as it is produced.
+    ##
+    ## The packing buffers are carved from `workspace`.
+    ## It must be aligned on LASER_MEM_ALIGN (64 bytes by default)
+    ## and hold at least `gemm_mem_required(T, M, N, K)` bytes.
+    ## If `workspace` is nil, a workspace cached by the calling thread is used.
+
+    when T is SomeInteger:
+      doAssert epilogue.activation in {actNone, actRelu},
+        "Only ReLU activation can be fused for integer matrix multiplication"
+      doAssert prologueA.kind notin {proTanhGrad, proSigmoidGrad} and
+               prologueB.kind notin {proTanhGrad, proSigmoidGrad},
+        "Only ReLU derivative can be fused for integer matrix multiplication"
 
     # Create a view to abstract deling with strides
     # and passing those in each proc
@@ -202,49 +813,301 @@ proc gemm_strided*[T: SomeNumber](
     let vB = B.toMatrixView(rowStrideB, colStrideB)
     let vC = C.toMatrixView(rowStrideC, colStrideC)
 
-    # Cache hierarchy:
-    #   - block C: mr*nr registers
-    #   - block B: kc*nr L1 cache
-    #   - block A: mc*kc L2 cache
-    #   - panel B: kc*nc L3 cache
+    # αAB does not contribute, A and B are not read
+    if alpha == 0.T or K == 0:
+      gemm_scale_epilogue(M, N, beta, vC, epilogue)
+      return
+
+    # Matrix-vector: the MR*NR microkernel would waste most of its registers
+    if is_gemv(M, N) and
+        prologueA.kind == proNone and prologueB.kind == proNone:
+      if not workspace.isNil:
+        doAssert workspace_size >= gemv_mem_required(T, M, N, K),
+          "The workspace must hold at least gemm_mem_required(T, M, N, K) bytes"
+        doAssert (cast[int](workspace) and (LASER_MEM_ALIGN - 1)) == 0,
+          "The workspace must be aligned on LASER_MEM_ALIGN"
+      gemm_timed_call(M, N, K):
+        gemv(M, N, K, alpha, vA, vB, beta, vC, epilogue, workspace)
+      return
+
+    # Small matrices: packing and allocating costs more than it saves
+    if is_small_gemm(M, N, K) and
+        prologueA.kind == proNone and prologueB.kind == proNone:
+      gemm_timed_call(M, N, K):
+        gemm_small(M, N, K, alpha, vA, vB, beta, vC, epilogue)
+      return
+
+    gemm_packed_dispatch(
+      M, N, K,
+      alpha, vA, vB,
+      beta, vC,
+      epilogue,
+      prologueA, prologueB,
+      workspace, workspace_size
+    )
 
-    template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
-      template apply(ukernel: MicroKernel): untyped {.dirty.} =
-        let tiles = ukernel.newTiles(T, M, N, K)
-        gemm_impl[T, ukernel](
-          M, N, K,
-          alpha, vA, vB,
-          beta, vC,
-          tiles
-        )
-        return
-      if colStrideC == 1:
-        const ukernel = cpu_features.x86_ukernel(T, true)
-        apply(ukernel)
-      else:
-        const ukernel = cpu_features.x86_ukernel(T, false)
-        apply(ukernel)
-
-    when defined(i386) or defined(amd64):
-      when T is float32:
-        if cpuinfo_has_x86_avx512f():   dispatch(x86_AVX512)
-        elif cpuinfo_has_x86_fma3():   dispatch(x86_AVX_FMA)
-        elif cpuinfo_has_x86_avx():  dispatch(x86_AVX)
-        elif cpuinfo_has_x86_sse():    dispatch(x86_SSE)
-      elif T is float64:
-        if cpuinfo_has_x86_avx512f():   dispatch(x86_AVX512)
-        elif cpuinfo_has_x86_fma3():   dispatch(x86_AVX_FMA)
-        elif cpuinfo_has_x86_avx():  dispatch(x86_AVX)
-        elif cpuinfo_has_x86_sse2():    dispatch(x86_SSE2)
-      elif T is int32 or T is uint32:
-        if cpuinfo_has_x86_avx512f():   dispatch(x86_AVX512)
-        elif cpuinfo_has_x86_avx2():   dispatch(x86_AVX2)
-        elif cpuinfo_has_x86_sse41():   dispatch(x86_SSE4_1)
-        elif cpuinfo_has_x86_sse2():   dispatch(x86_SSE2)
-      elif T is int64:
-        if cpuinfo_has_x86_avx512f():   dispatch(x86_AVX512)
-        elif cpuinfo_has_x86_sse2():   dispatch(x86_SSE2)
-    dispatch(x86_Generic)
+proc gemm_strided*[T: SomeNumber](
+      M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      B: ptr T,
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int,
+      epilogue: Epilogue[T],
+      prologueA, prologueB: Prologue[T]) {.inline.} =
+  ## Compute C = activation(α f(A)*g(B) + βC + bias)
+  ## using the workspace cached by the calling thread
+  gemm_strided(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    epilogue,
+    prologueA, prologueB,
+    nil, 0
+  )
+
+proc gemm_strided*[T: SomeNumber](
+      M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      B: ptr T,
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int,
+      epilogue: Epilogue[T]) {.inline.} =
+  ## Compute C = activation(αA*B + βC + bias)
+  gemm_strided(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    epilogue,
+    Prologue[T](), Prologue[T]()
+  )
+
+proc gemm_strided*[T: SomeNumber](
+      M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      B: ptr T,
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int) {.inline.} =
+  ## Compute C = αA*B + βC
+  gemm_strided(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    Epilogue[T](),
+    Prologue[T](), Prologue[T]()
+  )
+
+proc gemm_strided*[T: SomeNumber](
+      M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      B: ptr T,
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int,
+      workspace: pointer, workspace_size: int) {.inline.} =
+  ## Compute C = αA*B + βC
+  ## using a caller-provided workspace of `gemm_mem_required(T, M, N, K)` bytes
+  gemm_strided(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    Epilogue[T](),
+    Prologue[T](), Prologue[T](),
+    workspace, workspace_size
+  )
+
+# ############################################################
+#
+#        Half-precision storage with float32 accumulation
+#
+# ############################################################
+
+proc gemm_strided_widening[TA, TB](
+      M, N, K: int,
+      alpha: float32,
+      A: ptr TA,
+      rowStrideA, colStrideA: int,
+      B: ptr TB,
+      rowStrideB, colStrideB: int,
+      beta: float32,
+      C: ptr float32,
+      rowStrideC, colStrideC: int,
+      epilogue: Epilogue[float32],
+      workspace: pointer, workspace_size: int) =
+  ## A and B are widened to float32 while being packed
+  ## and multiplied by the float32 microkernels.
+  ## The GEMV and small matrix paths are not used
+  ## as they work on the unpacked matrices.
+  # Packed buffers are float32, the workspace is the float32 one.
+  gemm_packed_dispatch(
+    M, N, K,
+    alpha, A.toMatrixView(rowStrideA, colStrideA),
+           B.toMatrixView(rowStrideB, colStrideB),
+    beta,  C.toMatrixView(rowStrideC, colStrideC),
+    epilogue,
+    Prologue[float32](), Prologue[float32](),
+    workspace, workspace_size
+  )
+
+proc gemm_strided*[TA: Float16 or BFloat16; TB: Float16 or BFloat16 or float32](
+      M, N, K: int,
+      alpha: float32,
+      A: ptr TA,
+      rowStrideA, colStrideA: int,
+      B: ptr TB,
+      rowStrideB, colStrideB: int,
+      beta: float32,
+      C: ptr float32,
+      rowStrideC, colStrideC: int,
+      epilogue = Epilogue[float32](),
+      workspace: pointer = nil, workspace_size = 0) =
+  ## Compute C = activation(αA*B + βC + bias)
+  ## with A stored as fp16 or bfloat16, B stored as fp16, bfloat16 or float32
+  ## and C accumulated in float32.
+  ## A and B are converted to float32 while being packed.
+  ##
+  ## `workspace` may hold `gemm_mem_required(float32, M, N, K)` bytes
+  ## aligned on LASER_MEM_ALIGN, if nil the cached workspace is used.
+  gemm_strided_widening(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    epilogue,
+    workspace, workspace_size
+  )
+
+proc gemm_strided*[TB: Float16 or BFloat16](
+      M, N, K: int,
+      alpha: float32,
+      A: ptr float32,
+      rowStrideA, colStrideA: int,
+      B: ptr TB,
+      rowStrideB, colStrideB: int,
+      beta: float32,
+      C: ptr float32,
+      rowStrideC, colStrideC: int,
+      epilogue = Epilogue[float32](),
+      workspace: pointer = nil, workspace_size = 0) =
+  ## Compute C = activation(αA*B + βC + bias)
+  ## with A stored as float32, B stored as fp16 or bfloat16
+  ## and C accumulated in float32.
+  ## B is converted to float32 while being packed.
+  ##
+  ## `workspace` may hold `gemm_mem_required(float32, M, N, K)` bytes
+  ## aligned on LASER_MEM_ALIGN, if nil the cached workspace is used.
+  gemm_strided_widening(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC,
+    epilogue,
+    workspace, workspace_size
+  )
+
+# ############################################################
+#
+#          Weight-only quantization with float32 compute
+#
+# ############################################################
+
+proc gemm_strided*[Q: int8 or UInt4](
+      M, N, K: int,
+      alpha: float32,
+      A: ptr float32,
+      rowStrideA, colStrideA: int,
+      B: ptr Q,
+      rowStrideB, colStrideB: int,
+      scalesB: ptr float32,
+      zeroPointsB: ptr int8,
+      group_size: int,
+      beta: float32,
+      C: ptr float32,
+      rowStrideC, colStrideC: int,
+      epilogue = Epilogue[float32](),
+      workspace: pointer = nil, workspace_size = 0) =
+  ## Compute C = activation(αA*B + βC + bias)
+  ## with A and C float32 and B stored as int8 or 4-bit integers:
+  ##   B[k, j] = (B[k, j] - zeroPointsB[k div group_size, j]) * scalesB[k div group_size, j]
+  ##
+  ## `scalesB` and `zeroPointsB` are [ceil(K / group_size), N] row-major matrices.
+  ## `zeroPointsB` may be nil, the zero point is then 0 for int8 and 8 for UInt4.
+  ## UInt4 strides are in elements (nibbles), see UInt4.
+  ##
+  ## B is dequantized to float32 while being packed
+  ## and multiplied by the float32 microkernels.
+  ## The GEMV and small matrix paths are not used
+  ## as they work on the unpacked matrices.
+  ##
+  ## `workspace` may hold `gemm_mem_required(float32, M, N, K)` bytes
+  ## aligned on LASER_MEM_ALIGN, if nil the cached workspace is used.
+  doAssert group_size > 0, "The quantization group size must be positive"
+
+  let vB = B.toQuantizedMatrixView(
+    rowStrideB, colStrideB,
+    scalesB, zeroPointsB,
+    group_size, groupStride = N
+  )
+  gemm_packed_dispatch(
+    M, N, K,
+    alpha, A.toMatrixView(rowStrideA, colStrideA), vB,
+    beta,  C.toMatrixView(rowStrideC, colStrideC),
+    epilogue,
+    Prologue[float32](), Prologue[float32](),
+    workspace, workspace_size
+  )
+
+# ############################################################
+#
+#               Implicit im2col for convolutions
+#
+# ############################################################
+
+proc gemm_im2col*[T: SomeFloat](
+      M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      B: Im2ColView[T],
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int,
+      epilogue = Epilogue[T](),
+      workspace: pointer = nil, workspace_size = 0) =
+  ## Compute C = activation(αA*B + βC + bias)
+  ## with B the [K, N] im2col matrix of an image (see Im2ColView)
+  ## read from the image while being packed.
+  ## The GEMV and small matrix paths are not used
+  ## as they work on the unpacked matrices.
+  ##
+  ## `workspace` may hold `gemm_mem_required(T, M, N, K)` bytes
+  ## aligned on LASER_MEM_ALIGN, if nil the cached workspace is used.
+  gemm_packed_dispatch(
+    M, N, K,
+    alpha, A.toMatrixView(rowStrideA, colStrideA), B,
+    beta,  C.toMatrixView(rowStrideC, colStrideC),
+    epilogue,
+    Prologue[T](), Prologue[T](),
+    workspace, workspace_size
+  )
 
 # ############################################################
 #
@@ -253,6 +1116,18 @@ proc gemm_strided*[T: SomeNumber](
 # ############################################################
 
 when isMainModule:
+  proc gemm_packed[T](M, N, K: int, a, b, res: ptr T, epilogue = Epilogue[T]()) =
+    ## Row-major C = A*B through the packed microkernel path,
+    ## the shapes of the tests below would otherwise use gemv or gemm_small.
+    gemm_packed_dispatch(
+      M, N, K,
+      T(1), a.toMatrixView(K, 1), b.toMatrixView(N, 1),
+      T(0), res.toMatrixView(N, 1),
+      epilogue,
+      Prologue[T](), Prologue[T](),
+      nil, 0
+    )
+
   # Tests
   block:
     let a = [[1.0, 2, 3],
@@ -279,6 +1154,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[3, array[2, float]]
+    gemm_packed(3, 2, 3, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -306,6 +1185,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[3, array[2, float]]
+    gemm_packed(3, 2, 3, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -331,6 +1214,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[2, array[2, float]]
+    gemm_packed(2, 2, 3, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -357,6 +1244,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[2, array[4, int]]
+    gemm_packed(2, 4, 3, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -390,6 +1281,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[5, array[4, int]]
+    gemm_packed(5, 4, 4, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -421,6 +1316,10 @@ when isMainModule:
     # echo "result: ", res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[2, array[2, int]]
+    gemm_packed(2, 2, 8, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -458,6 +1357,10 @@ when isMainModule:
     # echo "result: ",   res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[8, array[8, int]]
+    gemm_packed(8, 8, 2, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
     echo "SUCCESS\n"
 
   block:
@@ -504,4 +1407,767 @@ when isMainModule:
     # echo "result: ",   res_ab
 
     doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[8, array[8, int]]
+    gemm_packed(8, 8, 8, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr)
+    doAssert res_packed == ab, $res_packed
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Fused per-column bias and ReLU epilogue"
+    let a = [[1.0, 2, 3],
+             [4.0, 5, 6]]
+
+    let b = [[ 1.0, -1],
+             [ 1.0, -1],
+             [ 1.0, -1]]
+
+    let bias = [-10.0, 20]
+
+    # relu(A*B + bias)
+    let ab = [[0.0, 14],
+              [5.0,  5]]
+
+    var res_ab: array[2, array[2, float]]
+    gemm_strided(
+      2, 2, 3,
+      1.0,  a[0][0].unsafeAddr, 3, 1,
+            b[0][0].unsafeAddr, 2, 1,
+      0.0,  res_ab[0][0].addr,  2, 1,
+      colBiasEpilogue(bias[0].unsafeAddr, actRelu)
+      )
+
+    doAssert res_ab == ab, $res_ab
+    # Same product through the packed path
+    var res_packed: array[2, array[2, float]]
+    gemm_packed(
+      2, 2, 3, a[0][0].unsafeAddr, b[0][0].unsafeAddr, res_packed[0][0].addr,
+      colBiasEpilogue(bias[0].unsafeAddr, actRelu)
+    )
+    doAssert res_packed == ab, $res_packed
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Fused per-row bias epilogue with K > kc and strided C"
+    const M = 5
+    const N = 3
+    const K = 1000
+    var a: array[M, array[K, int]]
+    var b: array[K, array[N, int]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = (i + k) mod 3 - 1
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = (k * j) mod 5 - 2
+    let bias = [1, -2, 3, -4, 5]
+
+    var expected: array[N, array[M, int]] # transposed
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        var acc = bias[i]
+        for k in 0 ..< K:
+          acc += a[i][k] * b[k][j]
+        expected[j][i] = max(0, acc)
+
+    var res_ab: array[N, array[M, int]]
+    gemm_strided(
+      M, N, K,
+      1,  a[0][0].unsafeAddr, K, 1,
+          b[0][0].unsafeAddr, N, 1,
+      0,  res_ab[0][0].addr,  1, M,
+      rowBiasEpilogue(bias[0].unsafeAddr, actRelu)
+      )
+
+    doAssert res_ab == expected, $res_ab
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Fused bias and ReLU on the SIMD registers: row-major C, β ≠ 0"
+    # Full float32 tiles with a unit-stride C take the SIMD epilogue,
+    # the edges and the column-major C the scalar one.
+    const M = 37
+    const N = 70
+    const K = 50
+    var a = newSeq[float32](M*K)
+    for i in 0 ..< a.len:
+      a[i] = float32(i mod 7) - 3
+    var b = newSeq[float32](K*N)
+    for i in 0 ..< b.len:
+      b[i] = float32(i mod 5) - 2
+    var rowBias = newSeq[float32](M)
+    for i in 0 ..< M:
+      rowBias[i] = float32(i mod 9) - 4
+    var colBias = newSeq[float32](N)
+    for j in 0 ..< N:
+      colBias[j] = float32(j mod 11) - 5
+    var c0 = newSeq[float32](M*N)
+    for i in 0 ..< c0.len:
+      c0[i] = float32(i mod 3) - 1
+
+    for perRow in [false, true]:
+      var expected = newSeq[float32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          var acc = 0'f32
+          for k in 0 ..< K:
+            acc += a[i*K + k] * b[k*N + j]
+          acc = 2'f32 * acc + 0.5'f32 * c0[i*N + j]
+          acc += (if perRow: rowBias[i] else: colBias[j])
+          expected[i*N + j] = max(0'f32, acc)
+
+      let epilogue = if perRow: rowBiasEpilogue(rowBias[0].addr, actRelu)
+                     else: colBiasEpilogue(colBias[0].addr, actRelu)
+
+      var res = c0
+      gemm_strided(
+        M, N, K,
+        2'f32,    a[0].addr, K, 1,
+                  b[0].addr, N, 1,
+        0.5'f32,  res[0].addr, N, 1,
+        epilogue
+        )
+      doAssert res == expected, "per-row bias: " & $perRow
+
+      # Column-major C through the scalar epilogue
+      var resT = newSeq[float32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          resT[j*M + i] = c0[i*N + j]
+      gemm_strided(
+        M, N, K,
+        2'f32,    a[0].addr, K, 1,
+                  b[0].addr, N, 1,
+        0.5'f32,  resT[0].addr, 1, M,
+        epilogue
+        )
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert resT[j*M + i] == expected[i*N + j]
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Fused ReLU propagates NaN in the SIMD and the scalar epilogues"
+    const M = 11
+    const N = 19
+    const K = 7
+    let nan = NaN.float32
+    var a = newSeq[float32](M*K)
+    var b = newSeq[float32](K*N)
+    for i in 0 ..< a.len: a[i] = float32(i mod 5) - 2
+    for i in 0 ..< b.len: b[i] = float32(i mod 3) - 1
+    # Row 3 of C is NaN, in a full tile and in the edge tiles
+    a[3*K] = nan
+    var bias = newSeq[float32](N)
+
+    for colMajor in [false, true]:
+      let (rowStrideC, colStrideC) = if colMajor: (1, M) else: (N, 1)
+      var c = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,    a[0].addr, K, 1,
+                  b[0].addr, N, 1,
+        0'f32,    c[0].addr, rowStrideC, colStrideC,
+        colBiasEpilogue(bias[0].addr, actRelu)
+        )
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          let x = c[i*rowStrideC + j*colStrideC]
+          if i == 3:
+            doAssert x != x, "NaN is propagated, column-major: " & $colMajor
+          else:
+            doAssert x >= 0'f32
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Fused ReLU derivative prologue on A and scaling prologue on B"
+    # Backprop through relu: dX = (dY ⊙ relu'(Y)) * W
+    let dy = [[1.0, 2, 3],
+              [4.0, 5, 6]]
+
+    let y =  [[0.0, 1, 1],
+              [2.0, 0, 3]]
+
+    let w = [[1.0, 1],
+             [1.0, 2],
+             [1.0, 3]]
+
+    # (dY ⊙ relu'(Y)) * 2W
+    let expected = [[10.0, 26],
+                    [20.0, 44]]
+
+    var res: array[2, array[2, float]]
+    gemm_strided(
+      2, 2, 3,
+      1.0,  dy[0][0].unsafeAddr, 3, 1,
+            w[0][0].unsafeAddr, 2, 1,
+      0.0,  res[0][0].addr,  2, 1,
+      Epilogue[float](),
+      reluGradPrologue(y[0][0].unsafeAddr, 3, 1),
+      scalePrologue(2.0)
+      )
+
+    doAssert res == expected, $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Small matrix path with odd shapes and strided B and C"
+    const M = 13
+    const N = 11
+    const K = 7
+    var a: array[M, array[K, float32]]
+    var b: array[N, array[K, float32]] # B is transposed: colStride = K
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = float32((i * 3 + k) mod 7) - 3
+    for j in 0 ..< N:
+      for k in 0 ..< K:
+        b[j][k] = float32((j + 2 * k) mod 5) - 2
+
+    var expected: array[N, array[M, float32]] # C is transposed
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        var acc = 0'f32
+        for k in 0 ..< K:
+          acc += a[i][k] * b[j][k]
+        expected[j][i] = acc
+
+    var res: array[N, array[M, float32]]
+    gemm_strided(
+      M, N, K,
+      1'f32,  a[0][0].unsafeAddr, K, 1,
+              b[0][0].unsafeAddr, 1, K,
+      0'f32,  res[0][0].addr,     1, M
+      )
+
+    doAssert res == expected, $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Caller-provided workspace"
+    const M = 100
+    const N = 90
+    const K = 80
+    var a: array[M, array[K, int32]]
+    var b: array[K, array[N, int32]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = int32((i + k) mod 5) - 2
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = int32((k * j) mod 7) - 3
+
+    var expected: array[M, array[N, int32]]
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        for k in 0 ..< K:
+          expected[i][j] += a[i][k] * b[k][j]
+
+    let size = gemm_mem_required(int32, M, N, K)
+    let mem = allocShared(size + LASER_MEM_ALIGN - 1)
+    let workspace = align_raw_data(byte, mem)
+
+    var res: array[M, array[N, int32]]
+    gemm_strided(
+      M, N, K,
+      1'i32,  a[0][0].unsafeAddr, K, 1,
+              b[0][0].unsafeAddr, N, 1,
+      0'i32,  res[0][0].addr,     N, 1,
+      workspace, size
+      )
+    deallocShared(mem)
+
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Split-K matrix-vector product with a caller-provided workspace"
+    const M = 3
+    const K = 40000
+    var a = newSeq[float32](M*K)
+    var b = newSeq[float32](K)
+    for i in 0 ..< a.len: a[i] = float32(i mod 5) - 2
+    for k in 0 ..< K: b[k] = float32(k mod 3) - 1
+
+    var expected = newSeq[float32](M)
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        expected[i] += a[i*K + k] * b[k]
+
+    # Covers the partial sums of the split-K GEMV
+    let size = gemm_mem_required(float32, M, 1, K)
+    doAssert size >= gemv_mem_required(float32, M, 1, K)
+    let mem = allocShared(size + LASER_MEM_ALIGN - 1)
+    let workspace = align_raw_data(byte, mem)
+
+    var res = newSeq[float32](M)
+    gemm_strided(
+      M, 1, K,
+      1'f32,  a[0].addr, K, 1,
+              b[0].addr, 1, 1,
+      0'f32,  res[0].addr, 1, 1,
+      workspace, size
+      )
+    deallocShared(mem)
+
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Matrix-vector products (M = 1 or N = 1)"
+    const M = 300
+    const N = 290
+    const K = 70
+    var a: array[M, array[K, float32]]
+    var b: array[K, array[N, float32]]
+    var bias: array[N, float32]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = float32((i + 2*k) mod 9) - 4
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = float32((3*k + j) mod 7) - 3
+    for j in 0 ..< N:
+      bias[j] = float32(j mod 5) - 2
+
+    # M = 1, B row-major: axpy on rows of B, with a column bias and ReLU
+    var expected_row, res_row: array[N, float32]
+    for j in 0 ..< N:
+      var acc = bias[j]
+      for k in 0 ..< K:
+        acc += a[0][k] * b[k][j]
+      expected_row[j] = max(0'f32, acc)
+
+    gemm_strided(
+      1, N, K,
+      1'f32,  a[0][0].unsafeAddr, K, 1,
+              b[0][0].unsafeAddr, N, 1,
+      0'f32,  res_row[0].addr,    N, 1,
+      colBiasEpilogue(bias[0].unsafeAddr, actRelu)
+      )
+    doAssert res_row == expected_row, $res_row
+
+    # N = 1, A row-major: dot products on rows of A
+    var x: array[K, float32]
+    for k in 0 ..< K:
+      x[k] = b[k][0]
+    var expected_col, res_col: array[M, float32]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        expected_col[i] += a[i][k] * x[k]
+      expected_col[i] = 2'f32 * expected_col[i] + 1'f32
+      res_col[i] = 1'f32
+
+    gemm_strided(
+      M, 1, K,
+      2'f32,  a[0][0].unsafeAddr, K, 1,
+              x[0].unsafeAddr,    1, 1,
+      1'f32,  res_col[0].addr,    1, 1
+      )
+    doAssert res_col == expected_col, $res_col
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Dot product and short outputs with a long K (split along K with -d:openmp)"
+    const N = 3
+    const K = 100_003
+    var a = newSeq[int](K)
+    var b = newSeq[int](K*N)
+    for k in 0 ..< K:
+      a[k] = (k mod 7) - 3
+      for j in 0 ..< N:
+        b[k*N + j] = ((k + j) mod 5) - 2
+
+    var expected: array[N, int]
+    for j in 0 ..< N:
+      for k in 0 ..< K:
+        expected[j] += a[k] * b[k*N + j]
+
+    # M = N = 1
+    var dot = [10]
+    gemm_strided(
+      1, 1, K,
+      2,  a[0].addr, K, 1,
+          b[0].addr, N, 1,
+      -1, dot[0].addr, 1, 1
+      )
+    doAssert dot[0] == 2 * expected[0] - 10, $dot
+
+    # M = 1, N = 3 with a fused ReLU
+    var res: array[N, int]
+    gemm_strided(
+      1, N, K,
+      1,  a[0].addr, K, 1,
+          b[0].addr, N, 1,
+      0,  res[0].addr, N, 1,
+      activationEpilogue[int](actRelu)
+      )
+    for j in 0 ..< N:
+      doAssert res[j] == max(0, expected[j]), $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Half-precision storage with float32 accumulation"
+    const M = 100
+    const N = 90
+    const K = 80
+    # A is column-major bfloat16, B is row-major fp16
+    var a: array[K, array[M, BFloat16]]
+    var b: array[K, array[N, Float16]]
+    var expected, res: array[M, array[N, float32]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[k][i] = toBFloat16(float32((i + 3*k) mod 11) - 5)
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = toFloat16(float32((2*k + j) mod 7) * 0.5'f32)
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        for k in 0 ..< K:
+          expected[i][j] += a[k][i].toFloat32 * b[k][j].toFloat32
+
+    gemm_strided(
+      M, N, K,
+      1'f32,  a[0][0].addr, 1, M,
+              b[0][0].addr, N, 1,
+      0'f32,  res[0][0].addr, N, 1
+      )
+    doAssert res == expected
+
+    # K = 0 on the widening path: C = relu(βC + bias), A and B are not read
+    var bias: array[N, float32]
+    for j in 0 ..< N:
+      bias[j] = float32(j) - 40
+    gemm_strided(
+      M, N, 0,
+      1'f32,  a[0][0].addr, 1, M,
+              b[0][0].addr, N, 1,
+      2'f32,  res[0][0].addr, N, 1,
+      colBiasEpilogue(bias[0].addr, actRelu)
+      )
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        doAssert res[i][j] == max(0'f32, 2'f32 * expected[i][j] + bias[j])
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Split-K: small M and N, large K, β != 0 and fused epilogue"
+    const M = 12
+    const N = 20
+    const K = 20000
+    var a = newSeq[int](M*K)
+    var b = newSeq[int](K*N)
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i*K + k] = (i + k) mod 3 - 1
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k*N + j] = (k * j) mod 5 - 2
+    var bias: array[N, int]
+    for j in 0 ..< N:
+      bias[j] = j - 10
+
+    var res = newSeq[int](M*N)
+    var expected = newSeq[int](M*N)
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        res[i*N + j] = i - j
+        var acc = 2 * (i - j) + bias[j]
+        for k in 0 ..< K:
+          acc += 3 * a[i*K + k] * b[k*N + j]
+        expected[i*N + j] = max(0, acc)
+
+    gemm_strided(
+      M, N, K,
+      3,  a[0].addr, K, 1,
+          b[0].addr, N, 1,
+      2,  res[0].addr, N, 1,
+      colBiasEpilogue(bias[0].addr, actRelu)
+      )
+
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Edge tiles with α != 1, β = 1 and β = 0.5 (JIT kernels with -d:GEMM_JIT)"
+    proc test_edges(T: typedesc) =
+      const M = 101
+      const N = 75
+      const K = 67
+      var a = newSeq[T](M*K)
+      var b = newSeq[T](K*N)
+      for i in 0 ..< M:
+        for k in 0 ..< K:
+          a[i*K + k] = T((i + 2*k) mod 5) - 2
+      for k in 0 ..< K:
+        for j in 0 ..< N:
+          b[k*N + j] = T((k + j) mod 3) - 1
+      var bias = newSeq[T](N)
+      for j in 0 ..< N:
+        bias[j] = T(j mod 7) - 3
+
+      for beta in [T(1), T(0.5)]:
+        var res = newSeq[T](M*N)
+        var expected = newSeq[T](M*N)
+        for i in 0 ..< M:
+          for j in 0 ..< N:
+            res[i*N + j] = T((i + j) mod 4)
+            var acc = beta * res[i*N + j] + bias[j]
+            for k in 0 ..< K:
+              acc += 2 * a[i*K + k] * b[k*N + j]
+            expected[i*N + j] = max(T(0), acc)
+
+        gemm_strided(
+          M, N, K,
+          T(2), a[0].addr, K, 1,
+                b[0].addr, N, 1,
+          beta, res[0].addr, N, 1,
+          colBiasEpilogue(bias[0].addr, actRelu)
+          )
+        doAssert res == expected
+
+    test_edges(float32)
+    test_edges(float64)
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Deterministic mode: same bits for 1 thread and all threads"
+    proc run(M, N, K: int, a, b: seq[float32]): seq[float32] =
+      result = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,  a[0].unsafeAddr, K, 1,
+                b[0].unsafeAddr, N, 1,
+        0'f32,  result[0].addr, N, 1
+        )
+
+    gemm_set_deterministic(float32)
+    let nb_threads = omp_get_max_threads()
+    # Split-K and regular shapes
+    for shape in [(12, 20, 20000), (300, 200, 1000)]:
+      let (M, N, K) = shape
+      var a = newSeq[float32](M*K)
+      var b = newSeq[float32](K*N)
+      for i in 0 ..< a.len:
+        a[i] = float32(i mod 17) / 7'f32 - 1'f32
+      for i in 0 ..< b.len:
+        b[i] = float32(i mod 13) / 3'f32 - 2'f32
+
+      omp_set_num_threads(1)
+      let serial = run(M, N, K, a, b)
+      omp_set_num_threads(nb_threads)
+      let parallel = run(M, N, K, a, b)
+      doAssert serial == parallel
+    gemm_unset_deterministic(float32)
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Instrumentation: cycles per phase, GFLOP/s and packing ratio"
+    const M = 301
+    const N = 203
+    const K = 500
+    var a = newSeq[float32](M*K)
+    var b = newSeq[float32](K*N)
+    var c = newSeq[float32](M*N)
+    for i in 0 ..< a.len:
+      a[i] = float32(i mod 11) - 5'f32
+    for i in 0 ..< b.len:
+      b[i] = float32(i mod 7) - 3'f32
+
+    gemm_reset_instrumentation()
+    gemm_strided(
+      M, N, K,
+      1'f32,  a[0].addr, K, 1,
+              b[0].addr, N, 1,
+      0'f32,  c[0].addr, N, 1
+      )
+    let stats = gemm_instrumentation()
+    when defined(GEMM_INSTRUMENT):
+      echo stats
+      doAssert stats.flops == float(2 * M * N * K)
+      # M and N are not multiples of MR and NR
+      for phase in [gpPackA, gpPackB, gpUKernel, gpUKernelEdge]:
+        doAssert stats.phases[phase] > 0
+      doAssert stats.gflops > 0 and stats.packing_ratio in 0.0 .. 1.0
+    else:
+      doAssert stats.flops == 0 and stats.gflops == 0 and stats.threads.len == 0
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Pipelined packing of B over several jc and pc iterations (with -d:openmp and 4+ threads)"
+    const M = 96
+    const N = 400
+    const K = 800
+    var a = newSeq[int32](M*K)
+    var b = newSeq[int32](K*N)
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i*K + k] = int32((i + 2*k) mod 7) - 3
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k*N + j] = int32((k + j*j) mod 5) - 2
+    var bias: array[N, int32]
+    for j in 0 ..< N:
+      bias[j] = int32(j mod 9) - 4
+
+    var res = newSeq[int32](M*N)
+    var expected = newSeq[int32](M*N)
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        res[i*N + j] = int32(i - j)
+        var acc = -1'i32 * int32(i - j) + bias[j]
+        for k in 0 ..< K:
+          acc += a[i*K + k] * (3'i32 * b[k*N + j])
+        expected[i*N + j] = max(0'i32, acc)
+
+    gemm_strided(
+      M, N, K,
+      1'i32,  a[0].addr, K, 1,
+              b[0].addr, N, 1,
+      -1'i32, res[0].addr, N, 1,
+      colBiasEpilogue(bias[0].addr, actRelu),
+      Prologue[int32](), scalePrologue(3'i32)
+      )
+
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Wide and tall microkernels: C with 2 rows and C with 8 columns"
+    template check(M, N, K: int) =
+      var a = newSeq[float32](M*K)
+      var b = newSeq[float32](K*N)
+      for i in 0 ..< M:
+        for k in 0 ..< K:
+          a[i*K + k] = float32((i + 3*k) mod 7) - 3
+      for k in 0 ..< K:
+        for j in 0 ..< N:
+          b[k*N + j] = float32((2*k + j) mod 5) - 2
+
+      var expected = newSeq[float32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          var acc = 0'f32
+          for k in 0 ..< K:
+            acc += a[i*K + k] * b[k*N + j]
+          expected[i*N + j] = acc
+
+      echo "  shape for M: ", M, ", N: ", N, ": ",
+        x86_ukernel_shape(gemm_cpu_simd(float32), float32, M, N),
+        ", column-major C: ",
+        x86_ukernel_shape(gemm_cpu_simd(float32), float32, M, N, c_unit_stride = false)
+
+      # Row-major and column-major C
+      var res = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,  a[0].addr, K, 1,
+                b[0].addr, N, 1,
+        0'f32,  res[0].addr, N, 1
+        )
+      doAssert res == expected
+
+      var resT = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,  a[0].addr, K, 1,
+                b[0].addr, N, 1,
+        0'f32,  resT[0].addr, 1, M
+        )
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert resT[i + j*M] == expected[i*N + j]
+
+    check(2, 1000, 300)
+    check(1000, 8, 300)
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Weight-only quantization: int8 and 4-bit B with per-group scales, M = 1..16"
+    const N = 37
+    const K = 300
+    const G = 64 # group size, K is not a multiple
+    const nb_groups = (K + G - 1) div G
+
+    var scales = newSeq[float32](nb_groups*N)
+    var zero_points = newSeq[int8](nb_groups*N)
+    for g in 0 ..< nb_groups:
+      for j in 0 ..< N:
+        scales[g*N + j] = 0.25'f32 * float32(1 + (g + j) mod 3)
+        zero_points[g*N + j] = int8((g * j) mod 5) - 2
+
+    # B[K, N] row-major, as int8 and as 4-bit packed two per byte
+    var qB8 = newSeq[int8](K*N)
+    var qB4 = newSeq[uint8]((K*N + 1) div 2)
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        let q = (k + 3*j) mod 16
+        let idx = k*N + j
+        qB8[idx] = int8(q - 8)
+        qB4[idx shr 1] = qB4[idx shr 1] or uint8(q shl ((idx and 1) * 4))
+
+    for M in [1, 4, 16]:
+      var a = newSeq[float32](M*K)
+      for i in 0 ..< M:
+        for k in 0 ..< K:
+          a[i*K + k] = float32((i + 2*k) mod 7) - 3
+
+      # Symmetric int8 and asymmetric UInt4 with the same dequantized values
+      var expected8 = newSeq[float32](M*N)
+      var expected4 = newSeq[float32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          var acc8, acc4 = 0'f32
+          for k in 0 ..< K:
+            let g = (k div G)*N + j
+            let q = float32((k + 3*j) mod 16)
+            acc8 += a[i*K + k] * ((q - 8) * scales[g])
+            acc4 += a[i*K + k] * ((q - float32(zero_points[g])) * scales[g])
+          expected8[i*N + j] = acc8
+          expected4[i*N + j] = acc4
+
+      var res8 = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,  a[0].addr, K, 1,
+                qB8[0].addr, N, 1,
+                scales[0].addr, nil, G,
+        0'f32,  res8[0].addr, N, 1
+        )
+      doAssert res8 == expected8
+
+      var res4 = newSeq[float32](M*N)
+      gemm_strided(
+        M, N, K,
+        1'f32,  a[0].addr, K, 1,
+                cast[ptr UInt4](qB4[0].addr), N, 1,
+                scales[0].addr, zero_points[0].addr, G,
+        0'f32,  res4[0].addr, N, 1
+        )
+      doAssert res4 == expected4
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## α = 0 and K = 0: C = activation(βC + bias), A and B are not read"
+    let no_data: ptr float = nil
+    let bias = [-10.0, 1]
+    var res_ab = [[1.0, 2],
+                  [3.0, 4]]
+    gemm_strided(
+      2, 2, 3,
+      0.0,  no_data, 3, 1,
+            no_data, 2, 1,
+      4.0,  res_ab[0][0].addr, 2, 1,
+      colBiasEpilogue(bias[0].unsafeAddr, actRelu)
+      )
+    doAssert res_ab == [[0.0, 9], [2.0, 17]], $res_ab
+
+    var nan_c = [[NaN, NaN]]
+    gemm_strided(
+      1, 2, 0,
+      1.0,  no_data, 0, 1,
+            no_data, 2, 1,
+      0.0,  nan_c[0][0].addr, 2, 1
+      )
+    doAssert nan_c == [[0.0, 0]], $nan_c
     echo "SUCCESS\n"
@@ -0,0 +1,133 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  times, strformat,
+  ../../openmp,
+  ./gemm_tiling, ./gemm
+
+# ############################################################
+#
+#                    GEMM autotuning
+#
+# ############################################################
+
+# The default microkernel is the widest ISA detected and the blocking
+# is derived from the cache sizes. This is not always the fastest:
+# for example Skylake SP with a single AVX512 FMA port may be faster with AVX2
+# and the L2 of some CPUs is shared or exclusive.
+#
+# The autotuner measures on the host, in order:
+#   1. the microkernel ISA (which fixes mr and nr) with the default blocking,
+#   2. the blocking mc and kc of the best microkernel,
+#   3. the parallelization threshold pt: the smallest M = N = K
+#      for which the multithreaded GEMM beats the single-threaded one.
+# and persists the winners in the tuning profile loaded by gemm_tiling at startup.
+#
+# Usage:
+#   nim c -r -d:release -d:openmp laser/primitives/matrix_multiplication/gemm_autotune.nim
+
+const
+  AutotuneKC = [128, 192, 256, 384, 512]
+  AutotuneMC = [48, 96, 144, 192, 288, 384]
+  AutotuneSizes = [80, 96, 128, 160, 192, 256, 320, 384]
+    ## Candidates for pt, small GEMMs below gemm_small thresholds do not apply
+  AutotuneNoParallel = high(int32).int div 4096
+    ## pt so that M*N*K > pt³ is never true, only used to measure the serial GEMM
+
+proc gemm_seconds[T](M, N, K: int, a, b: seq[T], c: var seq[T], nb_samples: int): float =
+  ## Minimum time of `nb_samples` GEMMs with the current tuning
+  result = Inf
+  for _ in 0 ..< nb_samples:
+    let start = epochTime()
+    gemm_strided(
+      M, N, K,
+      T(1), a[0].unsafeAddr, K, 1,
+            b[0].unsafeAddr, N, 1,
+      T(0), c[0].addr, N, 1
+    )
+    result = min(result, epochTime() - start)
+
+proc gemm_autotune*(T: typedesc, size = 1024, nb_samples = 5, verbose = true): GemmTuning =
+  ## Benchmark GEMM microkernels, blockings and parallelization thresholds
+  ## for T on the host and set the best ones in LaserGemmTuning.
+  ## Use `save_gemm_profile` to persist them.
+  let typ = tuning_type(T)
+  let previous = LaserGemmTuning[typ]
+
+  var a = newSeq[T](size * size)
+  var b = newSeq[T](size * size)
+  var c = newSeq[T](size * size)
+  for i in 0 ..< a.len:
+    a[i] = T(i mod 7)
+    b[i] = T(i mod 5)
+
+  template measure(candidate: GemmTuning, M, N, K: int): float =
+    LaserGemmTuning[typ] = candidate
+    gemm_seconds(M, N, K, a, b, c, nb_samples)
+
+  template report(msg: string) =
+    if verbose: echo msg
+
+  # 1. Microkernel ISA with the default blocking
+  var best = GemmTuning(tuned: true, simd: x86_Generic)
+  var best_time = Inf
+  for simd in CPUFeatureX86:
+    if not ukernel_available(T, simd) or not cpu_supports(simd):
+      continue
+    let candidate = GemmTuning(tuned: true, simd: simd)
+    discard measure(candidate, size, size, size) # Warmup
+    let t = measure(candidate, size, size, size)
+    report &"{$T:>7} {$simd:<12} default blocking: {t * 1000:>8.3f} ms"
+    if t < best_time:
+      best = candidate
+      best_time = t
+
+  # 2. Blocking
+  for kc in AutotuneKC:
+    for mc in AutotuneMC:
+      var candidate = best
+      candidate.mc = mc
+      candidate.kc = kc
+      let t = measure(candidate, size, size, size)
+      report &"{$T:>7} {$best.simd:<12} mc {mc:>4} kc {kc:>4}: {t * 1000:>8.3f} ms"
+      if t < best_time:
+        best = candidate
+        best_time = t
+
+  # 3. Parallelization threshold
+  # If no size is faster in parallel, pt stays 0 and the compiled default is used:
+  # persisting the serial sentinel would disable threading for every shape.
+  best.pt = 0
+  if omp_get_max_threads() > 1:
+    for s in AutotuneSizes:
+      var serial = best
+      serial.pt = AutotuneNoParallel
+      var parallel = best
+      parallel.pt = 1
+      let t_serial = measure(serial, s, s, s)
+      let t_parallel = measure(parallel, s, s, s)
+      report &"{$T:>7} pt {s:>4}: serial {t_serial * 1000:>8.3f} ms, parallel {t_parallel * 1000:>8.3f} ms"
+      if t_parallel < t_serial:
+        # Parallelize if M*N*K > pt³ so pt is just below s
+        best.pt = s - 1
+        break
+    if best.pt == 0:
+      report &"{$T:>7} pt: no size up to {AutotuneSizes[^1]} is faster in parallel, keeping the default"
+
+  report &"{$T:>7} tuned: {best.simd}, mc {best.mc}, kc {best.kc}, pt {best.pt}"
+  LaserGemmTuning[typ] = best
+  result = best
+
+  if previous.tuned and previous.simd != best.simd and verbose:
+    echo &"{$T:>7} previous profile used {previous.simd}"
+
+when isMainModule:
+  discard gemm_autotune(float32)
+  discard gemm_autotune(float64)
+  discard gemm_autotune(int32)
+  discard gemm_autotune(int64)
+  save_gemm_profile()
+  echo "\nGEMM profile saved to ", gemm_profile_path()
@@ -0,0 +1,372 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../compiler_optim_hints, ../../openmp,
+  ../../private/[align_unroller, memory],
+  ./gemm_tiling, ./gemm_utils, ./gemm_packing,
+  ./gemm_ukernel_dispatch, ./gemm, ./gemm_prepacked
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#              Batched Matrix Multiplication
+#
+# ############################################################
+
+# Calling gemm_strided in a loop has the following overhead per matrix:
+#   - computing the blocking and workspace size
+#   - repacking the B operand even when it is shared across the batch
+#   - opening a parallel region even when the matrix is too small to benefit
+#
+# Instead:
+#   - small matrices are processed in parallel across the batch,
+#     each thread reusing its own Tiles and multiplying serially.
+#   - large matrices are processed one after the other,
+#     reusing the same Tiles and parallelizing within each GEMM.
+#   - a B shared by the whole batch is packed once.
+
+type
+  BatchedView[T] = object
+    ## Either a base pointer with a batch stride
+    ## or an array of pointers to each matrix of the batch
+    base: ptr UncheckedArray[T]
+    batchStride: int
+    ptrs: ptr UncheckedArray[ptr T]
+    shared: bool # The same matrix is used for the whole batch
+
+func toBatchedView[T](data: ptr T, batchStride: int): BatchedView[T] {.inline.} =
+  result.base = cast[ptr UncheckedArray[T]](data)
+  result.batchStride = batchStride
+  result.shared = batchStride == 0
+
+func toBatchedView[T](data: openarray[ptr T]): BatchedView[T] =
+  if data.len == 0:
+    # Empty batch, there is no matrix to point to
+    return
+  result.ptrs = cast[ptr UncheckedArray[ptr T]](data[0].unsafeAddr)
+  result.shared = true
+  for i in 1 ..< data.len:
+    if data[i] != data[0]:
+      result.shared = false
+      break
+
+func matrix[T](bv: BatchedView[T], b: int): ptr T {.inline.} =
+  ## Returns a pointer to the b-th matrix of the batch
+  if bv.ptrs.isNil:
+    bv.base[b * bv.batchStride].addr
+  else:
+    bv.ptrs[b]
+
+# ############################################################
+#
+#              Batched GEMM Internal Implementation
+#
+# ############################################################
+
+proc gemm_batched_impl[T; ukernel: static MicroKernel](
+      batch, M, N, K: int,
+      alpha: T,
+      bA: BatchedView[T], rowStrideA, colStrideA: int,
+      bB: BatchedView[T], rowStrideB, colStrideB: int,
+      beta: T,
+      bC: BatchedView[T], rowStrideC, colStrideC: int
+    ) =
+
+  # αAB does not contribute and K = 0 would give an empty kc
+  # for the prepacked B and the pc loop
+  if alpha == 0.T or K == 0:
+    for b in 0 ..< batch:
+      gemm_scale_epilogue(
+        M, N, beta,
+        bC.matrix(b).toMatrixView(rowStrideC, colStrideC),
+        Epilogue[T]()
+      )
+    return
+
+  let PT = ukernel.parallel_threshold(T)
+  let parallelize_batch = batch > 1 and M*N*K <= PT*PT*PT
+  let nb_tiles = if parallelize_batch: omp_get_max_threads().int
+                 else: 1
+
+  # Workspace layout: the shared packed B if any, then one Tiles per thread.
+  # It is cached by the calling thread and reused across calls
+  # unless GEMM_NO_CACHED_WORKSPACE is defined.
+  let packedB_size = if bB.shared:
+                       round_step_up(
+                         gemm_prepackB_mem_required_impl(ukernel, T, M, N, K),
+                         LASER_MEM_ALIGN
+                       )
+                     else: 0
+  let tiles_size = ukernel.tiles_mem_required(T, M, N, K)
+  let mem_required = packedB_size + nb_tiles * tiles_size
+  when defined(GEMM_NO_CACHED_WORKSPACE):
+    let ws_alloc = allocShared(mem_required + LASER_MEM_ALIGN - 1)
+    let workspace = align_raw_data(byte, ws_alloc)
+  else:
+    let workspace = gemm_cached_workspace(mem_required)
+
+  template tiles_workspace(t: int): pointer =
+    cast[pointer](cast[ByteAddress](workspace) +% packedB_size +% t * tiles_size)
+
+  # Shared B is packed once for the whole batch
+  let packedB = cast[ptr UncheckedArray[T]](workspace)
+  if bB.shared:
+    gemm_prepackB_impl[T, ukernel](
+      packedB, M, N, K,
+      bB.matrix(0).toMatrixView(rowStrideB, colStrideB)
+    )
+
+  template gemm_one(b: int, tiles: Tiles[T]) =
+    let vA = bA.matrix(b).toMatrixView(rowStrideA, colStrideA)
+    let vC = bC.matrix(b).toMatrixView(rowStrideC, colStrideC)
+    if bB.shared:
+      gemm_packedB_impl[T, ukernel](
+        M, N, K,
+        alpha, vA, packedB,
+        beta, vC,
+        tiles
+      )
+    else:
+      let vB = bB.matrix(b).toMatrixView(rowStrideB, colStrideB)
+      gemm_impl[T, ukernel, T, T](
+        M, N, K,
+        alpha, vA, vB,
+        beta, vC,
+        tiles, Epilogue[T](),
+        Prologue[T](), Prologue[T]()
+      )
+
+  if parallelize_batch:
+    # Small matrices: gemm_impl does not open a parallel region
+    # and we parallelize across the batch instead.
+    # Each thread packs in its own slice of the workspace.
+    omp_parallel:
+      let tiles = ukernel.initTiles(T, M, N, K, tiles_workspace(omp_get_thread_num()))
+      omp_for(b, batch, use_simd=false, nowait=false):
+        gemm_one(b, tiles)
+  else:
+    # Large matrices: parallelize within each GEMM
+    let tiles = ukernel.initTiles(T, M, N, K, tiles_workspace(0))
+    for b in 0 ..< batch:
+      gemm_one(b, tiles)
+
+  when defined(GEMM_NO_CACHED_WORKSPACE):
+    deallocShared(ws_alloc)
+
+# ############################################################
+#
+#   Exported function and dispatch with CPU runtime detection
+#
+# ############################################################
+
+template dispatch_batched(){.dirty.} =
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    template apply(ukernel: MicroKernel): untyped {.dirty.} =
+      gemm_batched_impl[T, ukernel](
+        batch, M, N, K,
+        alpha, bA, rowStrideA, colStrideA,
+               bB, rowStrideB, colStrideB,
+        beta,  bC, rowStrideC, colStrideC
+      )
+      return
+    # All matrices of the batch have the same shape
+    if colStrideC == 1:
+      dispatch_ukernel_shape(cpu_features, T, true, M, N, apply)
+    else:
+      dispatch_ukernel_shape(cpu_features, T, false, M, N, apply)
+
+  # Same microkernel as gemm_strided, including the tuning profile
+  # and the deterministic mode
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+proc gemm_strided_batched*[T: SomeNumber](
+      batch, M, N, K: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA, batchStrideA: int,
+      B: ptr T,
+      rowStrideB, colStrideB, batchStrideB: int,
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC, batchStrideC: int) =
+  ## Compute C[b] = αA[b]*B[b] + βC[b] for b in 0 ..< batch
+  ## with X[b] located at X + b * batchStrideX
+  ##
+  ## A batchStrideB of 0 means that B is shared across the batch,
+  ## it is then only packed once.
+  if batch == 0:
+    return
+
+  let bA = A.toBatchedView(batchStrideA)
+  let bB = B.toBatchedView(batchStrideB)
+  let bC = C.toBatchedView(batchStrideC)
+
+  dispatch_batched()
+
+proc gemm_batched*[T: SomeNumber](
+      M, N, K: int,
+      alpha: T,
+      A: openarray[ptr T],
+      rowStrideA, colStrideA: int,
+      B: openarray[ptr T],
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: openarray[ptr T],
+      rowStrideC, colStrideC: int) =
+  ## Compute C[b] = αA[b]*B[b] + βC[b] for b in 0 ..< A.len
+  ## with X[b] the matrix pointed to by X[b]
+  ##
+  ## If all pointers in B are the same, B is only packed once.
+  doAssert A.len == B.len and A.len == C.len, "A, B and C must have the same batch size"
+  let batch = A.len
+  if batch == 0:
+    return
+
+  let bA = A.toBatchedView()
+  let bB = B.toBatchedView()
+  let bC = C.toBatchedView()
+
+  dispatch_batched()
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  block:
+    echo "\n## Strided batched GEMM with a shared B"
+    let a = [[[1.0, 2, 3],
+              [4.0, 5, 6]],
+             [[7.0, 8, 9],
+              [1.0, 0, 1]],
+             [[0.0, 1, 0],
+              [2.0, 2, 2]]]
+
+    let b = [[1.0, 2],
+             [3.0, 4],
+             [5.0, 6]]
+
+    var expected, res: array[3, array[2, array[2, float]]]
+    for i in 0 ..< 3:
+      gemm_strided(
+        2, 2, 3,
+        1.0,  a[i][0][0].unsafeAddr, 3, 1,
+              b[0][0].unsafeAddr, 2, 1,
+        0.0,  expected[i][0][0].addr, 2, 1
+      )
+
+    gemm_strided_batched(
+      3, 2, 2, 3,
+      1.0,  a[0][0][0].unsafeAddr, 3, 1, 6,
+            b[0][0].unsafeAddr, 2, 1, 0,
+      0.0,  res[0][0][0].addr, 2, 1, 4
+    )
+
+    doAssert res == expected, $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Skinny strided batched GEMM with a shared B and a column-major C"
+    # M = 2 selects the wide register tile for float32 on x86-64
+    const Batch = 3
+    const M = 2
+    const N = 200
+    const K = 33
+
+    var a = newSeq[float32](Batch*M*K)
+    for i in 0 ..< a.len:
+      a[i] = float32(i mod 7) - 3
+    var b = newSeq[float32](K*N)
+    for i in 0 ..< b.len:
+      b[i] = float32(i mod 5) - 2
+
+    var expected = newSeq[float32](Batch*M*N)
+    for bt in 0 ..< Batch:
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          var acc = 0'f32
+          for k in 0 ..< K:
+            acc += a[bt*M*K + i*K + k] * b[k*N + j]
+          expected[bt*M*N + j*M + i] = acc
+
+    var res = newSeq[float32](Batch*M*N)
+    gemm_strided_batched(
+      Batch, M, N, K,
+      1'f32,  a[0].addr, K, 1, M*K,
+              b[0].addr, N, 1, 0,
+      0'f32,  res[0].addr, 1, M, M*N
+    )
+
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Pointer-array batched GEMM"
+    let a = [[[1, 2],
+              [3, 4]],
+             [[5, 6],
+              [7, 8]]]
+
+    let b = [[[1, 0],
+              [0, 1]],
+             [[2, 1],
+              [1, 2]]]
+
+    let expected = [[[ 1, 2],
+                     [ 3, 4]],
+                    [[16,17],
+                     [22,23]]]
+
+    var res: array[2, array[2, array[2, int]]]
+    gemm_batched(
+      2, 2, 2,
+      1,  [a[0][0][0].unsafeAddr, a[1][0][0].unsafeAddr], 2, 1,
+          [b[0][0][0].unsafeAddr, b[1][0][0].unsafeAddr], 2, 1,
+      0,  [res[0][0][0].addr, res[1][0][0].addr], 2, 1
+    )
+
+    doAssert res == expected, $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## Empty batch"
+    let empty: seq[ptr float32] = @[]
+    doAssert empty.toBatchedView().ptrs.isNil
+
+    gemm_batched(
+      2, 2, 2,
+      1'f32, empty, 2, 1,
+             empty, 2, 1,
+      0'f32, empty, 2, 1
+    )
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## K = 0 with a shared B: C[b] = βC[b], A and B are not read"
+    let no_data: ptr float32 = nil
+    var c = [[[1'f32, 2], [3'f32, 4]],
+             [[5'f32, 6], [7'f32, 8]]]
+    gemm_strided_batched(
+      2, 2, 2, 0,
+      1'f32,  no_data, 0, 1, 0,
+              no_data, 2, 1, 0,
+      3'f32,  c[0][0][0].addr, 2, 1, 4
+    )
+    doAssert c == [[[3'f32, 6], [9'f32, 12]],
+                   [[15'f32, 18], [21'f32, 24]]], $c
+
+    var nan_c = [[NaN.float32, NaN.float32]]
+    gemm_strided_batched(
+      1, 1, 2, 5,
+      0'f32,  no_data, 5, 1, 0,
+              no_data, 2, 1, 0,
+      0'f32,  nan_c[0][0].addr, 2, 1, 2
+    )
+    doAssert nan_c == [[0'f32, 0]], $nan_c
+    echo "SUCCESS\n"
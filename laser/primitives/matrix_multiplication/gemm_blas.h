@@ -0,0 +1,49 @@
+/* Laser
+ * Copyright (c) 2018 Mamy André-Ratsimbazafy
+ * Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+ * This file may not be copied, modified, or distributed except according to those terms.
+ *
+ * Extensions of liblaser_blas, see gemm_blas.nim.
+ * cblas_sgemm, cblas_dgemm, sgemm_ and dgemm_ are declared by the usual cblas.h and BLAS headers.
+ */
+
+#ifndef LASER_GEMM_BLAS_H
+#define LASER_GEMM_BLAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* C = alpha * A * B + beta * C
+ * with A [M, K], B [K, N] and C [M, N] and arbitrary row and column strides in elements,
+ * for example a row-major A has rowStrideA = lda and colStrideA = 1. */
+void laser_sgemm_strided(
+    ptrdiff_t M, ptrdiff_t N, ptrdiff_t K,
+    float alpha, const float *A, ptrdiff_t rowStrideA, ptrdiff_t colStrideA,
+                 const float *B, ptrdiff_t rowStrideB, ptrdiff_t colStrideB,
+    float beta,  float *C,       ptrdiff_t rowStrideC, ptrdiff_t colStrideC);
+
+void laser_dgemm_strided(
+    ptrdiff_t M, ptrdiff_t N, ptrdiff_t K,
+    double alpha, const double *A, ptrdiff_t rowStrideA, ptrdiff_t colStrideA,
+                  const double *B, ptrdiff_t rowStrideB, ptrdiff_t colStrideB,
+    double beta,  double *C,       ptrdiff_t rowStrideC, ptrdiff_t colStrideC);
+
+void laser_igemm_strided(
+    ptrdiff_t M, ptrdiff_t N, ptrdiff_t K,
+    int32_t alpha, const int32_t *A, ptrdiff_t rowStrideA, ptrdiff_t colStrideA,
+                   const int32_t *B, ptrdiff_t rowStrideB, ptrdiff_t colStrideB,
+    int32_t beta,  int32_t *C,       ptrdiff_t rowStrideC, ptrdiff_t colStrideC);
+
+/* Free the packing buffers cached by the calling thread and its GC state,
+ * call it before a thread that used the library exits */
+void laser_gemm_release_workspace(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LASER_GEMM_BLAS_H */
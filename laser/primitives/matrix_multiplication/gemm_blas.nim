@@ -0,0 +1,446 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ./gemm, ./gemm_tiling
+
+# ############################################################
+#
+#              BLAS and CBLAS compatible C ABI
+#
+# ############################################################
+
+# Compiled as a shared library, this exports the BLAS GEMM symbols
+# so that laser can replace OpenBLAS or MKL without changing the callers:
+#   - cblas_sgemm and cblas_dgemm (cblas.h)
+#   - sgemm_ and dgemm_, the Fortran 77 interface, column-major with arguments by reference
+# and extensions for strided and integer matrices declared in gemm_blas.h:
+#   - laser_sgemm_strided, laser_dgemm_strided, laser_igemm_strided (int32)
+#     with arbitrary row and column strides instead of a layout and a leading dimension
+#   - laser_gemm_release_workspace to free the packing buffers of the calling thread
+#
+# Build with
+#   nimble blas
+# and swap it in with, for example
+#   LD_PRELOAD=./build/liblaser_blas.so ./my_service
+#
+# Integers are 32-bit (LP64 BLAS), like the default builds of OpenBLAS and reference BLAS.
+#
+# Layouts and transpositions are mapped onto row and column strides,
+# a row-major matrix is a transposed column-major one:
+#
+#   Layout     | Transpose | Row stride | Column stride
+#   -----------|-----------|------------|--------------
+#   row-major  | no        | ld         | 1
+#   row-major  | yes       | 1          | ld
+#   col-major  | no        | 1          | ld
+#   col-major  | yes       | ld         | 1
+#
+# Conjugate transpose is transpose for real matrices.
+# Invalid arguments are reported on stderr like xerbla, then the call returns.
+#
+# The library is called from threads the Nim runtime did not create.
+# It is built with --threads:on: the runtime is initialized by the library
+# constructor when it is loaded, on the loading thread, and the other threads
+# are registered with the GC on their first call.
+# GEMM does not allocate on the GC heap on its hot paths, but an assertion
+# or an error message would.
+# A thread that used the library should call laser_gemm_release_workspace
+# before it exits to free its packing buffers and its GC state.
+
+type
+  CblasOrder = enum
+    CblasRowMajor = 101
+    CblasColMajor = 102
+
+  CblasTranspose = enum
+    CblasNoTrans = 111
+    CblasTrans = 112
+    CblasConjTrans = 113
+
+proc c_fprintf(f: File, frmt: cstring): cint {.importc: "fprintf", header: "<stdio.h>", varargs, discardable.}
+
+when isMainModule:
+  var last_illegal: tuple[routine: string, param: int]
+    ## Last argument reported by xerbla, for the tests
+
+when compileOption("threads"):
+  let blas_init_thread = getThreadId()
+    ## Thread that loaded the library and ran the Nim initialization
+  var blas_thread_attached {.threadvar.}: bool
+
+proc blas_attach_thread() {.inline.} =
+  ## Register the calling thread with the GC if it is a foreign thread
+  when compileOption("threads"):
+    if not blas_thread_attached:
+      blas_thread_attached = true
+      if getThreadId() != blas_init_thread:
+        setupForeignThreadGc()
+
+proc blas_detach_thread() =
+  when compileOption("threads"):
+    if blas_thread_attached:
+      blas_thread_attached = false
+      if getThreadId() != blas_init_thread:
+        teardownForeignThreadGc()
+
+proc xerbla(routine: cstring, param: int) =
+  ## Report an illegal argument like the reference BLAS
+  c_fprintf(stderr, " ** On entry to %s parameter number %d had an illegal value\n",
+            routine, cint param)
+  when isMainModule:
+    last_illegal = ($routine, param)
+
+func strides(col_major, transpose: bool, ld: int): tuple[row, col: int] {.inline.} =
+  if col_major xor transpose: (1, ld)
+  else: (ld, 1)
+
+proc scale[T](M, N: int, beta: T, C: ptr T, rowStrideC, colStrideC: int) =
+  ## C = βC, C is not read if β = 0 as in the reference BLAS
+  let vC = cast[ptr UncheckedArray[T]](C)
+  for i in 0 ..< M:
+    for j in 0 ..< N:
+      let c = vC[i*rowStrideC + j*colStrideC].addr
+      c[] = if beta == 0.T: 0.T else: beta * c[]
+
+proc blas_gemm[T](
+      routine: cstring, first_param: int,
+      col_major, transA, transB: bool,
+      M, N, K: int,
+      alpha: T, A: ptr T, lda: int,
+                B: ptr T, ldb: int,
+      beta: T,  C: ptr T, ldc: int) =
+  ## GEMM with BLAS semantics.
+  ## Parameters are numbered as in the Fortran interface
+  ## and reported from `first_param` on.
+  let minLda = if col_major xor transA: M else: K
+  let minLdb = if col_major xor transB: K else: N
+  let minLdc = if col_major: M else: N
+
+  var param = 0
+  if M < 0: param = 3
+  elif N < 0: param = 4
+  elif K < 0: param = 5
+  elif lda < max(1, minLda): param = 8
+  elif ldb < max(1, minLdb): param = 10
+  elif ldc < max(1, minLdc): param = 13
+  if param != 0:
+    xerbla(routine, param + first_param - 1)
+    return
+
+  # Quick return
+  if M == 0 or N == 0 or ((alpha == 0.T or K == 0) and beta == 1.T):
+    return
+
+  let (rowStrideC, colStrideC) = strides(col_major, false, ldc)
+  if alpha == 0.T or K == 0:
+    scale(M, N, beta, C, rowStrideC, colStrideC)
+    return
+
+  let (rowStrideA, colStrideA) = strides(col_major, transA, lda)
+  let (rowStrideB, colStrideB) = strides(col_major, transB, ldb)
+
+  gemm_strided(
+    M, N, K,
+    alpha, A, rowStrideA, colStrideA,
+           B, rowStrideB, colStrideB,
+    beta,  C, rowStrideC, colStrideC
+  )
+
+proc cblas_gemm[T](
+      routine: cstring,
+      order, transA, transB: cint,
+      M, N, K: cint,
+      alpha: T, A: ptr T, lda: cint,
+                B: ptr T, ldb: cint,
+      beta: T,  C: ptr T, ldc: cint) {.inline.} =
+  template valid_trans(t: cint): bool =
+    t == CblasNoTrans.cint or t == CblasTrans.cint or t == CblasConjTrans.cint
+
+  # CBLAS parameters are shifted by the layout parameter
+  if order != CblasRowMajor.cint and order != CblasColMajor.cint:
+    xerbla(routine, 1)
+  elif not transA.valid_trans:
+    xerbla(routine, 2)
+  elif not transB.valid_trans:
+    xerbla(routine, 3)
+  else:
+    blas_gemm(
+      routine, first_param = 2,
+      order == CblasColMajor.cint,
+      transA != CblasNoTrans.cint, transB != CblasNoTrans.cint,
+      M, N, K,
+      alpha, A, lda,
+             B, ldb,
+      beta,  C, ldc
+    )
+
+proc fortran_gemm[T](
+      routine: cstring,
+      transa, transb: ptr char,
+      m, n, k: ptr cint,
+      alpha: ptr T, a: ptr T, lda: ptr cint,
+                    b: ptr T, ldb: ptr cint,
+      beta: ptr T,  c: ptr T, ldc: ptr cint) {.inline.} =
+  # Fortran passes the length of the character arguments after the last one,
+  # they are always 1 and ignored.
+  template valid_trans(t: char): bool =
+    t in {'N', 'n', 'T', 't', 'C', 'c'}
+
+  if not transa[].valid_trans:
+    xerbla(routine, 1)
+  elif not transb[].valid_trans:
+    xerbla(routine, 2)
+  else:
+    blas_gemm(
+      routine, first_param = 1,
+      col_major = true,
+      transa[] notin {'N', 'n'}, transb[] notin {'N', 'n'},
+      m[], n[], k[],
+      alpha[], a, lda[],
+               b, ldb[],
+      beta[],  c, ldc[]
+    )
+
+# ############################################################
+#
+#                       Exported symbols
+#
+# ############################################################
+
+{.pragma: blas, exportc, dynlib, cdecl.}
+
+proc cblas_sgemm*(
+      order, transA, transB: cint,
+      M, N, K: cint,
+      alpha: float32, A: ptr float32, lda: cint,
+                      B: ptr float32, ldb: cint,
+      beta: float32,  C: ptr float32, ldc: cint) {.blas.} =
+  blas_attach_thread()
+  cblas_gemm("cblas_sgemm", order, transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc)
+
+proc cblas_dgemm*(
+      order, transA, transB: cint,
+      M, N, K: cint,
+      alpha: float64, A: ptr float64, lda: cint,
+                      B: ptr float64, ldb: cint,
+      beta: float64,  C: ptr float64, ldc: cint) {.blas.} =
+  blas_attach_thread()
+  cblas_gemm("cblas_dgemm", order, transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc)
+
+proc sgemm_fortran*(
+      transa, transb: ptr char,
+      m, n, k: ptr cint,
+      alpha: ptr float32, a: ptr float32, lda: ptr cint,
+                          b: ptr float32, ldb: ptr cint,
+      beta: ptr float32,  c: ptr float32, ldc: ptr cint) {.exportc: "sgemm_", dynlib, cdecl.} =
+  blas_attach_thread()
+  fortran_gemm("SGEMM ", transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc)
+
+proc dgemm_fortran*(
+      transa, transb: ptr char,
+      m, n, k: ptr cint,
+      alpha: ptr float64, a: ptr float64, lda: ptr cint,
+                          b: ptr float64, ldb: ptr cint,
+      beta: ptr float64,  c: ptr float64, ldc: ptr cint) {.exportc: "dgemm_", dynlib, cdecl.} =
+  blas_attach_thread()
+  fortran_gemm("DGEMM ", transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc)
+
+template gen_strided(name: untyped, T: typedesc) =
+  proc name*(
+        M, N, K: int,
+        alpha: T, A: ptr T, rowStrideA, colStrideA: int,
+                  B: ptr T, rowStrideB, colStrideB: int,
+        beta: T,  C: ptr T, rowStrideC, colStrideC: int) {.blas.} =
+    ## Compute C = αA*B + βC with arbitrary strides
+    blas_attach_thread()
+    if M <= 0 or N <= 0:
+      return
+    if alpha == 0.T or K <= 0:
+      scale(M, N, beta, C, rowStrideC, colStrideC)
+      return
+    gemm_strided(
+      M, N, K,
+      alpha, A, rowStrideA, colStrideA,
+             B, rowStrideB, colStrideB,
+      beta,  C, rowStrideC, colStrideC
+    )
+
+gen_strided(laser_sgemm_strided, float32)
+gen_strided(laser_dgemm_strided, float64)
+gen_strided(laser_igemm_strided, int32)
+
+proc laser_gemm_release_workspace*() {.blas.} =
+  ## Free the packing buffers cached by the calling thread
+  ## and unregister it from the GC
+  gemm_release_workspace()
+  blas_detach_thread()
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  block:
+    echo "\n## CBLAS and Fortran layouts and transpositions"
+    const M = 37
+    const N = 29
+    const K = 41
+    # Column-major A [M, K] and its transpose, row-major B [K, N] and its transpose
+    var a, at, b, bt: seq[float64]
+    a.setLen M*K
+    at.setLen M*K
+    b.setLen K*N
+    bt.setLen K*N
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i + k*M] = float64((i * k) mod 7) - 3
+        at[k + i*K] = a[i + k*M]
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k*N + j] = float64((k + 2*j) mod 5) - 2
+        bt[j*K + k] = b[k*N + j]
+
+    var expected = newSeq[float64](M*N) # row-major
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        var acc = 0.0
+        for k in 0 ..< K:
+          acc += a[i + k*M] * b[k*N + j]
+        expected[i*N + j] = 2.0 * acc - float64(i + j)
+
+    template init_c(col_major: bool): seq[float64] =
+      var c = newSeq[float64](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          if col_major: c[i + j*M] = float64(i + j)
+          else: c[i*N + j] = float64(i + j)
+      c
+
+    # `a` is A column-major, `at` is A row-major,
+    # `b` is B row-major, `bt` is B column-major
+    block:
+      var c = init_c(false)
+      cblas_dgemm(CblasRowMajor.cint, CblasNoTrans.cint, CblasTrans.cint,
+                  M, N, K, 2.0, at[0].addr, K, bt[0].addr, K, -1.0, c[0].addr, N)
+      doAssert c == expected
+    block:
+      var c = init_c(false)
+      cblas_dgemm(CblasRowMajor.cint, CblasTrans.cint, CblasNoTrans.cint,
+                  M, N, K, 2.0, a[0].addr, M, b[0].addr, N, -1.0, c[0].addr, N)
+      doAssert c == expected
+    block:
+      var c = init_c(true)
+      cblas_dgemm(CblasColMajor.cint, CblasNoTrans.cint, CblasTrans.cint,
+                  M, N, K, 2.0, a[0].addr, M, b[0].addr, N, -1.0, c[0].addr, M)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert c[i + j*M] == expected[i*N + j]
+    block:
+      var c = init_c(true)
+      var
+        transa = 'T'
+        transb = 'n'
+        m = M.cint
+        n = N.cint
+        k = K.cint
+        lda = K.cint
+        ldb = K.cint
+        ldc = M.cint
+        alpha = 2.0
+        beta = -1.0
+      dgemm_fortran(transa.addr, transb.addr, m.addr, n.addr, k.addr,
+                    alpha.addr, at[0].addr, lda.addr, bt[0].addr, ldb.addr,
+                    beta.addr, c[0].addr, ldc.addr)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert c[i + j*M] == expected[i*N + j]
+    block:
+      # α = 0: C = βC
+      var c = init_c(false)
+      cblas_dgemm(CblasRowMajor.cint, CblasNoTrans.cint, CblasNoTrans.cint,
+                  M, N, K, 0.0, at[0].addr, K, b[0].addr, N, 3.0, c[0].addr, N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert c[i*N + j] == 3.0 * float64(i + j)
+    echo "SUCCESS\n"
+
+    echo "\n## Single-precision CBLAS"
+    block:
+      # All values are small integers, the float32 result is exact
+      var at32, b32: seq[float32]
+      for x in at: at32.add float32(x)
+      for x in b: b32.add float32(x)
+      var c = newSeq[float32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          c[i*N + j] = float32(i + j)
+      cblas_sgemm(CblasRowMajor.cint, CblasNoTrans.cint, CblasNoTrans.cint,
+                  M, N, K, 2'f32, at32[0].addr, K, b32[0].addr, N, -1'f32, c[0].addr, N)
+      for i in 0 ..< M*N:
+        doAssert c[i] == float32(expected[i])
+    echo "SUCCESS\n"
+
+    echo "\n## Strided int32 GEMM"
+    block:
+      # A row-major, B column-major, C column-major
+      var a32, bt32: seq[int32]
+      for x in at: a32.add int32(x)
+      for x in bt: bt32.add int32(x)
+      var c = newSeq[int32](M*N)
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          c[i + j*M] = int32(i + j)
+      laser_igemm_strided(
+        M, N, K,
+        2'i32,  a32[0].addr, K, 1,
+                bt32[0].addr, 1, K,
+        -1'i32, c[0].addr, 1, M
+      )
+      for i in 0 ..< M:
+        for j in 0 ..< N:
+          doAssert c[i + j*M] == int32(expected[i*N + j])
+    echo "SUCCESS\n"
+
+    echo "\n## Illegal arguments are reported and C is left untouched"
+    block:
+      # Row-major A not transposed needs lda >= K, lda is parameter 9 in CBLAS
+      var c = init_c(false)
+      let c_before = c
+      last_illegal = ("", 0)
+      cblas_dgemm(CblasRowMajor.cint, CblasNoTrans.cint, CblasNoTrans.cint,
+                  M, N, K, 2.0, at[0].addr, K-1, b[0].addr, N, -1.0, c[0].addr, N)
+      doAssert last_illegal == ("cblas_dgemm", 9), $last_illegal
+      doAssert c == c_before
+    block:
+      # Column-major C needs ldc >= M, ldc is parameter 13 in Fortran
+      var c = init_c(true)
+      let c_before = c
+      var
+        transa = 'N'
+        transb = 'N'
+        m = M.cint
+        n = N.cint
+        k = K.cint
+        lda = M.cint
+        ldb = K.cint
+        ldc = cint(M-1)
+        alpha = 2.0
+        beta = -1.0
+      last_illegal = ("", 0)
+      dgemm_fortran(transa.addr, transb.addr, m.addr, n.addr, k.addr,
+                    alpha.addr, a[0].addr, lda.addr, bt[0].addr, ldb.addr,
+                    beta.addr, c[0].addr, ldc.addr)
+      doAssert last_illegal == ("DGEMM ", 13), $last_illegal
+      doAssert c == c_before
+    block:
+      # Invalid transposition of B, C is not accessed
+      last_illegal = ("", 0)
+      cblas_sgemm(CblasRowMajor.cint, CblasNoTrans.cint, 0,
+                  M, N, K, 1'f32, nil, K, nil, N, 0'f32, nil, N)
+      doAssert last_illegal == ("cblas_sgemm", 3), $last_illegal
+    echo "SUCCESS\n"
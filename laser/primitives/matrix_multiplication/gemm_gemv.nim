@@ -0,0 +1,315 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../compiler_optim_hints, ../../openmp,
+  ../../private/[align_unroller, memory],
+  ./gemm_tiling, ./gemm_utils, ./gemm_ukernel_generic,
+  ./gemm_ukernel_sse, ./gemm_ukernel_sse2,
+  ./gemm_ukernel_avx, ./gemm_ukernel_avx_fma,
+  ./gemm_ukernel_avx512
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#        Matrix-Vector multiplication (M = 1 or N = 1)
+#
+# ############################################################
+
+# When M = 1 or N = 1 (batch-1 inference, Dense layer at decoding time)
+# an MR*NR microkernel wastes all but one row or column of its register tile
+# and packing costs as much as the multiplication itself.
+#
+# GEMV is memory-bandwidth bound: each element of the matrix is used once.
+# We reformulate both cases as y[n] = Σk W[n, k] * x[k]
+#   - N = 1: y = C[:, 0], W = A,  x = B[:, 0]
+#   - M = 1: y = C[0, :], W = Bᵀ, x = A[0, :]
+# and pick a kernel depending on which dimension of W is contiguous:
+#   - k contiguous: dot products with multiple SIMD accumulators
+#                   to hide the FMA latency
+#   - n contiguous: axpy y[n:n+tile] += x[k] * W[n:n+tile, k]
+#                   on a tile of y that stays in L1
+#   - otherwise:    scalar dot products
+#
+# The n dimension is parallelized with omp_parallel_chunks,
+# each thread owns a disjoint range of y.
+# Short outputs with a long K (dot products, few output features)
+# would leave threads idle, K is split instead: each thread computes
+# a partial y over a slice of K and the partial sums are reduced at the end.
+
+const
+  GEMV_TILE = 256
+    ## Number of outputs of y accumulated in L1
+    ## before applying α, β and the epilogue
+  GEMV_SPLITK_MIN_DEPTH = 4096
+    ## Minimum depth of a K slice when K is split between threads
+
+# ############################################################
+#
+#                    SIMD kernels
+#
+# ############################################################
+
+# The SIMD dot and axpy kernels are generated by `gemv_kernels_generator`
+# in the gemm_ukernel_<isa> files to be compiled with their SIMD flags.
+
+proc dot_fallback[T](x, y: ptr UncheckedArray[T], len: int): T =
+  ## Σ x[i] * y[i] with 4 accumulators.
+  ## The compiler vectorizes it for integers.
+  let x{.restrict.} = x
+  let y{.restrict.} = y
+  var acc0, acc1, acc2, acc3: T
+  let unroll_stop = round_step_down(len, 4)
+  for i in countup(0, unroll_stop - 1, 4):
+    acc0 += x[i  ] * y[i  ]
+    acc1 += x[i+1] * y[i+1]
+    acc2 += x[i+2] * y[i+2]
+    acc3 += x[i+3] * y[i+3]
+  result = (acc0 + acc1) + (acc2 + acc3)
+  for i in unroll_stop ..< len:
+    result += x[i] * y[i]
+
+proc axpy_fallback[T](y: ptr UncheckedArray[T], a: T, x: ptr UncheckedArray[T], len: int) =
+  ## y += a * x
+  let x{.restrict.} = x
+  let y{.restrict.} = y
+  for i in `||`(0, len-1, "simd"):
+    y[i] += a * x[i]
+
+proc dot*[T; simd: static CPUFeatureX86](x, y: ptr UncheckedArray[T], len: int): T {.inline.} =
+  ## Σ x[i] * y[i] with the SIMD kernel of `simd`
+  when T is float32 and simd == x86_SSE:           result = dot_sse(x, y, len)
+  elif T is float64 and simd == x86_SSE2:          result = dot_sse2(x, y, len)
+  elif T is SomeFloat and simd == x86_AVX:         result = dot_avx(x, y, len)
+  elif T is SomeFloat and simd == x86_AVX_FMA:     result = dot_avx_fma(x, y, len)
+  elif T is SomeFloat and simd == x86_AVX512:      result = dot_avx512(x, y, len)
+  else:                                            result = dot_fallback(x, y, len)
+
+proc axpy*[T; simd: static CPUFeatureX86](y: ptr UncheckedArray[T], a: T, x: ptr UncheckedArray[T], len: int) {.inline.} =
+  ## y += a * x with the SIMD kernel of `simd`
+  when T is float32 and simd == x86_SSE:           axpy_sse(y, a, x, len)
+  elif T is float64 and simd == x86_SSE2:          axpy_sse2(y, a, x, len)
+  elif T is SomeFloat and simd == x86_AVX:         axpy_avx(y, a, x, len)
+  elif T is SomeFloat and simd == x86_AVX_FMA:     axpy_avx_fma(y, a, x, len)
+  elif T is SomeFloat and simd == x86_AVX512:      axpy_avx512(y, a, x, len)
+  else:                                            axpy_fallback(y, a, x, len)
+
+# ############################################################
+#
+#                    GEMV implementation
+#
+# ############################################################
+
+proc gemv_tile[T; simd: static CPUFeatureX86](
+      nt, K: int,
+      alpha: T, W: MatrixView[T], x: MatrixView[T],
+      beta: T, vY: MatrixView[T],
+      epilogue: Epilogue[T]
+    ) =
+  ## Compute y[0:nt] = activation(α W[0:nt, :] * x + βy + bias)
+  ## x is a column vector: x[k, 0]
+  ## y and the bias are column vectors: y[n, 0]
+  var Y{.align_variable.}: array[GEMV_TILE, array[1, T]]
+  let y = cast[ptr UncheckedArray[T]](Y[0][0].addr)
+
+  template ptrW(n, k: int): ptr UncheckedArray[T] =
+    cast[ptr UncheckedArray[T]](W.buffer[n * W.rowStride + k * W.colStride].addr)
+
+  if W.colStride == 1 and x.rowStride == 1:
+    for n in 0 ..< nt:
+      y[n] = dot[T, simd](ptrW(n, 0), x.buffer, K)
+  elif W.rowStride == 1:
+    for k in 0 ..< K:
+      axpy[T, simd](y, x[k, 0], ptrW(0, k), nt)
+  else:
+    for n in 0 ..< nt:
+      var acc: T
+      for k in 0 ..< K:
+        acc += W[n, k] * x[k, 0]
+      y[n] = acc
+
+  gebb_ukernel_edge_epilogue(
+    alpha, Y.addr,
+    beta, vY, nt, 1,
+    epilogue
+  )
+
+proc gemv_nb_splits(T: typedesc, N, K: int): int =
+  ## Number of K slices of a GEMV with N outputs,
+  ## 1 if it is not split.
+  ##
+  ## Parallelizing is only worth it if each thread gets
+  ## enough of the matrix to saturate its memory bandwidth.
+  ## With fewer outputs than threads K is split.
+  ## The summation order of the slices depends on the number of threads,
+  ## like the split-K GEMM this is disabled in deterministic mode.
+  result = 1
+  when defined(openmp):
+    let nb_threads = omp_get_max_threads().int
+    if N * K > OMP_MEMORY_BOUND_GRAIN_SIZE * nb_threads and
+        N < nb_threads and N <= GEMV_TILE and not gemm_deterministic(T).enabled:
+      result = max(1, min(nb_threads, K div GEMV_SPLITK_MIN_DEPTH))
+
+func gemv_splitk_mem_required(T: typedesc, N, nb_splits: int): int {.inline.} =
+  ## Size in bytes of the partial sums of the split-K GEMV
+  nb_splits * round_step_up(N * T.sizeof, LASER_MEM_ALIGN)
+
+proc gemv_splitk[T; simd: static CPUFeatureX86](
+      N, K, nb_splits: int,
+      alpha: T, W: MatrixView[T], x: MatrixView[T],
+      beta: T, vY: MatrixView[T],
+      epilogue: Epilogue[T],
+      workspace: pointer
+    ) =
+  ## Compute y = activation(α W * x + βy + bias)
+  ## with W [N, K], N <= GEMV_TILE, and K split in `nb_splits` slices
+  ##
+  ## The partial sums are carved from `workspace`, of at least
+  ## `gemv_splitk_mem_required(T, N, nb_splits)` bytes,
+  ## or if it is nil from the workspace cached by the calling thread.
+  ## GEMV must not allocate on the GC heap as it may run on foreign threads.
+  let split_k = get_num_tiles(K, nb_splits)
+  # Each partial y on its own cache lines
+  let partial_stride = round_step_up(N * T.sizeof, LASER_MEM_ALIGN) div T.sizeof
+  var ws_alloc: pointer
+  var partial: ptr UncheckedArray[T]
+  if not workspace.isNil:
+    partial = cast[ptr UncheckedArray[T]](workspace)
+  else:
+    let mem_required = gemv_splitk_mem_required(T, N, nb_splits)
+    when defined(GEMM_NO_CACHED_WORKSPACE):
+      ws_alloc = allocShared(mem_required + LASER_MEM_ALIGN - 1)
+      partial = align_raw_data(T, ws_alloc)
+    else:
+      partial = cast[ptr UncheckedArray[T]](gemm_cached_workspace(mem_required))
+
+  # One slice per thread into its private partial y
+  omp_parallel:
+    omp_for(s, nb_splits, use_simd = false, nowait = true):
+      let pc = s * split_k
+      let kc = min(K - pc, split_k)
+      gemv_tile[T, simd](
+        N, kc,
+        1.T, W.stride(0, pc), x.stride(pc, 0),
+        0.T, partial[s * partial_stride].addr.toMatrixView(rowStride = 1, colStride = 1),
+        Epilogue[T]()
+      )
+
+  var Y{.align_variable.}: array[GEMV_TILE, array[1, T]]
+  for n in 0 ..< N:
+    var sum = partial[n]
+    for s in 1 ..< nb_splits:
+      sum += partial[s * partial_stride + n]
+    Y[n][0] = sum
+  if not ws_alloc.isNil:
+    deallocShared(ws_alloc)
+
+  gebb_ukernel_edge_epilogue(
+    alpha, Y.addr,
+    beta, vY, N, 1,
+    epilogue
+  )
+
+proc gemv_impl[T; simd: static CPUFeatureX86](
+      N, K: int,
+      alpha: T, W: MatrixView[T], x: MatrixView[T],
+      beta: T, vY: MatrixView[T],
+      epilogue: Epilogue[T],
+      workspace: pointer
+    ) =
+  ## Compute y = activation(α W * x + βy + bias)
+  ## with W [N, K], x [K, 1], y [N, 1]
+  template gemv_range(offset, len: int) =
+    for n in countup(offset, offset + len - 1, GEMV_TILE):
+      let nt = min(offset + len - n, GEMV_TILE)
+      gemv_tile[T, simd](
+        nt, K,
+        alpha, W.stride(n, 0), x,
+        beta, vY.stride(n, 0),
+        epilogue.stride(n, 0)
+      )
+
+  # Parallelizing is only worth it if each thread gets
+  # enough of the matrix to saturate its memory bandwidth.
+  let nb_threads = omp_get_max_threads().int
+  if N * K <= OMP_MEMORY_BOUND_GRAIN_SIZE * nb_threads:
+    gemv_range(0, N)
+    return
+
+  # Fewer outputs than threads: split K
+  let nb_splits = gemv_nb_splits(T, N, K)
+  if nb_splits > 1:
+    gemv_splitk[T, simd](N, K, nb_splits, alpha, W, x, beta, vY, epilogue, workspace)
+    return
+
+  omp_parallel_chunks(N, chunk_offset, chunk_size, omp_grain_size = 1):
+    gemv_range(chunk_offset, chunk_size)
+
+func transposed[T](view: MatrixView[T]): MatrixView[T] {.inline.} =
+  result.buffer = view.buffer
+  result.rowStride = view.colStride
+  result.colStride = view.rowStride
+
+proc gemv_dispatch[T; simd: static CPUFeatureX86](
+      M, N, K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T],
+      workspace: pointer
+    ) =
+  if N == 1:
+    # C[:, 0] = A * B[:, 0]
+    gemv_impl[T, simd](
+      M, K,
+      alpha, vA, vB,
+      beta, vC,
+      epilogue,
+      workspace
+    )
+  else:
+    # C[0, :]ᵀ = Bᵀ * A[0, :]ᵀ
+    var epiT = epilogue
+    epiT.bias = epilogue.bias.transposed
+    gemv_impl[T, simd](
+      N, K,
+      alpha, vB.transposed, vA.transposed,
+      beta, vC.transposed,
+      epiT,
+      workspace
+    )
+
+func is_gemv*(M, N: int): bool {.inline.} =
+  M == 1 or N == 1
+
+proc gemv_mem_required*(T: typedesc, M, N, K: int): int =
+  ## Returns the size in bytes of the workspace of `gemv`
+  ## for a M*N*K matrix multiplication with M = 1 or N = 1.
+  ## It depends on the number of OpenMP threads at the time of the call.
+  let nb_outputs = if N == 1: M else: N
+  let nb_splits = gemv_nb_splits(T, nb_outputs, K)
+  if nb_splits > 1:
+    result = gemv_splitk_mem_required(T, nb_outputs, nb_splits)
+
+proc gemv*[T](
+      M, N, K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T],
+      workspace: pointer = nil
+    ) =
+  ## Compute C = activation(αA*B + βC + bias) for M = 1 or N = 1
+  ## without packing.
+  ##
+  ## A non-nil `workspace` must be aligned on LASER_MEM_ALIGN
+  ## and hold at least `gemv_mem_required(T, M, N, K)` bytes,
+  ## otherwise a workspace cached by the calling thread is used if needed.
+  template dispatch(simd: static CPUFeatureX86): untyped =
+    gemv_dispatch[T, simd](M, N, K, alpha, vA, vB, beta, vC, epilogue, workspace)
+    return
+
+  # Same ISA as the GEMM microkernels, including the one pinned by the
+  # deterministic mode: the number of SIMD accumulators of the dot products depends on it.
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
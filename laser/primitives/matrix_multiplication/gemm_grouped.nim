@@ -0,0 +1,265 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  algorithm,
+  ../../compiler_optim_hints, ../../openmp,
+  ../../private/[align_unroller, memory],
+  ./gemm_tiling, ./gemm_utils, ./gemm_packing,
+  ./gemm_ukernel_dispatch, ./gemm
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#        Grouped Matrix Multiplication (ragged batches)
+#
+# ############################################################
+
+# Groups share N and K but each has its own M, A, B and C,
+# for example the tokens routed to each expert of a mixture-of-experts layer.
+#
+# Calling gemm_strided per group opens one parallel region per group:
+# small groups do not have enough ic and jr iterations for all cores
+# and the cores wait at the end of each region.
+#
+# Instead the mc*nc blocks of C of all groups form a single work list
+# distributed dynamically over the threads of one parallel region.
+# Each task packs its own panel of B and blocks of A, for all kc slices,
+# and there is no barrier between tasks.
+#
+# As panels of B are private to each thread, nc is divided by the number of threads
+# so that all panels together fit in the L3 like the shared panel of gemm_impl.
+# B is packed once per mc rows of C instead of once per jc iteration,
+# that is kc*nc elements for mc*nc*kc multiply-adds.
+
+proc find_group(task_start: openarray[int], t: int): int {.inline.} =
+  ## Returns the group of task `t`. Empty groups are skipped.
+  upperBound(task_start, t) - 1
+
+proc gemm_grouped_impl[T; ukernel: static MicroKernel](
+      N, K: int,
+      alpha: T,
+      M: openarray[int],
+      A: openarray[ptr T], rowStrideA, colStrideA: int,
+      B: openarray[ptr T], rowStrideB, colStrideB: int,
+      beta: T,
+      C: openarray[ptr T], rowStrideC, colStrideC: int
+    ) =
+  const NR = ukernel.nr
+
+  var M_max, M_total = 0
+  for m in M:
+    M_max = max(M_max, m)
+    M_total += m
+  if M_max == 0:
+    return
+
+  let PT = ukernel.parallel_threshold(T)
+  let parallelize = M_total*N*K > PT*PT*PT
+  let nb_threads = if parallelize: omp_get_max_threads().int
+                   else: 1
+
+  # Blocking of the largest group, with nc split between threads
+  let (MC, NC, KC) = ukernel.partitionMNK(T, M_max, N, K)
+  let task_nc = min(N, max(NR, round_step_up(get_num_tiles(NC, nb_threads), NR)))
+  let jc_num_tasks = get_num_tiles(N, task_nc)
+
+  # Work list: task_start[g] is the first task of group g,
+  # tasks of a group iterate on jc then ic.
+  var task_start = newSeq[int](M.len + 1)
+  for g in 0 ..< M.len:
+    task_start[g+1] = task_start[g] + get_num_tiles(M[g], MC) * jc_num_tasks
+  let nb_tasks = task_start[M.len]
+
+  # One Tiles per thread: a block [mc, kc] of A and a panel [kc, nc] of B
+  let tiles_size = ukernel.tiles_mem_required(T, MC, task_nc, K)
+  let mem_required = nb_threads * tiles_size
+  when defined(GEMM_NO_CACHED_WORKSPACE):
+    let ws_alloc = allocShared(mem_required + LASER_MEM_ALIGN - 1)
+    let workspace = align_raw_data(byte, ws_alloc)
+  else:
+    let workspace = gemm_cached_workspace(mem_required)
+
+  omp_parallel_if(parallelize):
+    let tiles = ukernel.initTiles(
+      T, MC, task_nc, K,
+      cast[pointer](cast[ByteAddress](workspace) +% omp_get_thread_num().int * tiles_size)
+    )
+    # Tasks have different sizes: the last blocks of each group are smaller
+    for t in `||`(0, nb_tasks-1, "for schedule(dynamic)"):
+      let g = task_start.find_group(t)
+      let icb = (t - task_start[g]) div jc_num_tasks
+      let jcb = (t - task_start[g]) mod jc_num_tasks
+
+      let ic = icb * MC
+      let mc = min(M[g] - ic, MC)                       # C[ic:ic+mc, jc:jc+nc]
+      let jc = jcb * task_nc
+      let nc = min(N - jc, task_nc)
+
+      let vA = A[g].toMatrixView(rowStrideA, colStrideA)
+      let vB = B[g].toMatrixView(rowStrideB, colStrideB)
+      let vC = C[g].toMatrixView(rowStrideC, colStrideC)
+
+      for pc in countup(0, K-1, KC):
+        let kc = min(K - pc, KC)                        # A[ic:ic+mc, pc:pc+kc], B[pc:pc+kc, jc:jc+nc]
+
+        # Private panel of B, packed by this thread only
+        prefetch(tiles.b, Write, LowTemporalLocality)
+        let kcncB = vB.stride(pc, jc)
+        pack_B_kc_nc_serial[T, ukernel](tiles.b, kc, nc, kcncB)
+
+        prefetch(tiles.a, Write, LowTemporalLocality)
+        pack_A_mc_kc[T, ukernel](tiles.a, mc, kc, vA.stride(ic, pc))
+
+        # First time writing to C, we scale it, otherwise accumulate
+        let beta = if pc == 0: beta else: 1.T
+
+        gebp_mkernel[T, ukernel](
+            mc, nc, kc,
+            alpha, tiles.a, tiles.b,
+            beta, vC.stride(ic, jc),
+            Epilogue[T]()
+          )
+
+  when defined(GEMM_NO_CACHED_WORKSPACE):
+    deallocShared(ws_alloc)
+
+# ############################################################
+#
+#   Exported function and dispatch with CPU runtime detection
+#
+# ############################################################
+
+proc gemm_grouped*[T: SomeNumber](
+      N, K: int,
+      alpha: T,
+      M: openarray[int],
+      A: openarray[ptr T],
+      rowStrideA, colStrideA: int,
+      B: openarray[ptr T],
+      rowStrideB, colStrideB: int,
+      beta: T,
+      C: openarray[ptr T],
+      rowStrideC, colStrideC: int) =
+  ## Compute C[g] = αA[g]*B[g] + βC[g] for g in 0 ..< M.len
+  ## with A[g] of shape [M[g], K], B[g] of shape [K, N] and C[g] of shape [M[g], N]
+  ##
+  ## All blocks of C of all groups are scheduled on the threads
+  ## of a single parallel region so that small groups do not leave cores idle.
+  doAssert A.len == M.len and B.len == M.len and C.len == M.len,
+    "M, A, B and C must have the same number of groups"
+  if M.len == 0 or N == 0:
+    return
+
+  # αAB does not contribute and K = 0 would give an empty kc
+  if alpha == 0.T or K == 0:
+    for g in 0 ..< M.len:
+      gemm_scale_epilogue(
+        M[g], N, beta,
+        C[g].toMatrixView(rowStrideC, colStrideC),
+        Epilogue[T]()
+      )
+    return
+
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    template apply(ukernel: MicroKernel): untyped {.dirty.} =
+      gemm_grouped_impl[T, ukernel](
+        N, K,
+        alpha, M,
+        A, rowStrideA, colStrideA,
+        B, rowStrideB, colStrideB,
+        beta,
+        C, rowStrideC, colStrideC
+      )
+      return
+    # All groups share the register tile, it is picked for their average M
+    var M_total = 0
+    for m in M:
+      M_total += m
+    let M_avg = get_num_tiles(M_total, M.len)
+    if colStrideC == 1:
+      dispatch_ukernel_shape(cpu_features, T, true, M_avg, N, apply)
+    else:
+      dispatch_ukernel_shape(cpu_features, T, false, M_avg, N, apply)
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  block:
+    echo "\n## Grouped GEMM with ragged M, an empty group and per-group B"
+    const N = 70
+    const K = 300
+    let M = [1, 0, 130, 7, 400]
+
+    var a, b, c, expected: seq[seq[int32]]
+    var ptrA, ptrB, ptrC: seq[ptr int32]
+    for g, m in M:
+      a.add newSeq[int32](max(1, m*K))
+      b.add newSeq[int32](K*N)
+      c.add newSeq[int32](max(1, m*N))
+      expected.add newSeq[int32](max(1, m*N))
+      for i in 0 ..< m:
+        for k in 0 ..< K:
+          a[g][i*K + k] = int32((i + k + g) mod 5) - 2
+      for k in 0 ..< K:
+        for j in 0 ..< N:
+          b[g][k*N + j] = int32((k * j + g) mod 7) - 3
+      for i in 0 ..< m:
+        for j in 0 ..< N:
+          c[g][i*N + j] = int32(i - j)
+          var acc = 2'i32 * c[g][i*N + j]
+          for k in 0 ..< K:
+            acc += 3'i32 * a[g][i*K + k] * b[g][k*N + j]
+          expected[g][i*N + j] = acc
+
+    for g in 0 ..< M.len:
+      ptrA.add a[g][0].addr
+      ptrB.add b[g][0].addr
+      ptrC.add c[g][0].addr
+
+    gemm_grouped(
+      N, K,
+      3'i32, M,
+      ptrA, K, 1,
+      ptrB, N, 1,
+      2'i32,
+      ptrC, N, 1
+    )
+
+    doAssert c == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## K = 0: C[g] = βC[g], A and B are not read"
+    let no_data: ptr float64 = nil
+    var c0 = [[1.0, 2], [3.0, 4]]
+    var c1 = [[NaN, NaN]]
+    gemm_grouped(
+      2, 0,
+      1.0, [2, 1],
+      [no_data, no_data], 0, 1,
+      [no_data, no_data], 2, 1,
+      -2.0,
+      [c0[0][0].addr, c1[0][0].addr], 2, 1
+    )
+    doAssert c0 == [[-2.0, -4], [-6.0, -8]], $c0
+
+    gemm_grouped(
+      2, 3,
+      0.0, [1],
+      [no_data], 3, 1,
+      [no_data], 2, 1,
+      0.0,
+      [c1[0][0].addr], 2, 1
+    )
+    doAssert c1 == [[0.0, 0]], $c1
+    echo "SUCCESS\n"
@@ -0,0 +1,191 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import strformat, strutils
+
+when defined(GEMM_INSTRUMENT):
+  import times, ../../openmp
+
+# ############################################################
+#
+#                 GEMM instrumentation
+#
+# ############################################################
+
+# Compiled with -d:GEMM_INSTRUMENT, GEMMs record the cycles spent by each thread in:
+#   - pack_A_mc_kc and pack_B_kc_nc,
+#   - gebb_ukernel (full MR*NR tiles) and gebb_ukernel_edge (edge tiles),
+#   - barriers: waiting for the other threads to finish packing ~B
+#     or their ic iterations.
+# and the wall-clock cycles and flops of each GEMM call,
+# including the ones served by the GEMV and small-matrix kernels.
+#
+# A shape is packing-bound if the packing ratio is high,
+# load-imbalanced if the barrier cycles are high
+# and edge-bound if the edge microkernel cycles are high.
+#
+# Without the flag `gemm_timed` is its body and the query API returns zeros.
+#
+# Cycles are read with rdtsc on x86 (reference cycles at the nominal frequency,
+# not core cycles) and are converted to seconds with a frequency calibrated
+# against the wall clock. Other architectures use the wall clock in nanoseconds.
+#
+# Counters are indexed by omp_get_thread_num(), with nested parallel regions
+# (see gemm_impl_sockets) the threads of each socket share counters.
+# They are updated atomically so this is only a loss of per-thread detail.
+# GEMMs running concurrently from different threads are summed together.
+
+const GEMM_INSTRUMENT_MAX_THREADS*{.intdefine.} = 256
+  ## Threads with a greater number share the counters of thread `number mod max`
+
+type
+  GemmPhase* = enum
+    gpPackA = "pack A"
+    gpPackB = "pack B"
+    gpUKernel = "microkernel"
+    gpUKernelEdge = "edge microkernel"
+    gpBarrier = "barrier"
+
+  GemmPhaseCycles* = array[GemmPhase, int]
+
+  GemmInstrumentation* = object
+    ## Counters accumulated since the last `gemm_reset_instrumentation`
+    threads*: seq[GemmPhaseCycles]   ## Cycles per phase of each thread
+    phases*: GemmPhaseCycles         ## Cycles per phase summed over all threads
+    wall_cycles*: int                ## Cycles from the start to the end of GEMM calls
+    flops*: float                    ## 2*M*N*K per GEMM call
+    cycles_per_second*: float        ## Frequency of the cycle counter
+
+  PaddedCycles = object
+    ## Cycles of a thread, padded to a 64-byte cache line
+    ## to avoid false sharing between threads
+    cycles: GemmPhaseCycles
+    pad: array[8 - (ord(high(GemmPhase)) + 1), int]
+
+when defined(GEMM_INSTRUMENT):
+  # The padding only prevents false sharing if the array starts on a cache line
+  var
+    gemm_thread_cycles{.codegenDecl: "$# $# __attribute__((aligned(64)))".}:
+      array[GEMM_INSTRUMENT_MAX_THREADS, PaddedCycles]
+    gemm_wall_cycles: int
+    gemm_flops: int
+
+  when defined(i386) or defined(amd64):
+    proc rdtsc(): int64 {.importc: "__rdtsc", header: "<x86intrin.h>".}
+
+    proc gemm_cycles*(): int {.inline.} =
+      rdtsc().int
+  else:
+    proc gemm_cycles*(): int {.inline.} =
+      int(epochTime() * 1e9)
+
+  proc gemm_record*(phase: GemmPhase, cycles: int) {.inline.} =
+    let tid = omp_get_thread_num().int mod GEMM_INSTRUMENT_MAX_THREADS
+    discard atomicInc(gemm_thread_cycles[tid].cycles[phase], cycles)
+
+  proc gemm_record_call*(M, N, K: int, cycles: int) {.inline.} =
+    discard atomicInc(gemm_wall_cycles, cycles)
+    discard atomicInc(gemm_flops, 2 * M * N * K)
+
+template gemm_timed*(phase: GemmPhase, body: untyped) =
+  ## Adds the cycles spent in `body` to `phase` of the calling thread.
+  ## `body` must not exit the enclosing scope (return, break, continue).
+  when defined(GEMM_INSTRUMENT):
+    let start = gemm_cycles()
+    body
+    gemm_record(phase, gemm_cycles() - start)
+  else:
+    body
+
+template gemm_timed_call*(M, N, K: int, body: untyped) =
+  ## Adds the wall-clock cycles spent in `body` and its 2*M*N*K flops
+  ## to the totals
+  when defined(GEMM_INSTRUMENT):
+    let start = gemm_cycles()
+    body
+    gemm_record_call(M, N, K, gemm_cycles() - start)
+  else:
+    body
+
+var cycles_per_second_cache: float
+
+proc calibrate_cycles_per_second(): float =
+  ## Measure the frequency of the cycle counter over 20 ms
+  when defined(GEMM_INSTRUMENT):
+    if cycles_per_second_cache == 0:
+      let start = epochTime()
+      let start_cycles = gemm_cycles()
+      while epochTime() - start < 0.02:
+        discard
+      cycles_per_second_cache = float(gemm_cycles() - start_cycles) / (epochTime() - start)
+    result = cycles_per_second_cache
+
+proc gemm_instrumentation*(): GemmInstrumentation =
+  ## Returns the counters of GEMMs since the last reset.
+  ## All zero if not compiled with -d:GEMM_INSTRUMENT.
+  when defined(GEMM_INSTRUMENT):
+    var last_thread = -1
+    for t in 0 ..< GEMM_INSTRUMENT_MAX_THREADS:
+      for phase in GemmPhase:
+        if gemm_thread_cycles[t].cycles[phase] != 0:
+          last_thread = t
+    result.threads = newSeq[GemmPhaseCycles](last_thread + 1)
+    for t in 0 .. last_thread:
+      result.threads[t] = gemm_thread_cycles[t].cycles
+      for phase in GemmPhase:
+        result.phases[phase] += gemm_thread_cycles[t].cycles[phase]
+    result.wall_cycles = gemm_wall_cycles
+    result.flops = gemm_flops.float
+    result.cycles_per_second = calibrate_cycles_per_second()
+
+proc gemm_reset_instrumentation*() =
+  ## Reset the counters, must not be called while a GEMM is running
+  when defined(GEMM_INSTRUMENT):
+    for t in 0 ..< GEMM_INSTRUMENT_MAX_THREADS:
+      for phase in GemmPhase:
+        gemm_thread_cycles[t].cycles[phase] = 0
+    gemm_wall_cycles = 0
+    gemm_flops = 0
+
+proc seconds*(stats: GemmInstrumentation): float =
+  ## Wall-clock time of the GEMM calls
+  if stats.cycles_per_second > 0:
+    result = stats.wall_cycles.float / stats.cycles_per_second
+
+proc gflops*(stats: GemmInstrumentation): float =
+  ## Achieved GFLOP/s over the GEMM calls
+  let seconds = stats.seconds
+  if seconds > 0:
+    result = stats.flops / seconds / 1e9
+
+proc packing_ratio*(stats: GemmInstrumentation): float =
+  ## Fraction of the packing and compute cycles spent packing A and B,
+  ## barriers excluded
+  let packing = stats.phases[gpPackA] + stats.phases[gpPackB]
+  let total = packing + stats.phases[gpUKernel] + stats.phases[gpUKernelEdge]
+  if total > 0:
+    result = packing / total
+
+proc barrier_ratio*(stats: GemmInstrumentation): float =
+  ## Fraction of the recorded cycles spent waiting at barriers
+  var total = 0
+  for phase in GemmPhase:
+    total += stats.phases[phase]
+  if total > 0:
+    result = stats.phases[gpBarrier] / total
+
+proc `$`*(stats: GemmInstrumentation): string =
+  result = &"GEMM: {stats.gflops:.2f} GFLOP/s, {stats.flops:.3e} flops in {stats.seconds*1e3:.3f} ms\n"
+  result &= &"  packing ratio: {stats.packing_ratio*100:.1f}%, barrier ratio: {stats.barrier_ratio*100:.1f}%\n"
+  result &= "  " & "thread".align(8)
+  for phase in GemmPhase:
+    result &= " " & ($phase).align(18)
+  for t, cycles in stats.threads:
+    result &= "\n  " & ($t).align(8)
+    for phase in GemmPhase:
+      result &= " " & ($cycles[phase]).align(18)
+  result &= "\n  " & "total".align(8)
+  for phase in GemmPhase:
+    result &= " " & ($stats.phases[phase]).align(18)
@@ -9,12 +9,35 @@
 #   - 2. object constructor needs and object type when workaround first issue with macro
 
 import
-  ../../compiler_optim_hints,
+  ../../compiler_optim_hints, ../../float16, ../../openmp,
   ../../private/align_unroller,
-  ./gemm_utils, ./gemm_tiling
+  ./gemm_utils, ./gemm_tiling, ./gemm_packing_f16c
 
 withCompilerOptimHints()
 
+# ############################################################
+#
+#                    Fused prologue
+#
+# ############################################################
+
+func transform[T](prologue: Prologue[T], x: T, row, col: int): T {.inline.} =
+  ## Apply the fused prologue on x = Operand[row, col]
+  ## The prologue kind is loop-invariant and the branch is hoisted
+  ## out of the packing loops by the compiler (loop unswitching).
+  case prologue.kind
+  of proNone: x
+  of proScale: x * prologue.scale
+  of proReluGrad:
+    if prologue.fwd[row, col] > 0.T: x else: 0.T
+  of proTanhGrad:
+    let y = prologue.fwd[row, col]
+    x * (1.T - y*y)
+  of proSigmoidGrad:
+    let y = prologue.fwd[row, col]
+    x * y * (1.T - y)
+  of proCustom: prologue.fn(x)
+
 # ############################################################
 #
 #                    Packing A
@@ -60,6 +83,62 @@ proc pack_A_mc_kc*[T; ukernel: static MicroKernel](
 #
 # ############################################################
 
+# pack_B_kc_nc shares the packing of a panel between the threads
+# of the enclosing parallel region, if any.
+# pack_B_kc_nc_serial packs it with the calling thread only,
+# for a thread packing a private panel or its share of a panel
+# while the other threads of the region do something else.
+
+template packing_single(serial: static bool, body: untyped) =
+  ## `body` runs on one thread of the enclosing parallel region
+  when serial:
+    block: body
+  else:
+    omp_single_nowait: body
+
+template packing_for(serial: static bool, idx: untyped, len: int, body: untyped) =
+  ## for idx in 0 ..< len, shared by the threads of the enclosing parallel region
+  when serial:
+    for idx in 0 ..< len: body
+  else:
+    for idx in `||`(0, len - 1, "for nowait"): body
+
+proc pack_B_impl[T; ukernel: static MicroKernel; serial: static bool](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: MatrixView[T]) =
+  let buffer{.restrict.} = assume_aligned packedB
+  const NR = ukernel.extract_nr()
+  let unroll_stop = nc.round_step_down(NR)
+
+  # 1. Process the tail
+  packing_single(serial):
+    let remainder = nc - unroll_stop
+    if remainder > 0:
+      let offBuf = buffer + kc*unroll_stop
+      for k in 0 ..< kc:
+        for j in 0 ..< remainder:
+          offBuf[k*NR + j] = B[k, unroll_stop+j]
+        for j in remainder ..< NR: # Pad with 0 if packing over the edge
+          offBuf[k*NR + j] = 0.T
+
+  # 2. Pack n matrices of size kc*nr, n = nc/nr
+  when serial:
+    {.emit:"""
+        for (int j = 0; j < `unroll_stop`; j+=`NR`)
+          for (int k = 0; k < `kc`; k++)
+            for (int jj = 0; jj < `NR`; jj++)
+              `buffer`[j*`kc`+k*`NR`+jj] = `B`.buffer[k*`B`.rowStride + (j+jj)*`B`.colStride];
+    """.}
+  else:
+    {.emit:"""
+        #pragma omp for nowait
+        for (int j = 0; j < `unroll_stop`; j+=`NR`)
+          for (int k = 0; k < `kc`; k++)
+            for (int jj = 0; jj < `NR`; jj++)
+              `buffer`[j*`kc`+k*`NR`+jj] = `B`.buffer[k*`B`.rowStride + (j+jj)*`B`.colStride];
+    """.}
+
 proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
       packedB: ptr UncheckedArray[T],
       kc, nc: int,
@@ -70,25 +149,332 @@ proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
   ## Concretely the outer dimension of packed matrices
   ## is k so that C[i, j] = A[i, k] * B[k, j]
   ## does not require strided access
-  let buffer{.restrict.} = assume_aligned packedB
-  const NR = ukernel.extract_nr()
-  let unroll_stop = nc.round_step_down(NR)
+  ##
+  ## Packing is shared between the threads of the enclosing
+  ## parallel region, if any. It does not end with a barrier,
+  ## the caller must synchronize the threads before reading ~B.
+  pack_B_impl[T, ukernel, false](packedB, kc, nc, B)
 
-  # 1. Pack n matrices of size kc*nr, n = nc/nr
-  {.emit:"""
-      #pragma omp parallel for
-      for (int j = 0; j < `unroll_stop`; j+=`NR`)
-        for (int k = 0; k < `kc`; k++)
-          for (int jj = 0; jj < `NR`; jj++)
-            `buffer`[j*`kc`+k*`NR`+jj] = `B`.buffer[k*`B`.rowStride + (j+jj)*`B`.colStride];
-  """.}
+proc pack_B_kc_nc_serial*[T; ukernel: static MicroKernel](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: MatrixView[T]) =
+  ## Packs panel [kc, nc] for ~B with the calling thread only
+  pack_B_impl[T, ukernel, true](packedB, kc, nc, B)
+
+# ############################################################
+#
+#                Packing with fused prologue
+#
+# ############################################################
+
+proc pack_A_mc_kc*[T; ukernel: static MicroKernel](
+      packedA: ptr UncheckedArray[T],
+      mc, kc: int,
+      A: MatrixView[T],
+      prologue: Prologue[T]) =
+  ## Packs panel [kc, mc] into buffer Ã
+  ## and applies the prologue transform on each element of A
+  if prologue.kind == proNone:
+    pack_A_mc_kc[T, ukernel](packedA, mc, kc, A)
+    return
+
+  let buffer{.restrict.} = assume_aligned packedA
+  const MR = ukernel.extract_mr()
+  let unroll_stop = mc.round_step_down(MR)
+
+  # 1. Pack m matrices of size kc*mr, m = mc/mr
+  for i in countup(0, unroll_stop-1, MR):
+    for k in 0 ..< kc:
+      for ii in 0 ..< MR:
+        buffer[i*kc+k*MR+ii] = prologue.transform(A[i+ii, k], i+ii, k)
 
   # 2. Process the tail
-  let remainder = nc - unroll_stop
+  let remainder = mc - unroll_stop
   if remainder > 0:
     let offBuf = buffer + kc*unroll_stop
     for k in 0 ..< kc:
-      for j in 0 ..< remainder:
-        offBuf[k*NR + j] = B[k, unroll_stop+j]
-      for j in remainder ..< NR: # Pad with 0 if packing over the edge
-        offBuf[k*NR + j] = 0.T
+      for i in 0 ..< remainder:
+        offBuf[k*MR + i] = prologue.transform(A[unroll_stop+i, k], unroll_stop+i, k)
+      for i in remainder ..< MR: # Pad with 0 if packing over the edge
+        offBuf[k*MR + i] = 0.T
+
+proc pack_B_impl[T; ukernel: static MicroKernel; serial: static bool](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: MatrixView[T],
+      prologue: Prologue[T]) =
+  if prologue.kind == proNone:
+    pack_B_impl[T, ukernel, serial](packedB, kc, nc, B)
+    return
+
+  let buffer{.restrict.} = assume_aligned packedB
+  const NR = ukernel.extract_nr()
+  let unroll_stop = nc.round_step_down(NR)
+
+  # 1. Process the tail
+  packing_single(serial):
+    let remainder = nc - unroll_stop
+    if remainder > 0:
+      let offBuf = buffer + kc*unroll_stop
+      for k in 0 ..< kc:
+        for j in 0 ..< remainder:
+          offBuf[k*NR + j] = prologue.transform(B[k, unroll_stop+j], k, unroll_stop+j)
+        for j in remainder ..< NR: # Pad with 0 if packing over the edge
+          offBuf[k*NR + j] = 0.T
+
+  # 2. Pack n matrices of size kc*nr, n = nc/nr
+  packing_for(serial, jp, unroll_stop div NR):
+    let j = jp * NR
+    for k in 0 ..< kc:
+      for jj in 0 ..< NR:
+        buffer[j*kc+k*NR+jj] = prologue.transform(B[k, j+jj], k, j+jj)
+
+proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: MatrixView[T],
+      prologue: Prologue[T]) =
+  ## Packs panel [kc, nc] for ~B
+  ## and applies the prologue transform on each element of B
+  pack_B_impl[T, ukernel, false](packedB, kc, nc, B, prologue)
+
+proc pack_B_kc_nc_serial*[T; ukernel: static MicroKernel](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: MatrixView[T],
+      prologue: Prologue[T]) =
+  ## Packs panel [kc, nc] for ~B with the calling thread only
+  ## and applies the prologue transform on each element of B
+  pack_B_impl[T, ukernel, true](packedB, kc, nc, B, prologue)
+
+# ############################################################
+#
+#          Packing with widening from half-precision
+#
+# ############################################################
+
+# A and B may be stored as Float16 or BFloat16 and packed as float32
+# so that the float32 microkernels are reused unchanged.
+# The conversion happens while the data is being re-ordered
+# so the half-precision matrices are read only once per panel.
+#
+# The widening is vectorized if the source of a packed row is contiguous:
+#   - BFloat16 is a shift, vectorized by the compiler
+#   - Float16 uses F16C if the microkernel targets AVX+FMA or AVX512
+
+proc widen[H](
+      dst: ptr UncheckedArray[float32],
+      src: ptr H, stride, len: int,
+      f16c: static bool) {.inline.} =
+  ## dst[0:len] = float32(src[0:len*stride:stride])
+  let src = cast[ptr UncheckedArray[H]](src)
+  when f16c and (defined(i386) or defined(amd64)):
+    if stride == 1:
+      widen_f16c(dst, src, len)
+      return
+  for l in 0 ..< len:
+    dst[l] = src[l*stride].toFloat32
+
+template gen_pack_widening(H: typedesc) =
+  proc pack_A_mc_kc*[T; ukernel: static MicroKernel](
+        packedA: ptr UncheckedArray[T],
+        mc, kc: int,
+        A: MatrixView[H],
+        prologue: Prologue[T]) =
+    ## Packs panel [kc, mc] into buffer Ã
+    ## and widens A to float32, then applies the prologue
+    static: assert T is float32, "Half-precision matrices are packed as float32"
+    let buffer{.restrict.} = assume_aligned packedA
+    const
+      MR = ukernel.extract_mr()
+      f16c = H is Float16 and ukernel.extract_cpu_simd in {x86_AVX_FMA, x86_AVX512}
+
+    for ip in 0 ..< get_num_tiles(mc, MR):
+      let i = ip * MR
+      let mr = min(mc - i, MR)
+      let upanel = buffer + i*kc
+      for k in 0 ..< kc:
+        let row = upanel + k*MR
+        widen(row, A.buffer[i*A.rowStride + k*A.colStride].addr, A.rowStride, mr, f16c)
+        if prologue.kind != proNone:
+          for ii in 0 ..< mr:
+            row[ii] = prologue.transform(row[ii], i+ii, k)
+        for ii in mr ..< MR: # Pad with 0 if packing over the edge
+          row[ii] = 0.T
+
+  proc pack_B_impl[T; ukernel: static MicroKernel; serial: static bool](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: MatrixView[H],
+        prologue: Prologue[T]) =
+    static: assert T is float32, "Half-precision matrices are packed as float32"
+    let buffer{.restrict.} = assume_aligned packedB
+    const
+      NR = ukernel.extract_nr()
+      f16c = H is Float16 and ukernel.extract_cpu_simd in {x86_AVX_FMA, x86_AVX512}
+
+    packing_for(serial, jp, get_num_tiles(nc, NR)):
+      let j = jp * NR
+      let nr = min(nc - j, NR)
+      let upanel = buffer + j*kc
+      for k in 0 ..< kc:
+        let row = upanel + k*NR
+        widen(row, B.buffer[k*B.rowStride + j*B.colStride].addr, B.colStride, nr, f16c)
+        if prologue.kind != proNone:
+          for jj in 0 ..< nr:
+            row[jj] = prologue.transform(row[jj], k, j+jj)
+        for jj in nr ..< NR: # Pad with 0 if packing over the edge
+          row[jj] = 0.T
+
+  proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: MatrixView[H],
+        prologue: Prologue[T]) =
+    ## Packs panel [kc, nc] for ~B
+    ## and widens B to float32, then applies the prologue
+    pack_B_impl[T, ukernel, false](packedB, kc, nc, B, prologue)
+
+  proc pack_B_kc_nc_serial*[T; ukernel: static MicroKernel](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: MatrixView[H],
+        prologue: Prologue[T]) =
+    ## Packs panel [kc, nc] for ~B with the calling thread only
+    ## and widens B to float32, then applies the prologue
+    pack_B_impl[T, ukernel, true](packedB, kc, nc, B, prologue)
+
+gen_pack_widening(Float16)
+gen_pack_widening(BFloat16)
+
+# ############################################################
+#
+#          Packing with dequantization of weights
+#
+# ############################################################
+
+# B may be stored as int8 or UInt4 with a scale and zero point
+# per group of rows of each column (see QuantizedMatrixView)
+# and is dequantized to float32 while being packed
+# so that the float32 microkernels are reused unchanged.
+#
+# For small M the GEMM is bound by reading B,
+# int8 and 4-bit weights read 4x and 8x fewer bytes than float32.
+
+template gen_pack_dequantizing(Q: typedesc) =
+  proc pack_B_impl[T; ukernel: static MicroKernel; serial: static bool](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: QuantizedMatrixView[Q],
+        prologue: Prologue[T]) =
+    static: assert T is float32, "Quantized matrices are packed as float32"
+    let buffer{.restrict.} = assume_aligned packedB
+    const NR = ukernel.extract_nr()
+
+    packing_for(serial, jp, get_num_tiles(nc, NR)):
+      let j = jp * NR
+      let nr = min(nc - j, NR)
+      let upanel = buffer + j*kc
+      let col = B.col + j
+      for k in 0 ..< kc:
+        let row = upanel + k*NR
+        let r = B.row + k
+        let group = (r div B.group_size) * B.groupStride + col
+        for jj in 0 ..< nr:
+          let q = B.quantized(r, col+jj) - B.zero_point(group+jj)
+          row[jj] = float32(q) * B.scales[group+jj]
+        if prologue.kind != proNone:
+          for jj in 0 ..< nr:
+            row[jj] = prologue.transform(row[jj], k, j+jj)
+        for jj in nr ..< NR: # Pad with 0 if packing over the edge
+          row[jj] = 0.T
+
+  proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: QuantizedMatrixView[Q],
+        prologue: Prologue[T]) =
+    ## Packs panel [kc, nc] for ~B
+    ## and dequantizes B to float32, then applies the prologue
+    pack_B_impl[T, ukernel, false](packedB, kc, nc, B, prologue)
+
+  proc pack_B_kc_nc_serial*[T; ukernel: static MicroKernel](
+        packedB: ptr UncheckedArray[T],
+        kc, nc: int,
+        B: QuantizedMatrixView[Q],
+        prologue: Prologue[T]) =
+    ## Packs panel [kc, nc] for ~B with the calling thread only
+    ## and dequantizes B to float32, then applies the prologue
+    pack_B_impl[T, ukernel, true](packedB, kc, nc, B, prologue)
+
+gen_pack_dequantizing(int8)
+gen_pack_dequantizing(UInt4)
+
+# ############################################################
+#
+#                Packing with fused im2col
+#
+# ############################################################
+
+# B may be the im2col matrix of an image (see Im2ColView).
+# The sliding windows are read from the image while packing
+# so the im2col matrix is never materialized.
+
+proc pack_B_impl[T; ukernel: static MicroKernel; serial: static bool](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: Im2ColView[T],
+      prologue: Prologue[T]) =
+  let buffer{.restrict.} = assume_aligned packedB
+  const NR = ukernel.extract_nr()
+  let kHkW = B.kH * B.kW
+
+  packing_for(serial, jp, get_num_tiles(nc, NR)):
+    let j = jp * NR
+    let nr = min(nc - j, NR)
+    let upanel = buffer + j*kc
+    # Output pixel of the first column of the micropanel
+    let oh0 = (B.col + j) div B.outW
+    let ow0 = (B.col + j) mod B.outW
+    for k in 0 ..< kc:
+      let row = upanel + k*NR
+      # Channel and kernel position of row k
+      let r = B.row + k
+      let channel = (r div kHkW) * B.H * B.W
+      let kr = (r mod kHkW) div B.kW
+      let kcol = r mod B.kW
+      var oh = oh0
+      var ow = ow0
+      for jj in 0 ..< nr:
+        let ih = oh * B.strideH - B.padH + kr
+        let iw = ow * B.strideW - B.padW + kcol
+        row[jj] = if ih <% B.H and iw <% B.W: B.image[channel + ih*B.W + iw]
+                  else: 0.T
+        inc ow
+        if ow == B.outW:
+          ow = 0
+          inc oh
+      if prologue.kind != proNone:
+        for jj in 0 ..< nr:
+          row[jj] = prologue.transform(row[jj], k, j+jj)
+      for jj in nr ..< NR: # Pad with 0 if packing over the edge
+        row[jj] = 0.T
+
+proc pack_B_kc_nc*[T; ukernel: static MicroKernel](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: Im2ColView[T],
+      prologue: Prologue[T]) =
+  ## Packs panel [kc, nc] of the im2col matrix for ~B
+  ## reading the image directly, then applies the prologue
+  pack_B_impl[T, ukernel, false](packedB, kc, nc, B, prologue)
+
+proc pack_B_kc_nc_serial*[T; ukernel: static MicroKernel](
+      packedB: ptr UncheckedArray[T],
+      kc, nc: int,
+      B: Im2ColView[T],
+      prologue: Prologue[T]) =
+  ## Packs panel [kc, nc] of the im2col matrix for ~B with the calling thread only
+  ## reading the image directly, then applies the prologue
+  pack_B_impl[T, ukernel, true](packedB, kc, nc, B, prologue)
@@ -0,0 +1,23 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../simd, ../../float16,
+  ../../private/align_unroller
+
+# F16C conversion is isolated in this file for its "-mf16c" flag, see "nim.cfg".
+# All CPUs with FMA3 or AVX512 support F16C.
+
+when defined(i386) or defined(amd64):
+  proc widen_f16c*(dst: ptr UncheckedArray[float32], src: ptr UncheckedArray[Float16], len: int) =
+    ## dst[0:len] = float32(src[0:len])
+    let unroll_stop = round_step_down(len, 8)
+    for i in countup(0, unroll_stop - 1, 8):
+      mm256_storeu_ps(
+        dst[i].addr,
+        mm256_cvtph_ps(mm_loadu_si128(cast[ptr m128i](src[i].addr)))
+      )
+    for i in unroll_stop ..< len:
+      dst[i] = src[i].toFloat32
@@ -24,7 +24,9 @@ template dispatch(
   template dispatch_opt(cpu_features: static CPUFeatureX86): untyped {.dirty.} =
     ## Dispatch depending on detected CPU features.
     type A = T # workaround "Cannot evaluate at compile-time
-    # c_unit_stride is not relevant here
+    # c_unit_stride is not relevant here.
+    # The shape of the register tile is not picked from M and N like in gemm_strided:
+    # the packed panels must match the microkernel of the GEMM that consumes them.
     const ukernel = cpu_features.x86_ukernel(A, c_unit_stride = false)
 
     when return_void:
@@ -33,26 +35,8 @@ template dispatch(
     else:
       return func_call
 
-  when defined(i386) or defined(amd64):
-    when T is float32:
-      if cpuinfo_has_x86_avx512f():   dispatch_opt(x86_AVX512)
-      elif cpuinfo_has_x86_fma3():    dispatch_opt(x86_AVX_FMA)
-      elif cpuinfo_has_x86_avx():     dispatch_opt(x86_AVX)
-      elif cpuinfo_has_x86_sse():     dispatch_opt(x86_SSE)
-    elif T is float64:
-      if cpuinfo_has_x86_avx512f():   dispatch_opt(x86_AVX512)
-      elif cpuinfo_has_x86_fma3():    dispatch_opt(x86_AVX_FMA)
-      elif cpuinfo_has_x86_avx():     dispatch_opt(x86_AVX)
-      elif cpuinfo_has_x86_sse2():    dispatch_opt(x86_SSE2)
-    elif T is int32 or T is uint32:
-      if cpuinfo_has_x86_avx512f():   dispatch_opt(x86_AVX512)
-      elif cpuinfo_has_x86_avx2():    dispatch_opt(x86_AVX2)
-      elif cpuinfo_has_x86_sse41():   dispatch_opt(x86_SSE4_1)
-      elif cpuinfo_has_x86_sse2():    dispatch_opt(x86_SSE2)
-    elif T is int64:
-      if cpuinfo_has_x86_avx512f():   dispatch_opt(x86_AVX512)
-      elif cpuinfo_has_x86_sse2():    dispatch_opt(x86_SSE2)
-  dispatch_opt(x86_Generic)
+  # Same microkernel as gemm_strided, including the tuning profile
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch_opt)
 
 # ############################################################
 #
@@ -60,7 +44,7 @@ template dispatch(
 #
 # ############################################################
 
-func gemm_prepackB_mem_required_impl*(
+proc gemm_prepackB_mem_required_impl*(
   ukernel: static MicroKernel,
   T: typedesc,
   M, N, K: int): int =
@@ -68,12 +52,13 @@ func gemm_prepackB_mem_required_impl*(
   let (MC, NC, KC) = ukernel.partitionMNK(T, M, N, K)
   const NR = ukernel.nr
 
+  let jc_num_iter = get_num_tiles(N, NC)
   let pc_num_iter = get_num_tiles(K, KC)
   let upanelB_size = KC * round_step_up(NC, NR)
 
-  result = T.sizeof * upanelB_size * pc_num_iter
+  result = T.sizeof * upanelB_size * pc_num_iter * jc_num_iter
 
-func gemm_prepackB_mem_required*(
+proc gemm_prepackB_mem_required*(
   T: type,
   M, N, K: int): int =
   ## Returns the amount of memory that needs to be preallocated
@@ -84,29 +69,36 @@ func gemm_prepackB_mem_required*(
       ukernel, T, M, N, K
     )
 
-proc gemm_prepackB_impl[T; ukernel: static MicroKernel](
+proc gemm_prepackB_impl*[T; ukernel: static MicroKernel](
         dst: ptr UncheckedArray[T],
         M, N, K: int,
         vB: MatrixView[T]
       ) =
 
+  ## Packed B layout: for each jc block, for each pc block,
+  ## a panel [KC, NC] packed by micropanels of NR columns
   let (MC, NC, KC) = ukernel.partitionMNK(T, M, N, K)
+  let jc_num_iter = get_num_tiles(N, NC)
   let pc_num_iter = get_num_tiles(K, KC)
   let upanelB_size = KC * round_step_up(NC, ukernel.nr)
-  for pcb in 0||(pc_num_iter-1):
-    let packB = dst + pcb * upanelB_size
-    prefetch(packB, Write, LowTemporalLocality)
-
-    let pc = pcb * KC
-    let kc = min(K - pc, KC)
-    let kcncB = vB.stride(pc, 0)
 
-    # Note: pack_B also creates a parallel region
-    #       this will cause issues if omp_get_nested = 1
-    pack_B_kc_nc[T, ukernel](
-      packB,
-      kc, NC, kcncB
-    )
+  # B panels are packed one after the other, each shared by all threads
+  omp_parallel_if(K*N > OMP_MEMORY_BOUND_GRAIN_SIZE * omp_get_max_threads()):
+    for jcb in 0 ..< jc_num_iter:
+      let jc = jcb * NC
+      let nc = min(N - jc, NC)
+      for pcb in 0 ..< pc_num_iter:
+        let packB = dst + (jcb * pc_num_iter + pcb) * upanelB_size
+        prefetch(packB, Write, LowTemporalLocality)
+
+        let pc = pcb * KC
+        let kc = min(K - pc, KC)
+        let kcncB = vB.stride(pc, jc)
+
+        pack_B_kc_nc[T, ukernel](
+          packB,
+          kc, nc, kcncB
+        )
 
 proc gemm_prepackB*[T](
         dst_packedB: ptr (T or UncheckedArray[T]),
@@ -119,7 +111,7 @@ proc gemm_prepackB*[T](
   ##
   ## For optimal performance packing is machine and architecture dependent
   ## i.e. it depends on detected features like AVX and number of cores
-  ## and may depend on your machine cache sizes in the future.
+  ## and on your machine cache sizes.
   ## It is unsafe to store or serialize it.
 
   doAssert (cast[int](dst_packedB) and 63) == 0, "The destination pointer must be 64-bit aligned"
@@ -140,7 +132,7 @@ proc gemm_prepackB*[T](
 #
 # ############################################################
 
-func gemm_prepackA_mem_required_impl*(
+proc gemm_prepackA_mem_required_impl*(
   ukernel: static MicroKernel,
   T: typedesc,
   M, N, K: int): int =
@@ -154,7 +146,7 @@ func gemm_prepackA_mem_required_impl*(
 
   result = T.sizeof * upanelA_size * pc_num_iter * ic_num_iter
 
-func gemm_prepackA_mem_required*(
+proc gemm_prepackA_mem_required*(
   T: typedesc,
   M, N, K: int): int =
   ## Returns the amount of memory that needs to be preallocated
@@ -183,7 +175,7 @@ proc gemm_prepackA_impl[T; ukernel: static MicroKernel](
     let kc = min(K - pc, KC)
 
     for icb in 0 ..< ic_num_iter:
-      let packA = dst + pc*pc_num_iter + icb*upanelA_size
+      let packA = dst + (pcb*ic_num_iter + icb)*upanelA_size
       prefetch(packA, Write, LowTemporalLocality)
       let ic = icb * MC
       let mc = min(M-ic, MC)
@@ -202,7 +194,7 @@ proc gemm_prepackA*[T](
   ##
   ## For optimal performance packing is machine and architecture dependent
   ## i.e. it depends on detected features like AVX and number of cores
-  ## and may depend on your machine cache sizes in the future.
+  ## and on your machine cache sizes.
   ## It is unsafe to store or serialize it.
 
   doAssert (cast[int](dst_packedA) and 63) == 0, "The destination pointer must be 64-bit aligned"
@@ -235,42 +227,55 @@ proc gemm_packed_impl[T](
   const
     MR = ukernel.mr
     NR = ukernel.nr
-    PT = ukernel.pt
 
   let
+    PT = ukernel.parallel_threshold(T)
     parallelize = M*N*K > PT*PT*PT
 
     (MC, NC, KC) = ukernel.partitionMNK(T, M, N, K)
+    jc_num_iter = get_num_tiles(N, NC)
     pc_num_iter = get_num_tiles(K, KC)
     ic_num_iter = get_num_tiles(M, MC)
 
     upanelB_size = KC * round_step_up(NC, NR)
     upanelA_size = KC * round_step_up(MC, MR)
 
-
-  # ######################################
-  # 2.   for pc = 0,...,k−1 in steps of kc
-  for pcb in 0 ..< pc_num_iter:
-    let packedB{.restrict.} = cast[ptr UncheckedArray[T]](packedB + pcb * upanelB_size)
-    let pc = pcb * KC
-    let kc = min(K - pc, KC)
-
-    # First time writing to C, we scale it, otherwise accumulate
-    let beta = if pc == 0: beta else: 1.T
-
-    omp_parallel_if(parallelize):
-      # ####################################
-      # 3. for ic = 0,...,m−1 in steps of mc
-      omp_for(icb, ic_num_iter, use_simd=false, nowait=true):
-        let packedA{.restrict.} = cast[ptr UncheckedArray[T]](packedA + icb * upanelA_size)
-        let ic = icb * MC
-        let mc = min(M-ic, MC)
-
-        gebp_mkernel[T, ukernel](
-          mc, NC, kc,
-          alpha, packedA, packedB,
-          beta, vc.stride(ic, 0)
+  # A single parallel region spans the jc and pc loops,
+  # with a barrier after each ic loop as C is accumulated over pc.
+  omp_parallel_if(parallelize):
+    # ####################################################################
+    # 1. for jc = 0,...,n−1 in steps of nc
+    for jcb in 0 ..< jc_num_iter:
+      let jc = jcb * NC
+      let nc = min(N - jc, NC)
+
+      # ######################################
+      # 2.   for pc = 0,...,k−1 in steps of kc
+      for pcb in 0 ..< pc_num_iter:
+        let packedB{.restrict.} = cast[ptr UncheckedArray[T]](
+          packedB + (jcb * pc_num_iter + pcb) * upanelB_size
         )
+        let pc = pcb * KC
+        let kc = min(K - pc, KC)
+
+        # First time writing to C, we scale it, otherwise accumulate
+        let beta = if pc == 0: beta else: 1.T
+
+        # ####################################
+        # 3. for ic = 0,...,m−1 in steps of mc
+        omp_for(icb, ic_num_iter, use_simd=false, nowait=false):
+          let packedA{.restrict.} = cast[ptr UncheckedArray[T]](
+            packedA + (pcb * ic_num_iter + icb) * upanelA_size
+          )
+          let ic = icb * MC
+          let mc = min(M-ic, MC)
+
+          gebp_mkernel[T, ukernel](
+            mc, nc, kc,
+            alpha, packedA, packedB,
+            beta, vc.stride(ic, jc),
+            Epilogue[T]()
+          )
 
 proc gemm_packed*[T: SomeNumber](
       M, N, K: int,
@@ -291,6 +296,52 @@ proc gemm_packed*[T: SomeNumber](
       beta, vC
     )
 
+proc gemm_packedB_impl*[T; ukernel: static MicroKernel](
+      M, N, K: int,
+      alpha: T, vA: MatrixView[T], packedB: ptr UncheckedArray[T],
+      beta: T, vC: MatrixView[T],
+      tiles: Tiles[T]
+    ) =
+  ## Same as gemm_impl except that B was already packed
+  ## for all jc and pc iterations by gemm_prepackB_impl
+  ## with the kc and nc of `tiles`. A is packed on the fly.
+  const NR = ukernel.extract_nr
+  let PT = ukernel.parallel_threshold(T)
+  let parallelize = M*N*K > PT*PT*PT
+  let upanelB_size = tiles.kc * round_step_up(tiles.nc, NR)
+
+  let pc_num_iter = get_num_tiles(K, tiles.kc)
+
+  omp_parallel_if(parallelize):
+    for jcb in 0 ..< get_num_tiles(N, tiles.nc):
+      let jc = jcb * tiles.nc
+      let nc = min(N - jc, tiles.nc)
+
+      for pcb in 0 ..< pc_num_iter:
+        let pc = pcb * tiles.kc
+        let kc = min(K - pc, tiles.kc)
+        let packB = packedB + (jcb * pc_num_iter + pcb) * upanelB_size
+
+        # First time writing to C, we scale it, otherwise accumulate
+        let beta = if pc == 0: beta else: 1.T
+
+        # Barrier at the end as C is accumulated over pc
+        omp_for(icb, tiles.ic_num_tasks, use_simd=false, nowait=false):
+          let packA = tiles.a + icb * tiles.upanelA_size
+          prefetch(packA, Write, LowTemporalLocality)
+          let ic = icb * tiles.mc
+          let mc = min(M-ic, tiles.mc)
+
+          let mckcA = vA.stride(ic, pc)
+          pack_A_mc_kc[T, ukernel](packA, mc, kc, mckcA)
+
+          gebp_mkernel[T, ukernel](
+              mc, nc, kc,
+              alpha, packA, packB,
+              beta, vC.stride(ic, jc),
+              Epilogue[T]()
+            )
+
 # ############################################################
 #
 #                       Private tests
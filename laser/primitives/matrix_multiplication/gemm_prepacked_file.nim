@@ -0,0 +1,534 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  memfiles,
+  ../../compiler_optim_hints,
+  ../../private/[align_unroller, memory],
+  ./gemm_tiling, ./gemm_utils, ./gemm, ./gemm_prepacked
+
+# ############################################################
+#
+#              Serialized prepacked B matrices
+#
+# ############################################################
+
+# The layout of a prepacked B depends on the microkernel (ISA, mr and nr)
+# and on the blocking kc and nc derived from the cache sizes or the tuning profile.
+# Weights packed once can be stored in a file
+# and used directly from a memory-mapped file by `gemm_packedB`
+# instead of being repacked at each process start.
+#
+# File layout, in the byte order of the machine that packed it:
+#   - PackedBHeader
+#   - padding up to `data_offset`, a multiple of LASER_MEM_ALIGN
+#   - ~B panels as written by gemm_prepackB_impl: for each jc block,
+#     for each pc block, a [kc, nc] panel packed by micropanels of nr columns.
+#
+# The header records everything the layout depends on.
+# A file packed for another microkernel than the one this CPU dispatches to
+# is rejected, it must be packed again.
+
+type
+  PackedScalar = enum
+    psFloat32 = "float32"
+    psFloat64 = "float64"
+    psInt32 = "int32"
+    psUint32 = "uint32"
+    psInt64 = "int64"
+    psUint64 = "uint64"
+
+  PackedBHeader* = object
+    magic*: array[8, char]
+    version*: uint32
+    byte_order*: uint32     ## PackedBByteOrder as written by the packing machine
+    scalar*: uint32         ## PackedScalar
+    cpu_simd*: uint32       ## CPUFeatureX86 of the microkernel
+    mr*, nr*: uint32        ## Microkernel shape
+    kc*, nc*: uint32        ## Blocking of the ~B panels
+    N*, K*: int64           ## Shape of B
+    data_offset*: int64     ## Offset of the panels from the start of the header
+    data_size*: int64       ## Size of the panels in bytes
+
+  PackedB*[T] = object
+    ## View on a serialized prepacked B of shape [header.K, header.N],
+    ## in memory or memory-mapped. It does not own the memory.
+    header*: ptr PackedBHeader
+    data*: ptr UncheckedArray[T]
+
+  MappedPackedB*[T] = object
+    ## A prepacked B memory-mapped from a file
+    file: MemFile
+    packed*: PackedB[T]
+
+  PackedBScalar* = float32 or float64 or int32 or uint32 or int64 or uint64
+
+const
+  PackedBMagic = ['L', 'A', 'S', 'E', 'R', 'P', 'K', 'B']
+  PackedBVersion = 1'u32
+  PackedBByteOrder = 0x01020304'u32
+  PackedBDataOffset = round_step_up(sizeof(PackedBHeader), LASER_MEM_ALIGN)
+
+template packed_scalar(T: typedesc): PackedScalar =
+  when T is float32: psFloat32
+  elif T is float64: psFloat64
+  elif T is int32: psInt32
+  elif T is uint32: psUint32
+  elif T is int64: psInt64
+  else: psUint64
+
+proc packedB_partition(
+      ukernel: static MicroKernel, T: typedesc,
+      N, K: int
+    ): tuple[nc, kc, size: int] =
+  ## Blocking and size in bytes of the ~B panels.
+  ## nc and kc do not depend on M, M = 1 is only a placeholder.
+  ## An empty B has no panels and a zero blocking.
+  if N == 0 or K == 0:
+    return
+  let (MC, NC, KC) = ukernel.partitionMNK(T, 1, N, K)
+  result.nc = NC
+  result.kc = KC
+  result.size = ukernel.gemm_prepackB_mem_required_impl(T, 1, N, K)
+
+proc gemm_prepackB_serialized_size*(T: typedesc[PackedBScalar], N, K: int): int =
+  ## Returns the size in bytes of a serialized prepacked B of shape KxN,
+  ## header included.
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    type A = T # workaround "Cannot evaluate at compile-time"
+    const ukernel = cpu_features.x86_ukernel(A, c_unit_stride = false)
+    return PackedBDataOffset + ukernel.packedB_partition(A, N, K).size
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+proc gemm_prepackB_serialize*[T: PackedBScalar](
+        dst: pointer, dst_size: int,
+        N, K: int,
+        src_B: ptr T, rowStrideB, colStrideB: int) =
+  ## Prepack matrix B of shape KxN and strides rowStrideB and colStrideB
+  ## into `dst` with a header, so that it can be stored
+  ## and used later with `gemm_packedB`.
+  ##
+  ## `dst` must be aligned on LASER_MEM_ALIGN
+  ## and hold at least `gemm_prepackB_serialized_size(T, N, K)` bytes.
+  doAssert (cast[int](dst) and (LASER_MEM_ALIGN - 1)) == 0,
+    "The destination pointer must be aligned on LASER_MEM_ALIGN"
+
+  let vB = src_B.toMatrixView(rowStrideB, colStrideB)
+
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    const ukernel = cpu_features.x86_ukernel(T, c_unit_stride = false)
+    let partition = ukernel.packedB_partition(T, N, K)
+    doAssert dst_size >= PackedBDataOffset + partition.size,
+      "The destination must hold at least gemm_prepackB_serialized_size(T, N, K) bytes"
+
+    let header = cast[ptr PackedBHeader](dst)
+    zeroMem(dst, PackedBDataOffset)
+    header.magic = PackedBMagic
+    header.version = PackedBVersion
+    header.byte_order = PackedBByteOrder
+    header.scalar = uint32 ord(packed_scalar(T))
+    header.cpu_simd = uint32 ord(cpu_features)
+    header.mr = uint32 ukernel.mr
+    header.nr = uint32 ukernel.nr
+    header.kc = uint32 partition.kc
+    header.nc = uint32 partition.nc
+    header.N = N
+    header.K = K
+    header.data_offset = PackedBDataOffset
+    header.data_size = partition.size
+
+    if partition.size > 0:
+      gemm_prepackB_impl[T, ukernel](
+        cast[ptr UncheckedArray[T]](cast[ByteAddress](dst) +% PackedBDataOffset),
+        1, N, K,
+        vB
+      )
+    return
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+proc save_prepackedB*[T: PackedBScalar](
+        path: string,
+        N, K: int,
+        src_B: ptr T, rowStrideB, colStrideB: int) =
+  ## Prepack matrix B of shape KxN and strides rowStrideB and colStrideB
+  ## and write it to a file that can be memory-mapped by `mapPackedB`
+  let size = gemm_prepackB_serialized_size(T, N, K)
+  let mem = allocShared(size + LASER_MEM_ALIGN - 1)
+  defer: deallocShared(mem)
+  let buf = align_raw_data(byte, mem)
+
+  gemm_prepackB_serialize(buf, size, N, K, src_B, rowStrideB, colStrideB)
+
+  var f: File
+  if not open(f, path, fmWrite):
+    raise newException(IOError, "Cannot open \"" & path & "\" for writing")
+  defer: close(f)
+  if f.writeBuffer(buf, size) != size:
+    raise newException(IOError, "Cannot write the prepacked B to \"" & path & "\"")
+
+# ############################################################
+#
+#                    Loading
+#
+# ############################################################
+
+proc toPackedB*[T: PackedBScalar](mem: pointer, size: int): PackedB[T] =
+  ## Interpret `size` bytes at `mem` as a serialized prepacked B of T.
+  ## Raises ValueError if it is not one, if it was written by another
+  ## version of the format or on a machine with another byte order,
+  ## if it is truncated or if its header is inconsistent.
+  ##
+  ## `mem` must be aligned on LASER_MEM_ALIGN, mmap-ed files are page-aligned.
+  if size < sizeof(PackedBHeader):
+    raise newException(ValueError, "Prepacked B: truncated header")
+  let header = cast[ptr PackedBHeader](mem)
+  if header.magic != PackedBMagic:
+    raise newException(ValueError, "Prepacked B: invalid magic number")
+  if header.byte_order != PackedBByteOrder:
+    raise newException(ValueError, "Prepacked B: written with another byte order")
+  if header.version != PackedBVersion:
+    raise newException(ValueError,
+      "Prepacked B: format version " & $header.version &
+      ", expected " & $PackedBVersion)
+  if header.scalar != uint32 ord(packed_scalar(T)):
+    raise newException(ValueError,
+      "Prepacked B: packed for another scalar type than " & $packed_scalar(T))
+  if header.cpu_simd > uint32 ord(high(CPUFeatureX86)):
+    raise newException(ValueError, "Prepacked B: unknown microkernel " & $header.cpu_simd)
+  if header.nr == 0 or header.N < 0 or header.K < 0:
+    raise newException(ValueError, "Prepacked B: corrupted shape or blocking")
+  # An empty B is serialized without panels and with a zero blocking
+  let empty = header.N == 0 or header.K == 0
+  if empty != (header.kc == 0) or empty != (header.nc == 0):
+    raise newException(ValueError, "Prepacked B: corrupted shape or blocking")
+  let ukernel = x86_ukernel(CPUFeatureX86(header.cpu_simd), T, c_unit_stride = false)
+  if header.mr != uint32 ukernel.mr or header.nr != uint32 ukernel.nr:
+    raise newException(ValueError,
+      "Prepacked B: corrupted header, the " & $CPUFeatureX86(header.cpu_simd) &
+      " microkernel is " & $ukernel.mr & "x" & $ukernel.nr &
+      ", not " & $header.mr & "x" & $header.nr)
+  # The header is untrusted: bound each factor before multiplying
+  # so that a corrupted field cannot overflow the size computations.
+  # B itself must fit in the buffer and the blocking cannot exceed its padded shape.
+  if header.N > size or header.K > size or
+      (header.K > 0 and header.N > size div T.sizeof div header.K.int):
+    raise newException(ValueError, "Prepacked B: shape larger than the data")
+  let
+    N = header.N.int
+    K = header.K.int
+    nr = header.nr.int
+    kc = header.kc.int
+    nc = header.nc.int
+  if kc > K or nc > get_num_tiles(N, nr) * nr:
+    raise newException(ValueError, "Prepacked B: blocking larger than the shape")
+  let data_size = if empty: 0
+                  else: T.sizeof * kc * get_num_tiles(nc, nr) * nr *
+                          get_num_tiles(N, nc) * get_num_tiles(K, kc)
+  if header.data_size != data_size:
+    raise newException(ValueError, "Prepacked B: data size does not match its shape and blocking")
+  if header.data_offset < sizeof(PackedBHeader) or header.data_offset > size or
+      header.data_size > size - header.data_offset:
+    raise newException(ValueError, "Prepacked B: truncated data")
+  if ((cast[int](mem) + header.data_offset.int) and (LASER_MEM_ALIGN - 1)) != 0:
+    raise newException(ValueError, "Prepacked B: data is not aligned on LASER_MEM_ALIGN")
+
+  result.header = header
+  result.data = cast[ptr UncheckedArray[T]](
+    cast[ByteAddress](mem) +% header.data_offset.int
+  )
+
+proc mapPackedB*[T: PackedBScalar](path: string): MappedPackedB[T] =
+  ## Memory-map a file written by `save_prepackedB`.
+  ## The pages are loaded on first use, unmap with `close`.
+  result.file = memfiles.open(path, mode = fmRead)
+  try:
+    result.packed = toPackedB[T](result.file.mem, result.file.size)
+  except ValueError:
+    result.file.close()
+    raise
+
+proc close*[T](mapped: var MappedPackedB[T]) =
+  mapped.file.close()
+  mapped.packed = PackedB[T]()
+
+proc dispatch_mismatch[T](packedB: PackedB[T]): string =
+  ## Returns why the microkernel of this CPU cannot use `packedB`
+  ## or an empty string if it can.
+  let simd = gemm_cpu_simd(T)
+  if packedB.header.cpu_simd != uint32 ord(simd):
+    if packedB.header.cpu_simd > uint32 ord(high(CPUFeatureX86)):
+      return "Prepacked B: unknown microkernel " & $packedB.header.cpu_simd
+    return "Prepacked B: packed for the " & $CPUFeatureX86(packedB.header.cpu_simd) &
+      " microkernel but this CPU uses " & $simd
+  let ukernel = x86_ukernel(simd, T, c_unit_stride = false)
+  if packedB.header.mr != uint32 ukernel.mr or packedB.header.nr != uint32 ukernel.nr:
+    return "Prepacked B: packed for a " & $packedB.header.mr & "x" & $packedB.header.nr &
+      " microkernel but this build uses " & $ukernel.mr & "x" & $ukernel.nr
+
+proc gemm_packedB_compatible*[T](packedB: PackedB[T]): bool =
+  ## Returns true if `gemm_packedB` can use `packedB` on this CPU.
+  ## Otherwise B must be packed again.
+  dispatch_mismatch(packedB).len == 0
+
+# ############################################################
+#
+#                 GEMM with a serialized B
+#
+# ############################################################
+
+proc gemm_packedB*[T: PackedBScalar](
+      M: int,
+      alpha: T,
+      A: ptr T,
+      rowStrideA, colStrideA: int,
+      packedB: PackedB[T],
+      beta: T,
+      C: ptr T,
+      rowStrideC, colStrideC: int) =
+  ## Compute C = αA*B + βC with A of shape MxK
+  ## and B of shape KxN prepacked by `gemm_prepackB_serialize` or `save_prepackedB`.
+  ## A is packed on the fly.
+  ##
+  ## Raises ValueError if B was packed for another microkernel
+  ## than the one this CPU dispatches to, see `gemm_packedB_compatible`.
+  let mismatch = dispatch_mismatch(packedB)
+  if mismatch.len > 0:
+    raise newException(ValueError, mismatch)
+
+  let N = packedB.header.N.int
+  let K = packedB.header.K.int
+  if M == 0 or N == 0:
+    return
+  let vA = A.toMatrixView(rowStrideA, colStrideA)
+  let vC = C.toMatrixView(rowStrideC, colStrideC)
+
+  # αAB does not contribute and K = 0 has no panels
+  if alpha == 0.T or K == 0:
+    gemm_scale_epilogue(M, N, beta, vC, Epilogue[T]())
+    return
+
+  template dispatch(cpu_features: static CPUFeatureX86): untyped{.dirty.} =
+    template apply(ukernel: MicroKernel): untyped {.dirty.} =
+      # The blocking of ~B is fixed by the file, only mc is chosen here:
+      # the block Ã [mc, kc] gets the L2 budget of the host blocking
+      # for the kc of the file.
+      const MR = ukernel.mr
+      var tiles: Tiles[T]
+      tiles.kc = packedB.header.kc.int
+      let host = ukernel.partitionMNK(T, M, N, K)
+      let mc = host.mc * host.kc div tiles.kc
+      tiles.mc = min(max(MR, mc - mc mod MR), M)
+      tiles.nc = packedB.header.nc.int
+      tiles.ic_num_tasks = get_num_tiles(M, tiles.mc)
+      tiles.upanelA_size = tiles.kc * round_step_up(tiles.mc, MR)
+
+      let mem_required = T.sizeof * tiles.upanelA_size * tiles.ic_num_tasks
+      var ws_alloc: pointer
+      when defined(GEMM_NO_CACHED_WORKSPACE):
+        ws_alloc = allocShared(mem_required + LASER_MEM_ALIGN - 1)
+        tiles.a = align_raw_data(T, ws_alloc)
+      else:
+        tiles.a = cast[ptr UncheckedArray[T]](gemm_cached_workspace(mem_required))
+
+      gemm_packedB_impl[T, ukernel](
+        M, N, K,
+        alpha, vA, packedB.data,
+        beta, vC,
+        tiles
+      )
+      if not ws_alloc.isNil:
+        deallocShared(ws_alloc)
+      return
+    # The shape of the register tile is not picked from M and N
+    # like in gemm_strided: B was packed in nr-wide panels
+    # for the default microkernel, before M is known.
+    if colStrideC == 1:
+      const ukernel = cpu_features.x86_ukernel(T, true)
+      apply(ukernel)
+    else:
+      const ukernel = cpu_features.x86_ukernel(T, false)
+      apply(ukernel)
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  import os, random
+
+  block: # Round-trip through a memory-mapped file
+    const M = 67
+    const N = 253
+    const K = 301
+
+    var a = newSeq[float32](M*K)
+    var b = newSeq[float32](K*N)
+    for i in 0 ..< a.len: a[i] = float32(rand(-4 .. 4))
+    for i in 0 ..< b.len: b[i] = float32(rand(-4 .. 4))
+
+    var expected = newSeq[float32](M*N)
+    gemm_strided(
+      M, N, K,
+      1'f32, a[0].addr, K, 1,
+             b[0].addr, N, 1,
+      0'f32, expected[0].addr, N, 1
+    )
+
+    let path = getTempDir() / "laser_prepackedB_test.bin"
+    save_prepackedB(path, N, K, b[0].addr, N, 1)
+    defer: removeFile(path)
+
+    var mapped = mapPackedB[float32](path)
+    doAssert mapped.packed.header.N == N and mapped.packed.header.K == K
+    doAssert gemm_packedB_compatible(mapped.packed)
+
+    var c = newSeq[float32](M*N)
+    gemm_packedB(
+      M,
+      1'f32, a[0].addr, K, 1,
+      mapped.packed,
+      0'f32, c[0].addr, N, 1
+    )
+    mapped.close()
+    doAssert c == expected
+
+    # Rejected as another scalar type
+    doAssertRaises(ValueError):
+      discard mapPackedB[float64](path)
+    echo "SUCCESS\n"
+
+  block: # Rejected when packed for another microkernel
+    const N = 16
+    const K = 16
+    var b = newSeq[int32](K*N)
+    let size = gemm_prepackB_serialized_size(int32, N, K)
+    let mem = allocShared0(size + LASER_MEM_ALIGN - 1)
+    let buf = align_raw_data(byte, mem)
+    gemm_prepackB_serialize(buf, size, N, K, b[0].addr, N, 1)
+
+    let packed = toPackedB[int32](buf, size)
+    doAssert gemm_packedB_compatible(packed)
+    packed.header.cpu_simd = if packed.header.cpu_simd == uint32 ord(x86_Generic): uint32 ord(x86_AVX512)
+                             else: uint32 ord(x86_Generic)
+    doAssert not gemm_packedB_compatible(packed)
+
+    var c = newSeq[int32](N)
+    doAssertRaises(ValueError):
+      gemm_packedB(
+        1,
+        1'i32, b[0].addr, K, 1,
+        packed,
+        0'i32, c[0].addr, N, 1
+      )
+    deallocShared(mem)
+    echo "SUCCESS\n"
+
+  block: # Rejected when truncated or when the header is corrupted
+    const N = 37
+    const K = 29
+    var b = newSeq[float32](K*N)
+    let size = gemm_prepackB_serialized_size(float32, N, K)
+    let mem = allocShared0(size + LASER_MEM_ALIGN - 1)
+    let buf = align_raw_data(byte, mem)
+    gemm_prepackB_serialize(buf, size, N, K, b[0].addr, N, 1)
+    discard toPackedB[float32](buf, size)
+
+    let path = getTempDir() / "laser_prepackedB_truncated.bin"
+    block:
+      var f = open(path, fmWrite)
+      doAssert f.writeBuffer(buf, size - 1) == size - 1
+      f.close()
+    doAssertRaises(ValueError):
+      discard mapPackedB[float32](path)
+    removeFile(path)
+
+    let header = cast[ptr PackedBHeader](buf)
+    template corrupted(field, value: untyped) =
+      let saved = header.field
+      header.field = value
+      doAssertRaises(ValueError):
+        discard toPackedB[float32](buf, size)
+      header.field = saved
+
+    corrupted(kc, 0)
+    corrupted(nc, 0)
+    corrupted(nr, 0)
+    corrupted(nr, header.nr + 1)
+    corrupted(N, -1)
+    corrupted(K, header.K + 1000)
+    corrupted(data_size, header.data_size - 4)
+    corrupted(cpu_simd, 1000)
+    # Values that would overflow the size computations
+    corrupted(N, high(int64))
+    corrupted(K, high(int64) div 2)
+    corrupted(kc, high(uint32))
+    corrupted(nc, high(uint32))
+    corrupted(data_size, high(int64))
+    corrupted(data_offset, high(int64))
+    discard toPackedB[float32](buf, size)
+
+    deallocShared(mem)
+    echo "SUCCESS\n"
+
+  block: # Empty shapes round-trip, K = 0 and α = 0 only scale C
+    for (N, K) in [(0, 7), (9, 0), (0, 0)]:
+      var b = newSeq[float32](max(1, K*N))
+      let size = gemm_prepackB_serialized_size(float32, N, K)
+      let mem = allocShared0(size + LASER_MEM_ALIGN - 1)
+      let buf = align_raw_data(byte, mem)
+      gemm_prepackB_serialize(buf, size, N, K, b[0].addr, max(1, N), 1)
+      let packed = toPackedB[float32](buf, size)
+      doAssert packed.header.N == N and packed.header.K == K
+      doAssert packed.header.data_size == 0
+
+      const M = 5
+      var a = newSeq[float32](max(1, M*K))
+      var c = newSeq[float32](max(1, M*N))
+      for i in 0 ..< c.len: c[i] = float32(i)
+      gemm_packedB(
+        M,
+        1'f32, a[0].addr, max(1, K), 1,
+        packed,
+        2'f32, c[0].addr, max(1, N), 1
+      )
+      if N > 0:
+        for i in 0 ..< c.len: doAssert c[i] == 2'f32 * float32(i)
+      deallocShared(mem)
+
+    # M = 0 and α = 0
+    const N = 13
+    const K = 11
+    var b = newSeq[float32](K*N)
+    for i in 0 ..< b.len: b[i] = float32(rand(-4 .. 4))
+    let size = gemm_prepackB_serialized_size(float32, N, K)
+    let mem = allocShared0(size + LASER_MEM_ALIGN - 1)
+    let buf = align_raw_data(byte, mem)
+    gemm_prepackB_serialize(buf, size, N, K, b[0].addr, N, 1)
+    let packed = toPackedB[float32](buf, size)
+
+    var a = newSeq[float32](3*K)
+    var c = newSeq[float32](3*N)
+    gemm_packedB(
+      0,
+      1'f32, a[0].addr, K, 1,
+      packed,
+      0'f32, c[0].addr, N, 1
+    )
+    for i in 0 ..< c.len: c[i] = float32(i)
+    gemm_packedB(
+      3,
+      0'f32, a[0].addr, K, 1,
+      packed,
+      0.5'f32, c[0].addr, N, 1
+    )
+    for i in 0 ..< c.len: doAssert c[i] == 0.5'f32 * float32(i)
+    deallocShared(mem)
+    echo "SUCCESS\n"
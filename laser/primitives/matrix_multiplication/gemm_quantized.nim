@@ -0,0 +1,480 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../cpuinfo, ../../compiler_optim_hints, ../../openmp,
+  ../../private/align_unroller,
+  ./gemm_tiling, ./gemm_utils, ./gemm_ukernel_u8s8,
+  ./gemm_ukernel_u8s8_avx2, ./gemm_ukernel_u8s8_avx512bw, ./gemm_ukernel_u8s8_avx512vnni,
+  math
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#      Quantized GEMM: uint8 * int8 -> int32 accumulation
+#
+# ############################################################
+
+# Quantized inference multiplies uint8 activations A by int8 weights B
+# and accumulates in int32. Compared to float32 this is
+# 4x less memory bandwidth for the weights and 2x~4x the compute throughput.
+#
+# The int32 result is then requantized to int8, uint8 or float32:
+#   C = clamp(round(scale * (AB - zpA * Σk B[k, j] + bias[j])) + zpC)
+#
+# The requantization is fused on the last pc iteration.
+# When K > kc the partial int32 sums of the previous pc iterations
+# are kept in an int32 scratch matrix.
+
+type
+  Requantization* = object
+    ## Conversion of the int32 accumulator C = AB to the output type
+    a_zero_point*: int32
+      ## Zero point of A. It is corrected with the column sums of B
+    bias*: ptr UncheckedArray[int32]
+      ## Optional per-column bias of length N in the int32 domain, nil for none
+    scale*: float32
+      ## Multiplier from the int32 domain to the output domain,
+      ## usually scaleA * scaleB / scaleC
+    col_scales*: ptr UncheckedArray[float32]
+      ## Optional per-column (per output channel) multiplier of length N.
+      ## It overrides `scale` if not nil.
+    out_zero_point*: int32
+      ## Zero point of C, ignored for float32 output
+    clamp_min*, clamp_max*: int32
+      ## Clamping after adding the output zero point, ignored for float32 output.
+      ## Use clamp_min = out_zero_point to fuse a ReLU.
+
+func requantization*(
+      scale: float32,
+      out_zero_point = 0'i32,
+      a_zero_point = 0'i32,
+      bias: ptr int32 = nil,
+      clamp_min = low(int32), clamp_max = high(int32)
+    ): Requantization =
+  ## Per-tensor requantization
+  result.scale = scale
+  result.out_zero_point = out_zero_point
+  result.a_zero_point = a_zero_point
+  result.bias = cast[ptr UncheckedArray[int32]](bias)
+  result.clamp_min = clamp_min
+  result.clamp_max = clamp_max
+
+func requantization*(
+      col_scales: ptr float32,
+      out_zero_point = 0'i32,
+      a_zero_point = 0'i32,
+      bias: ptr int32 = nil,
+      clamp_min = low(int32), clamp_max = high(int32)
+    ): Requantization =
+  ## Per-column (per output channel) requantization
+  result = requantization(1'f32, out_zero_point, a_zero_point, bias, clamp_min, clamp_max)
+  result.col_scales = cast[ptr UncheckedArray[float32]](col_scales)
+
+func requantize[O](rq: Requantization, acc: int32, colsumB: int32, j: int): O {.inline.} =
+  var acc = acc - rq.a_zero_point * colsumB
+  if not rq.bias.isNil:
+    acc += rq.bias[j]
+  let scale = if rq.col_scales.isNil: rq.scale
+              else: rq.col_scales[j]
+  when O is float32:
+    result = float32(acc) * scale
+  else:
+    let lo = max(rq.clamp_min, int32 low(O))
+    let hi = min(rq.clamp_max, int32 high(O))
+    # Clamp before converting: the scaled accumulator and the zero point
+    # can be out of the int32 range
+    let q = round(float32(acc) * scale) + float32(rq.out_zero_point)
+    result = O(clamp(q, float32(lo), float32(hi)))
+
+# ############################################################
+#
+#                    Tiling
+#
+# ############################################################
+
+type QuantizedTiles = object
+  mc, nc, kc: int
+  ic_num_tasks: int
+  upanelA_size: int # bytes
+  bufA_size, bufB_size, colsum_size, scratch_size: int # bytes
+
+proc partitionQuantized(
+      ukernel: static MicroKernel,
+      M, N, K: int,
+      need_scratch: bool
+    ): QuantizedTiles =
+  const
+    MR = ukernel.mr
+    NR = ukernel.nr
+  (result.mc, result.nc, result.kc) = ukernel.partitionMNK(int8, M, N, K)
+  if result.kc < K:
+    # Only the last kc block can have a K tail
+    result.kc = max(4, round_step_down(result.kc, 4))
+  let kc4 = get_num_tiles(result.kc, 4)
+
+  result.ic_num_tasks = get_num_tiles(M, result.mc)
+  result.upanelA_size = round_step_up(kc4 * 4 * round_step_up(result.mc, MR), LASER_MEM_ALIGN)
+  result.bufA_size = result.upanelA_size * result.ic_num_tasks
+  result.bufB_size = round_step_up(kc4 * 4 * round_step_up(result.nc, NR), LASER_MEM_ALIGN)
+  result.colsum_size = round_step_up(N * sizeof(int32), LASER_MEM_ALIGN)
+  if need_scratch and result.kc < K:
+    result.scratch_size = M * N * sizeof(int32)
+
+# ############################################################
+#
+#                    Microkernel dispatch
+#
+# ############################################################
+
+proc gebb_ukernel_u8s8[MR, NR: static int; simd: static CPUFeatureX86; vnni: static bool](
+      kc: int,
+      packedA: ptr UncheckedArray[uint8],
+      packedB: ptr UncheckedArray[int8],
+      AB: var array[MR, array[NR, int32]]
+    ) {.inline.} =
+  ## AB = Ã[MR, kc] * ~B[kc, NR] with Ã and ~B packed by pack_A_u8s8 and pack_B_u8s8
+  let kc4 = get_num_tiles(kc, 4)
+
+  when simd == x86_AVX512 and vnni:
+    gebb_ukernel_u8s8_avx512vnni[MR, NR](kc4, packedA, packedB, AB)
+  elif simd == x86_AVX512:
+    gebb_ukernel_u8s8_avx512bw[MR, NR](kc4, packedA, packedB, AB)
+  elif simd == x86_AVX2:
+    gebb_ukernel_u8s8_avx2[MR, NR](kc4, packedA, packedB, AB)
+  else:
+    gebb_ukernel_u8s8_fallback[MR, NR](kc4, packedA, packedB, AB)
+
+# ############################################################
+#
+#                    Implementation
+#
+# ############################################################
+
+proc gemm_u8s8_impl[O; ukernel: static MicroKernel; vnni: static bool](
+      M, N, K: int,
+      vA: MatrixView[uint8], vB: MatrixView[int8],
+      vC: MatrixView[O],
+      rq: Requantization
+    ) =
+  const
+    MR = ukernel.extract_mr
+    NR = ukernel.extract_nr
+    PT = ukernel.extract_pt
+    simd = ukernel.extract_cpu_simd
+    raw_int32 = O is int32
+
+  let tiles = ukernel.partitionQuantized(M, N, K, need_scratch = not raw_int32)
+  let workspace = cast[ByteAddress](gemm_cached_workspace(
+    tiles.bufA_size + tiles.bufB_size + tiles.colsum_size + tiles.scratch_size
+  ))
+  let bufA = cast[ptr UncheckedArray[uint8]](workspace)
+  let bufB = cast[ptr UncheckedArray[int8]](workspace +% tiles.bufA_size)
+  let colsumB = cast[ptr UncheckedArray[int32]](workspace +% tiles.bufA_size +% tiles.bufB_size)
+  let scratch = cast[ptr int32](
+    workspace +% tiles.bufA_size +% tiles.bufB_size +% tiles.colsum_size
+  ).toMatrixView(rowStride = N, colStride = 1)
+
+  # Column sums of B to correct the zero point of A:
+  #   Σk (A[i, k] - zpA) * B[k, j] = Σk A[i, k] * B[k, j] - zpA * Σk B[k, j]
+  when not raw_int32:
+    if rq.a_zero_point != 0:
+      for j in `||`(0, N-1, "parallel for"):
+        var sum = 0'i32
+        for k in 0 ..< K:
+          sum += int32 vB[k, j]
+        colsumB[j] = sum
+
+  let parallelize = M*N*K > PT*PT*PT
+
+  # A single parallel region spans the jc and pc loops, see gemm_impl
+  omp_parallel_if(parallelize):
+    for jc in countup(0, N-1, tiles.nc):
+      let nc = min(N - jc, tiles.nc)
+      for pc in countup(0, K-1, tiles.kc):
+        let kc = min(K - pc, tiles.kc)
+        let kc4 = get_num_tiles(kc, 4)
+        let first_pc = pc == 0
+        let last_pc = pc + kc == K
+
+        # Shared by all threads, ends with a barrier
+        pack_B_u8s8[NR](bufB, kc, nc, vB.stride(pc, jc))
+
+        omp_for(icb, tiles.ic_num_tasks, use_simd=false, nowait=false):
+          let packA = bufA + icb * tiles.upanelA_size
+          let ic = icb * tiles.mc
+          let mc = min(M - ic, tiles.mc)
+          pack_A_u8s8[MR](packA, mc, kc, vA.stride(ic, pc))
+
+          for jr in `||`(0, nc-1, NR, "taskloop"):
+            let nr = min(nc - jr, NR)
+            for ir in countup(0, mc-1, MR):
+              let mr = min(mc - ir, MR)
+              let i0 = ic + ir
+              let j0 = jc + jr
+
+              var AB{.align_variable.}: array[MR, array[NR, int32]]
+              gebb_ukernel_u8s8[MR, NR, simd, vnni](
+                kc,
+                packA + ir * kc4 * 4,
+                bufB + jr * kc4 * 4,
+                AB
+              )
+
+              when raw_int32:
+                # C is the int32 accumulator
+                for i in 0 ..< mr:
+                  for j in 0 ..< nr:
+                    if first_pc: vC[i0+i, j0+j] = AB[i][j]
+                    else: vC[i0+i, j0+j] += AB[i][j]
+              else:
+                if not last_pc:
+                  for i in 0 ..< mr:
+                    for j in 0 ..< nr:
+                      if first_pc: scratch[i0+i, j0+j] = AB[i][j]
+                      else: scratch[i0+i, j0+j] += AB[i][j]
+                else:
+                  # Requantize while the tile is hot
+                  for i in 0 ..< mr:
+                    for j in 0 ..< nr:
+                      var acc = AB[i][j]
+                      if not first_pc:
+                        acc += scratch[i0+i, j0+j]
+                      let colsum = if rq.a_zero_point != 0: colsumB[j0+j]
+                                   else: 0'i32
+                      vC[i0+i, j0+j] = requantize[O](rq, acc, colsum, j0+j)
+
+# ############################################################
+#
+#   Exported function and dispatch with CPU runtime detection
+#
+# ############################################################
+
+proc gemm_u8s8_dispatch[O](
+      M, N, K: int,
+      A: ptr uint8, rowStrideA, colStrideA: int,
+      B: ptr int8, rowStrideB, colStrideB: int,
+      C: ptr O, rowStrideC, colStrideC: int,
+      rq: Requantization) =
+  if M == 0 or N == 0:
+    return
+
+  let vA = A.toMatrixView(rowStrideA, colStrideA)
+  let vB = B.toMatrixView(rowStrideB, colStrideB)
+  let vC = C.toMatrixView(rowStrideC, colStrideC)
+
+  # K = 0 would give an empty kc: AB is 0 and so is the zero point correction,
+  # only the bias and the output zero point remain
+  if K == 0:
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        when O is int32:
+          vC[i, j] = 0
+        else:
+          vC[i, j] = requantize[O](rq, 0, 0, j)
+    return
+
+  template dispatch(cpu_features: static CPUFeatureX86, vnni: static bool): untyped =
+    const ukernel = x86_ukernel_u8s8(cpu_features)
+    gemm_u8s8_impl[O, ukernel, vnni](M, N, K, vA, vB, vC, rq)
+    return
+
+  when defined(i386) or defined(amd64):
+    if cpuinfo_has_x86_avx512vnni():   dispatch(x86_AVX512, vnni = true)
+    elif cpuinfo_has_x86_avx512bw():   dispatch(x86_AVX512, vnni = false)
+    elif cpuinfo_has_x86_avx2():       dispatch(x86_AVX2, vnni = false)
+  dispatch(x86_Generic, vnni = false)
+
+proc gemm_u8s8_s32*(
+      M, N, K: int,
+      A: ptr uint8, rowStrideA, colStrideA: int,
+      B: ptr int8, rowStrideB, colStrideB: int,
+      C: ptr int32, rowStrideC, colStrideC: int) =
+  ## Compute C = A*B with A uint8, B int8 and C int32
+  gemm_u8s8_dispatch(
+    M, N, K,
+    A, rowStrideA, colStrideA,
+    B, rowStrideB, colStrideB,
+    C, rowStrideC, colStrideC,
+    Requantization()
+  )
+
+proc gemm_u8s8*[O: int8 or uint8 or float32](
+      M, N, K: int,
+      A: ptr uint8, rowStrideA, colStrideA: int,
+      B: ptr int8, rowStrideB, colStrideB: int,
+      C: ptr O, rowStrideC, colStrideC: int,
+      requant: Requantization) =
+  ## Compute C = requantize(A*B) with A uint8, B int8
+  ## accumulated in int32, and C int8, uint8 or float32.
+  ## See `Requantization`.
+  gemm_u8s8_dispatch(
+    M, N, K,
+    A, rowStrideA, colStrideA,
+    B, rowStrideB, colStrideB,
+    C, rowStrideC, colStrideC,
+    requant
+  )
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  block:
+    echo "\n## u8 * s8 -> s32 over the full uint8 range"
+    const M = 37
+    const N = 45
+    const K = 1501 # Not a multiple of 4 and larger than kc
+    var a: array[M, array[K, uint8]]
+    var b: array[K, array[N, int8]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = uint8((i * 7 + k * 3) mod 256)
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = int8((k * 5 + j * 11) mod 255 - 127)
+
+    var expected: array[M, array[N, int32]]
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        for k in 0 ..< K:
+          expected[i][j] += int32(a[i][k]) * int32(b[k][j])
+
+    var res: array[M, array[N, int32]]
+    gemm_u8s8_s32(
+      M, N, K,
+      a[0][0].addr, K, 1,
+      b[0][0].addr, N, 1,
+      res[0][0].addr, N, 1
+    )
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## u8 * s8 requantized to int8 with zero point, bias and ReLU"
+    const M = 5
+    const N = 7
+    const K = 9
+    var a: array[M, array[K, uint8]]
+    var b: array[K, array[N, int8]]
+    var bias: array[N, int32]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = uint8((i + 2 * k) mod 17)
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = int8((k * 3 - j * 5) mod 11)
+    for j in 0 ..< N:
+      bias[j] = int32(j * 10 - 30)
+
+    let rq = requantization(
+      scale = 0.25'f32, out_zero_point = 3, a_zero_point = 8,
+      bias = bias[0].addr, clamp_min = 3 # ReLU
+    )
+
+    var expected: array[M, array[N, int8]]
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        var acc = bias[j]
+        for k in 0 ..< K:
+          acc += (int32(a[i][k]) - 8) * int32(b[k][j])
+        expected[i][j] = int8 clamp(int32(round(float32(acc) * 0.25'f32)) + 3, 3, 127)
+
+    var res: array[M, array[N, int8]]
+    gemm_u8s8(
+      M, N, K,
+      a[0][0].addr, K, 1,
+      b[0][0].addr, N, 1,
+      res[0][0].addr, N, 1,
+      rq
+    )
+    doAssert res == expected, $res
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## u8 * s8 requantized with a scale that saturates beyond int32"
+    const M = 3
+    const N = 17
+    const K = 8
+    var a: array[M, array[K, uint8]]
+    var b: array[K, array[N, int8]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = 200
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = if j mod 2 == 0: 100'i8 else: -100'i8
+
+    let rq = requantization(
+      scale = 1e9'f32, out_zero_point = high(int32)
+    )
+    var res: array[M, array[N, uint8]]
+    gemm_u8s8(
+      M, N, K,
+      a[0][0].addr, K, 1,
+      b[0][0].addr, N, 1,
+      res[0][0].addr, N, 1,
+      rq
+    )
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        # ±1.6e14 + high(int32) saturates to either bound of uint8
+        doAssert res[i][j] == (if j mod 2 == 0: 255'u8 else: 0'u8)
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## u8 * s8 -> s32 with A = 255 and B = -128: no int16 saturation on any ISA"
+    const M = 9
+    const N = 33
+    const K = 64
+    var a: array[M, array[K, uint8]]
+    var b: array[K, array[N, int8]]
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        a[i][k] = 255
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        b[k][j] = if j mod 2 == 0: -128'i8 else: 127'i8
+
+    var res: array[M, array[N, int32]]
+    gemm_u8s8_s32(
+      M, N, K,
+      a[0][0].addr, K, 1,
+      b[0][0].addr, N, 1,
+      res[0][0].addr, N, 1
+    )
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        doAssert res[i][j] == (if j mod 2 == 0: -128'i32 * 255 * K else: 127'i32 * 255 * K), $res[i][j]
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## K = 0: C is 0 for int32 output and the requantized bias otherwise"
+    var a = [0'u8]
+    var b = [0'i8]
+    var bias = [-7'i32, 40]
+    var c32 = [[1'i32, 2], [3'i32, 4]]
+    gemm_u8s8_s32(
+      2, 2, 0,
+      a[0].addr, 0, 1,
+      b[0].addr, 2, 1,
+      c32[0][0].addr, 2, 1
+    )
+    doAssert c32 == [[0'i32, 0], [0'i32, 0]], $c32
+
+    var c8 = [[1'u8, 2], [3'u8, 4]]
+    gemm_u8s8(
+      2, 2, 0,
+      a[0].addr, 0, 1,
+      b[0].addr, 2, 1,
+      c8[0][0].addr, 2, 1,
+      requantization(scale = 0.5'f32, out_zero_point = 10, a_zero_point = 3, bias = bias[0].addr)
+    )
+    doAssert c8 == [[6'u8, 30], [6'u8, 30]], $c8
+    echo "SUCCESS\n"
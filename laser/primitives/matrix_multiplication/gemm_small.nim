@@ -0,0 +1,159 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../compiler_optim_hints,
+  ./gemm_tiling, ./gemm_utils, ./gemm_ukernel_generic,
+  ./gemm_ukernel_sse, ./gemm_ukernel_sse2,
+  ./gemm_ukernel_avx, ./gemm_ukernel_avx_fma,
+  ./gemm_ukernel_avx512
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#          Small matrix multiplication without packing
+#
+# ############################################################
+
+# For small matrices, for example 3x3 to 64x64 from convolution kernels
+# or small Dense layers, packing A and B and allocating the packing buffers
+# costs more than the multiplication itself.
+# Everything fits in L1 or L2 cache so we read directly
+# from the strided views and accumulate a MR*NR register tile.
+#
+# The small path:
+#   - does not allocate on the heap
+#   - does not open a parallel region
+#   - computes the full tiles with the register tile of the ISA microkernel,
+#     for float32 and float64 with a unit column stride B,
+#     with kernels generated by `gemm_small_kernel_generator`
+#     in the gemm_ukernel_<isa> files to be compiled with their SIMD flags
+#   - otherwise, and for the edges, uses compile-time MR*NR tiles
+#     so that the compiler unrolls the accumulation loops.
+#
+# Packing is amortized over M*N*K FMAs for M*K + K*N packed elements,
+# with M and N <= 64 that is at most 32 FMAs per packed element.
+# The unpacked kernels load A and B from L1 instead
+# and skip the workspace and the parallel region.
+
+const GEMM_SMALL_MAX_DIM*{.intdefine.} = 64
+  ## M, N and K must all be lower or equal to this
+  ## to use the small matrix multiplication path.
+  ## Pass `-d:GEMM_SMALL_MAX_DIM=0` to disable it.
+
+func is_small_gemm*(M, N, K: int): bool {.inline.} =
+  M <= GEMM_SMALL_MAX_DIM and N <= GEMM_SMALL_MAX_DIM and K <= GEMM_SMALL_MAX_DIM
+
+proc gemm_small_tile[T; MR, NR: static int; b_unit_stride: static bool](
+      mr, nr, K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
+    ) =
+  ## Compute a [mr, nr] tile of C with mr <= MR and nr <= NR
+  var AB{.align_variable.}: array[MR, array[NR, T]]
+
+  template B(k, j: int): T =
+    when b_unit_stride:
+      vB.buffer[k*vB.rowStride + j]
+    else:
+      vB[k, j]
+
+  if mr == MR and nr == NR:
+    # Shape-specialized: all bounds are known at compile-time
+    for k in 0 ..< K:
+      for i in 0 ..< MR:
+        let a = vA[i, k]
+        for j in `||`(0, NR-1, "simd"):
+          AB[i][j] += a * B(k, j)
+  else:
+    for k in 0 ..< K:
+      for i in 0 ..< mr:
+        let a = vA[i, k]
+        for j in 0 ..< nr:
+          AB[i][j] += a * B(k, j)
+
+  gebb_ukernel_edge_epilogue(
+    alpha, AB.addr,
+    beta, vC, mr, nr,
+    epilogue
+  )
+
+func small_kernel_available(T: typedesc, simd: CPUFeatureX86): bool =
+  ## A SIMD small kernel is generated for this type and ISA
+  when T is float32:
+    simd in {x86_SSE, x86_AVX, x86_AVX_FMA, x86_AVX512}
+  elif T is float64:
+    simd in {x86_SSE2, x86_AVX, x86_AVX_FMA, x86_AVX512}
+  else:
+    false
+
+proc gemm_small_simd[T; simd: static CPUFeatureX86; MR, NbVecs: static int](
+      K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
+    ) {.inline.} =
+  ## Full [MR, NbVecs * nb_scalars] tile with the SIMD kernel of `simd`
+  when simd == x86_SSE:         gemm_small_sse[MR, NbVecs](K, alpha, vA, vB, beta, vC, epilogue)
+  elif simd == x86_SSE2:        gemm_small_sse2[MR, NbVecs](K, alpha, vA, vB, beta, vC, epilogue)
+  elif simd == x86_AVX:         gemm_small_avx[MR, NbVecs](K, alpha, vA, vB, beta, vC, epilogue)
+  elif simd == x86_AVX_FMA:     gemm_small_avx_fma[MR, NbVecs](K, alpha, vA, vB, beta, vC, epilogue)
+  elif simd == x86_AVX512:      gemm_small_avx512[MR, NbVecs](K, alpha, vA, vB, beta, vC, epilogue)
+  else:
+    {.error: "No small matrix kernel for " & $simd.}
+
+proc gemm_small_impl[T; simd: static CPUFeatureX86; b_unit_stride: static bool](
+      M, N, K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
+    ) =
+  const
+    use_simd = b_unit_stride and small_kernel_available(T, simd)
+    ukernel = simd.x86_ukernel(T, c_unit_stride = false)
+    MR = if use_simd: ukernel.mr else: 4
+    NbVecs = ukernel.nb_vecs_nr
+    NR = if use_simd: ukernel.nr
+         else: max(4, 32 div sizeof(T)) # 8 float32/int32 or 4 float64/int64
+
+  for i in countup(0, M-1, MR):
+    let mr = min(M-i, MR)
+    for j in countup(0, N-1, NR):
+      let nr = min(N-j, NR)
+      when use_simd:
+        if mr == MR and nr == NR:
+          gemm_small_simd[T, simd, MR, NbVecs](
+            K,
+            alpha, vA.stride(i, 0), vB.stride(0, j),
+            beta, vC.stride(i, j),
+            epilogue.stride(i, j)
+          )
+          continue
+      gemm_small_tile[T, MR, NR, b_unit_stride](
+        mr, nr, K,
+        alpha, vA.stride(i, 0), vB.stride(0, j),
+        beta, vC.stride(i, j),
+        epilogue.stride(i, j)
+      )
+
+proc gemm_small*[T](
+      M, N, K: int,
+      alpha: T, vA, vB: MatrixView[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
+    ) =
+  ## Compute C = activation(αA*B + βC + bias) without packing.
+  ## Meant for matrices that satisfy `is_small_gemm`
+  template dispatch(simd: static CPUFeatureX86): untyped =
+    if vB.colStride == 1:
+      gemm_small_impl[T, simd, true](M, N, K, alpha, vA, vB, beta, vC, epilogue)
+    else:
+      gemm_small_impl[T, simd, false](M, N, K, alpha, vA, vB, beta, vC, epilogue)
+    return
+
+  # Same ISA as the GEMM microkernels, including the deterministic mode
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
@@ -32,7 +32,7 @@
 import
   ../../cpuinfo, ../../compiler_optim_hints,
   ../../private/[memory, align_unroller],
-  typetraits, macros,
+  typetraits, macros, os, strutils,
   ./gemm_utils
 
 # ############################################################
@@ -59,6 +59,12 @@ import
 #   so mr*nr >= 16
 
 type
+  MicroKernelShape* = enum
+    ## Register tile of C, see x86_ukernel
+    ukDefault  # mr ~ nr
+    ukWide     # small mr, large nr, for C with few rows
+    ukTall     # large mr, nr of one SIMD vector, for C with few columns
+
   MicroKernel* = object
     mr*, nr*: int
     cpu_simd*: CPUFeatureX86
@@ -196,7 +202,49 @@ else: # 32-bit
       x86_AVX512:  2  # 8 ZMM registers
     ]
 
-func x86_ukernel*(cpu: CPUFeatureX86, T: typedesc, c_unit_stride: bool): MicroKernel =
+# Alternative shapes of the register tile with the same register budget
+# (MR+2) * NbVecs <= X, for C with few rows or few columns:
+# the default 6x16 float32 AVX tile wastes 2/3 of its FMAs
+# on the rows of a C with 2 rows and half of them on the columns of a C with 8 columns.
+#    - Wide: MR = 2, NbVecs = 4 (SSE, AVX) or MR = 6, NbVecs = 4 (AVX512)
+#    - Tall: MR = 12, NbVecs = 1 (SSE, AVX) or MR = 28, NbVecs = 1 (AVX512)
+# They are only used on x86-64 for SIMD float32 and float64 microkernels.
+const X86_regs_wide: X86_FeatureMap = [
+  x86_Generic: 2,
+  x86_SSE:     2,
+  x86_SSE2:    2,
+  x86_SSE4_1:  2,
+  x86_AVX:     2,
+  x86_AVX_FMA: 2,
+  x86_AVX2:    2,
+  x86_AVX512:  6
+]
+
+const NbVecs_wide: X86_FeatureMap = [
+  x86_Generic: 1,
+  x86_SSE:     4,
+  x86_SSE2:    4,
+  x86_SSE4_1:  4,
+  x86_AVX:     4,
+  x86_AVX_FMA: 4,
+  x86_AVX2:    4,
+  x86_AVX512:  4
+]
+
+const X86_regs_tall: X86_FeatureMap = [
+  x86_Generic: 2,
+  x86_SSE:     12,
+  x86_SSE2:    12,
+  x86_SSE4_1:  12,
+  x86_AVX:     12,
+  x86_AVX_FMA: 12,
+  x86_AVX2:    12,
+  x86_AVX512:  28
+]
+
+func x86_ukernel*(
+      cpu: CPUFeatureX86, T: typedesc, c_unit_stride: bool,
+      shape = ukDefault): MicroKernel =
   result.cpu_simd = cpu
   result.c_unit_stride = c_unit_stride
   result.pt = 128
@@ -214,10 +262,54 @@ func x86_ukernel*(cpu: CPUFeatureX86, T: typedesc, c_unit_stride: bool): MicroKe
   # This avoids dealing with transpose
   # in the inner loop and untranspose in the epilogue
 
-  result.mr = X86_regs[cpu]                 # 2~6 registers for the rows of Ã
-  result.nb_vecs_nr = NbVecs[cpu]           # SIMD vectors of B
+  case shape
+  of ukDefault:
+    result.mr = X86_regs[cpu]               # 2~6 registers for the rows of Ã
+    result.nb_vecs_nr = NbVecs[cpu]         # SIMD vectors of B
+  of ukWide:
+    result.mr = X86_regs_wide[cpu]
+    result.nb_vecs_nr = NbVecs_wide[cpu]
+  of ukTall:
+    result.mr = X86_regs_tall[cpu]
+    result.nb_vecs_nr = 1
   result.nr = result.nb_vecs_nr * result.nb_scalars
 
+func ukernel_efficiency(ukernel: MicroKernel, M, N: int): float =
+  ## Estimated fraction of the peak FMA throughput of `ukernel` on a M*N C.
+  ##
+  ## Per k, the microkernel issues mr*nb_vecs FMAs, nb_vecs loads of ~B and mr broadcasts of Ã.
+  ## With as many load as FMA ports, loads are the bottleneck if mr + nb_vecs > mr*nb_vecs.
+  ## On the edges of C, full mr*nr tiles are computed for M mod mr rows and N mod nr columns.
+  let fmas = ukernel.mr * ukernel.nb_vecs_nr
+  let loads = ukernel.mr + ukernel.nb_vecs_nr
+  let
+    padded_M = (M + ukernel.mr - 1) div ukernel.mr * ukernel.mr
+    padded_N = (N + ukernel.nr - 1) div ukernel.nr * ukernel.nr
+    useful = float(M * N) / float(padded_M * padded_N)
+  result = useful * float(fmas) / float(max(fmas, loads))
+
+func x86_ukernel_shape*(cpu: CPUFeatureX86, T: typedesc, M, N: int, c_unit_stride = true): MicroKernelShape =
+  ## Returns the shape of the register tile for a M*N C.
+  ## An alternative shape must be at least 10% faster than the default one,
+  ## their blocking was not autotuned.
+  ##
+  ## If C is not unit-stride (column-major output), each of the nr columns of a tile
+  ## is written to a different cache line with a scalar epilogue.
+  ## The tall shape writes a single SIMD vector of columns of mr contiguous rows:
+  ## it is preferred as soon as it is as fast as the default one.
+  result = ukDefault
+  when defined(amd64) and T is SomeFloat:
+    if cpu == x86_Generic:
+      return
+    var best = x86_ukernel(cpu, T, false).ukernel_efficiency(M, N) * 1.1
+    for shape in [ukWide, ukTall]:
+      var efficiency = x86_ukernel(cpu, T, false, shape).ukernel_efficiency(M, N)
+      if shape == ukTall and not c_unit_stride:
+        efficiency *= 1.1
+      if efficiency > best:
+        best = efficiency
+        result = shape
+
 #############################################
 # Workaround "undeclared identifier mr or nr"
 # for some reason the compiler cannot access fields in
@@ -248,38 +340,315 @@ macro extract_pt*(ukernel: static MicroKernel): untyped =
 
 # multithreading info in [2] and https://github.com/flame/blis/blob/master/docs/Multithreading.md
 
-type Tiles*[T] = ref object
+type Tiles*[T] = object
+  ## Blocking of a GEMM and its packing buffers.
+  ## The buffers are carved from a workspace that Tiles do not own.
   a*: ptr UncheckedArray[T]
   b*: ptr UncheckedArray[T]
+  b_next*: ptr UncheckedArray[T] # Second panel of ~B if packing is pipelined, nil otherwise
   mc*, nc*, kc*: int
 
   # Multithreaded panels
   ic_num_tasks*: int   # For private L1-L2 and shared L3
   upanelA_size*: int   # Each thread uses a different upanel of A
-
-  # Allocation data
-  a_alloc_mem: pointer
-  b_alloc_mem: pointer
-  # The Tiles data structure takes 64-byte = 1 cache-line
-
-
-proc deallocTiles[T](tiles: Tiles[T]) =
-  if not tiles.a_alloc_mem.isNil:
-    deallocShared tiles.a_alloc_mem
-  if not tiles.b_alloc_mem.isNil:
-    deallocShared tiles.b_alloc_mem
+  # The Tiles data structure takes 64-byte, 1 cache-line
 
 func get_num_tiles*(dim_size, tile_size: int): int {.inline.} =
   ## Get the number of tiles along a dimension depending on the tile size	
   (dim_size + tile_size - 1) div tile_size
 
-func partitionMNK*(
+# ############################################################
+#
+#                    Cache hierarchy
+#
+# ############################################################
+
+type CacheHierarchy* = object
+  ## Data cache sizes in bytes and associativity
+  ## 0 if the cache level was not detected
+  l1d_size*, l1d_ways*: int
+  l2_size*, l2_ways*: int
+  l3_size*: int
+
+proc detect_cache_hierarchy(): CacheHierarchy =
+  let l1d = cpuinfo_get_l1d_cache(0)
+  if not l1d.isNil:
+    result.l1d_size = l1d.size.int
+    result.l1d_ways = l1d.associativity.int
+  let l2 = cpuinfo_get_l2_cache(0)
+  if not l2.isNil:
+    result.l2_size = l2.size.int
+    result.l2_ways = l2.associativity.int
+  let l3 = cpuinfo_get_l3_cache(0)
+  if not l3.isNil:
+    result.l3_size = l3.size.int
+
+let LaserCacheHierarchy* = detect_cache_hierarchy()
+  ## Detected once per process, at module initialization
+
+# ############################################################
+#
+#                    Tuning profile
+#
+# ############################################################
+
+# The microkernel ISA, blocking and parallelization threshold
+# can be measured on the host by gemm_autotune and persisted in a profile.
+# The profile is loaded at startup from $LASER_GEMM_PROFILE
+# or from <config dir>/laser/gemm_profile.txt and is ignored
+# if it was tuned on a different CPU model.
+# Compile with `-d:GEMM_NO_PROFILE` to ignore it.
+#
+# Format, one line per scalar type, mc/kc/pt 0 for the default:
+#   laser-gemm-profile 1
+#   cpu Intel(R) Core(TM) i9-9980XE CPU @ 3.00GHz
+#   float32 x86_AVX512 96 384 128
+
+type
+  GemmTuning* = object
+    tuned*: bool            ## The fields below are ignored if false
+    simd*: CPUFeatureX86    ## Microkernel ISA
+    mc*, kc*: int           ## Blocking of the `simd` microkernel, 0 for the cache-derived default
+    pt*: int                ## Parallelization threshold of the `simd` microkernel, 0 for the default
+
+  GemmTuningType* = enum
+    gttFloat32 = "float32"
+    gttFloat64 = "float64"
+    gttInt32 = "int32"
+    gttInt64 = "int64"
+
+const GemmProfileVersion = 1
+
+var LaserGemmTuning*: array[GemmTuningType, GemmTuning]
+  ## Tuning in use by this process. It must not be modified
+  ## while a GEMM is running.
+
+func cpu_supports*(simd: CPUFeatureX86): bool =
+  ## Returns true if the CPU supports the ISA of a microkernel
+  when defined(i386) or defined(amd64):
+    case simd
+    of x86_Generic: true
+    of x86_SSE:     cpuinfo_has_x86_sse()
+    of x86_SSE2:    cpuinfo_has_x86_sse2()
+    of x86_SSE4_1:  cpuinfo_has_x86_sse4_1()
+    of x86_AVX:     cpuinfo_has_x86_avx()
+    of x86_AVX_FMA: cpuinfo_has_x86_avx() and cpuinfo_has_x86_fma3()
+    of x86_AVX2:    cpuinfo_has_x86_avx2()
+    of x86_AVX512:  cpuinfo_has_x86_avx512f()
+  else:
+    simd == x86_Generic
+
+template tuning_type*(T: typedesc): untyped =
+  when T is float32: gttFloat32
+  elif T is float64: gttFloat64
+  elif T is int32 or T is uint32: gttInt32
+  elif T is int64 or T is uint64: gttInt64
+  else: {.error: "GEMM tuning is not supported for " & $T.}
+
+proc gemm_tuning*(T: typedesc): GemmTuning {.inline.} =
+  ## Returns the tuning of GEMM for T, not tuned if there is none
+  when T is float32 or T is float64 or
+       T is int32 or T is uint32 or T is int64 or T is uint64:
+    result = LaserGemmTuning[tuning_type(T)]
+
+# ############################################################
+#
+#                    Deterministic mode
+#
+# ############################################################
+
+# Floating-point addition is not associative, a GEMM result depends on:
+#   - the microkernel ISA: FMA or separate multiply and add,
+#   - kc: C accumulates one partial product of depth kc per pc iteration,
+#   - split-K: partial products are summed in an order depending on the thread count.
+# The other blocking parameters (mc, nc, mr, nr) and the parallelization of the
+# ic and jr loops only decide which thread computes an element of C, not in which order.
+#
+# In deterministic mode the ISA and kc are pinned and split-K is disabled
+# so that results are bitwise identical for any number of threads
+# and on any CPU supporting the pinned ISA.
+# The ic and jr loops are still parallelized and the pinned microkernel is used
+# so the cost is a kc that may not fit the caches and no split-K for small M*N.
+
+const GEMM_DETERMINISTIC_KC*{.intdefine.} = 256
+  ## Default kc of the deterministic mode,
+  ## 256 float32 or float64 fit half a 4KB page or 1KB to 2KB of L1 per column of ~B.
+
+type
+  GemmDeterministic* = object
+    enabled*: bool          ## The fields below are ignored if false
+    simd*: CPUFeatureX86    ## Pinned microkernel ISA
+    kc*: int                ## Pinned depth of the partial products
+
+var LaserGemmDeterministic*: array[GemmTuningType, GemmDeterministic]
+  ## Deterministic mode in use by this process, set by `gemm_set_deterministic`.
+  ## It must not be modified while a GEMM is running.
+
+proc gemm_deterministic*(T: typedesc): GemmDeterministic {.inline.} =
+  ## Returns the deterministic mode of GEMM for T, disabled if there is none
+  when T is float32 or T is float64 or
+       T is int32 or T is uint32 or T is int64 or T is uint64:
+    result = LaserGemmDeterministic[tuning_type(T)]
+
+proc parallel_threshold*(ukernel: static MicroKernel, T: typedesc): int {.inline.} =
+  ## GEMMs are parallelized if M*N*K > pt³
+  let tuning = gemm_tuning(T)
+  if tuning.tuned and tuning.simd == ukernel.cpu_simd and tuning.pt > 0:
+    tuning.pt
+  else:
+    ukernel.pt
+
+# ############################################################
+#
+#              Microkernel ISA runtime dispatch
+#
+# ############################################################
+
+func ukernel_available*(T: typedesc, simd: CPUFeatureX86): bool =
+  ## Returns true if there is a GEMM microkernel for T and `simd`
+  when T is float32:
+    simd in {x86_Generic, x86_SSE, x86_AVX, x86_AVX_FMA, x86_AVX512}
+  elif T is float64:
+    simd in {x86_Generic, x86_SSE2, x86_AVX, x86_AVX_FMA, x86_AVX512}
+  elif T is int32 or T is uint32:
+    simd in {x86_Generic, x86_SSE2, x86_SSE4_1, x86_AVX2, x86_AVX512}
+  elif T is int64:
+    simd in {x86_Generic, x86_SSE2, x86_AVX512}
+  else:
+    simd == x86_Generic
+
+proc gemm_cpu_simd*(T: typedesc): CPUFeatureX86 =
+  ## Returns the ISA of the GEMM microkernel for T:
+  ## the one pinned by the deterministic mode,
+  ## the one of the tuning profile if the CPU supports it
+  ## otherwise the best one detected.
+  let deterministic = gemm_deterministic(T)
+  if deterministic.enabled:
+    return deterministic.simd
+
+  let tuning = gemm_tuning(T)
+  if tuning.tuned and ukernel_available(T, tuning.simd) and
+      cpu_supports(tuning.simd):
+    return tuning.simd
+
+  when defined(i386) or defined(amd64):
+    when T is float32:
+      if cpuinfo_has_x86_avx512f():   return x86_AVX512
+      elif cpuinfo_has_x86_fma3():    return x86_AVX_FMA
+      elif cpuinfo_has_x86_avx():     return x86_AVX
+      elif cpuinfo_has_x86_sse():     return x86_SSE
+    elif T is float64:
+      if cpuinfo_has_x86_avx512f():   return x86_AVX512
+      elif cpuinfo_has_x86_fma3():    return x86_AVX_FMA
+      elif cpuinfo_has_x86_avx():     return x86_AVX
+      elif cpuinfo_has_x86_sse2():    return x86_SSE2
+    elif T is int32 or T is uint32:
+      if cpuinfo_has_x86_avx512f():   return x86_AVX512
+      elif cpuinfo_has_x86_avx2():    return x86_AVX2
+      elif cpuinfo_has_x86_sse4_1():  return x86_SSE4_1
+      elif cpuinfo_has_x86_sse2():    return x86_SSE2
+    elif T is int64:
+      if cpuinfo_has_x86_avx512f():   return x86_AVX512
+      elif cpuinfo_has_x86_sse2():    return x86_SSE2
+  result = x86_Generic
+
+template dispatch_cpu_simd*(T: typedesc, simd: CPUFeatureX86, dispatch: untyped) =
+  ## Expands `dispatch(cpu_features)` for the runtime `simd`,
+  ## `dispatch` must return.
+  case simd
+  of x86_AVX512:
+    when ukernel_available(T, x86_AVX512): dispatch(x86_AVX512)
+    else: discard
+  of x86_AVX_FMA:
+    when ukernel_available(T, x86_AVX_FMA): dispatch(x86_AVX_FMA)
+    else: discard
+  of x86_AVX2:
+    when ukernel_available(T, x86_AVX2): dispatch(x86_AVX2)
+    else: discard
+  of x86_AVX:
+    when ukernel_available(T, x86_AVX): dispatch(x86_AVX)
+    else: discard
+  of x86_SSE4_1:
+    when ukernel_available(T, x86_SSE4_1): dispatch(x86_SSE4_1)
+    else: discard
+  of x86_SSE2:
+    when ukernel_available(T, x86_SSE2): dispatch(x86_SSE2)
+    else: discard
+  of x86_SSE:
+    when ukernel_available(T, x86_SSE): dispatch(x86_SSE)
+    else: discard
+  of x86_Generic:
+    discard
+  dispatch(x86_Generic)
+
+proc cpu_model_name(): string =
+  let package = cpuinfo_get_package(0)
+  if not package.isNil:
+    result = $cast[cstring](package.name[0].unsafeAddr)
+
+proc gemm_profile_path*(): string =
+  ## Path of the tuning profile: $LASER_GEMM_PROFILE
+  ## or <config dir>/laser/gemm_profile.txt
+  result = getEnv("LASER_GEMM_PROFILE")
+  if result.len == 0:
+    result = getConfigDir() / "laser" / "gemm_profile.txt"
+
+proc save_gemm_profile*(path = gemm_profile_path()) =
+  ## Persist the tuned entries of LaserGemmTuning
+  createDir(path.parentDir)
+  var profile = "laser-gemm-profile " & $GemmProfileVersion & "\n"
+  profile &= "cpu " & cpu_model_name() & "\n"
+  for typ, tuning in LaserGemmTuning:
+    if tuning.tuned:
+      profile &= $typ & " " & $tuning.simd & " " &
+        $tuning.mc & " " & $tuning.kc & " " & $tuning.pt & "\n"
+  writeFile(path, profile)
+
+proc load_gemm_profile*(path = gemm_profile_path()): bool =
+  ## Load a tuning profile into LaserGemmTuning.
+  ## Returns false and leaves the tuning unchanged if the file
+  ## does not exist, is malformed, has another version or another CPU model.
+  if not fileExists(path):
+    return false
+  var tunings = LaserGemmTuning
+  try:
+    let lines = readFile(path).strip.splitLines
+    if lines.len < 2 or
+        lines[0] != "laser-gemm-profile " & $GemmProfileVersion or
+        lines[1] != "cpu " & cpu_model_name():
+      return false
+    for i in 2 ..< lines.len:
+      let fields = lines[i].splitWhitespace
+      if fields.len != 5:
+        return false
+      let simd = parseEnum[CPUFeatureX86](fields[1])
+      if not cpu_supports(simd):
+        return false
+      tunings[parseEnum[GemmTuningType](fields[0])] = GemmTuning(
+        tuned: true, simd: simd,
+        mc: parseInt(fields[2]), kc: parseInt(fields[3]), pt: parseInt(fields[4])
+      )
+  except ValueError, IOError:
+    return false
+  LaserGemmTuning = tunings
+  result = true
+
+when not defined(GEMM_NO_PROFILE):
+  discard load_gemm_profile()
+
+proc partitionMNK*(
       ukernel: static MicroKernel,
       T: typedesc,
       M, N, K: Natural,
     ): tuple[mc, nc, kc: int] =
-  
-  result.nc = N # We don't partition over N
+  ## Returns the blocking for the GEMM loops:
+  ##   - kc*nr micropanel of B in L1
+  ##   - mc*kc block of A in L2
+  ##   - kc*nc panel of B in L3
+  ## derived from the cache sizes and associativity detected at runtime.
+  const
+    MR = ukernel.mr
+    NR = ukernel.nr
 
   # ## Panel sizes
   # - TLB constraint
@@ -304,38 +673,171 @@ func partitionMNK*(
   #     by the TLB and (2) the L2 cache
   #     In practice mc is chosen so that A occupies about half the smaller of (1) and (2)
 
-
-  # TODO: heuristics to compute the size
-  result.mc = min( 768 div T.sizeof, M)
-  result.kc = min(2048 div T.sizeof, K)
-
-proc newTiles*(
+  let caches = LaserCacheHierarchy
+
+  template l3_nc(kc: int): int =
+    # nc: the panel of B [kc, nc] is shared by all cores and should occupy
+    #     at most half of the L3 so that the blocks of Ã and C are not evicted.
+    if caches.l3_size > 0:
+      let nc = caches.l3_size div 2 div (kc * T.sizeof)
+      max(NR, nc - nc mod NR)
+    else:
+      N
+
+  # In deterministic mode kc is pinned, mc and nc are derived from it
+  let deterministic = gemm_deterministic(T)
+  let pinned_kc = deterministic.enabled and deterministic.simd == ukernel.cpu_simd
+
+  let tuning = gemm_tuning(T)
+  if tuning.tuned and tuning.simd == ukernel.cpu_simd and
+      tuning.mc > 0 and tuning.kc > 0:
+    # Blocking measured by gemm_autotune
+    let kc = if pinned_kc: deterministic.kc else: tuning.kc
+    result.mc = min(max(MR, tuning.mc - tuning.mc mod MR), M)
+    result.nc = min(l3_nc(kc), N)
+    result.kc = min(kc, K)
+    return
+
+  if caches.l1d_size == 0 or caches.l1d_ways == 0 or
+      caches.l2_size == 0 or caches.l2_ways == 0:
+    # Cache detection failed, use defaults suitable for 32KB L1 and 256KB L2
+    result.mc = min( 768 div T.sizeof, M)
+    result.kc = min((if pinned_kc: deterministic.kc else: 2048 div T.sizeof), K)
+    result.nc = N
+    return
+
+  # Set-associative caches, see [3] section 4:
+  # we count in "ways" so that the micropanels do not evict each other
+  # from the same cache sets.
+
+  # kc: the micropanel of B [kc, nr] is reused by each mr rows of Ã
+  #     and gets floor((W_L1 - 1) / (1 + MR/NR)) ways of L1.
+  #     The remaining way is for C and the streaming Ã micropanel.
+  let
+    l1_way_size = caches.l1d_size div caches.l1d_ways
+    b_ways = max(1, (caches.l1d_ways - 1) * NR div (NR + MR))
+  var kc = b_ways * l1_way_size div (NR * T.sizeof)
+  kc = max(kc, 16)
+  if pinned_kc:
+    kc = deterministic.kc
+
+  # mc: the block of Ã [mc, kc] gets the L2 ways left after
+  #     the micropanel of B and one way for C.
+  let
+    l2_way_size = caches.l2_size div caches.l2_ways
+    b_ways_l2 = get_num_tiles(kc * NR * T.sizeof, l2_way_size)
+    a_ways = max(1, caches.l2_ways - 1 - b_ways_l2)
+  var mc = a_ways * l2_way_size div (kc * T.sizeof)
+  mc = max(MR, mc - mc mod MR)
+
+  result.mc = min(mc, M)
+  result.nc = min(l3_nc(kc), N)
+  result.kc = min(kc, K)
+
+proc partitionTiles(
         ukernel: static MicroKernel,
         T: typedesc,
         M, N, K: Natural,
-        ): Tiles[T] =
+        ): tuple[tiles: Tiles[T], bufA_size, bufB_size: int] =
   # BLIS paper [2] section II Figure 2:
   #   - kc * nr in L1 cache µkernel
   #   - mc * kc in L2 cache Ã
   #   - kc * nc in L3 cache ~B (no L3 in Xeon Phi ¯\_(ツ)_/¯)
-  new result, deallocTiles[T]
   const
     nr = ukernel.nr
     mr = ukernel.mr
 
-  (result.mc, result.nc, result.kc) = ukernel.partitionMNK(T, M, N, K)
+  template tiles: untyped = result.tiles
+
+  (tiles.mc, tiles.nc, tiles.kc) = ukernel.partitionMNK(T, M, N, K)
 
   # Parallel config
   # Ic loop parallel means that each thread will share a panel B and pack a different A
-  result.ic_num_tasks = get_num_tiles(M, result.mc)
+  tiles.ic_num_tasks = get_num_tiles(M, tiles.mc)
 
   # Packing
   # During packing the max size is unroll_stop*kc+kc*LR, LR = MR or NR
-  result.upanelA_size = result.kc*round_step_up(result.mc, mr)
-  let bufA_size = T.sizeof * result.upanelA_size * result.ic_num_tasks
-  let bufB_size = T.sizeof * result.kc*round_step_up(result.nc, nr)
-
-  result.a_alloc_mem = allocShared(bufA_size + 63)
-  result.b_alloc_mem = allocShared(bufB_size + 63)
-  result.a = assume_aligned align_raw_data(T, result.a_alloc_mem)
-  result.b = assume_aligned align_raw_data(T, result.b_alloc_mem)
+  tiles.upanelA_size = tiles.kc*round_step_up(tiles.mc, mr)
+  result.bufA_size = round_step_up(
+    T.sizeof * tiles.upanelA_size * tiles.ic_num_tasks,
+    LASER_MEM_ALIGN
+  )
+  result.bufB_size = round_step_up(
+    T.sizeof * tiles.kc*round_step_up(tiles.nc, nr),
+    LASER_MEM_ALIGN
+  )
+
+proc tiles_mem_required*(
+        ukernel: static MicroKernel,
+        T: typedesc,
+        M, N, K: Natural,
+        double_buffer_B = false
+        ): int =
+  ## Returns the size in bytes of the workspace
+  ## holding the packing buffers of A and B.
+  ## With `double_buffer_B` there are two panels of ~B.
+  let partition = ukernel.partitionTiles(T, M, N, K)
+  result = partition.bufA_size + partition.bufB_size
+  if double_buffer_B:
+    result += partition.bufB_size
+
+proc initTiles*(
+        ukernel: static MicroKernel,
+        T: typedesc,
+        M, N, K: Natural,
+        workspace: pointer,
+        double_buffer_B = false
+        ): Tiles[T] =
+  ## Partition a M*N*K GEMM and carve the packing buffers
+  ## from `workspace`. The workspace must be aligned on LASER_MEM_ALIGN
+  ## and hold at least `tiles_mem_required(ukernel, T, M, N, K, double_buffer_B)` bytes.
+  ##
+  ## This does not allocate and can be called from OpenMP threads.
+  let partition = ukernel.partitionTiles(T, M, N, K)
+  result = partition.tiles
+  result.a = assume_aligned cast[ptr UncheckedArray[T]](workspace)
+  result.b = assume_aligned cast[ptr UncheckedArray[T]](
+    cast[ByteAddress](workspace) +% partition.bufA_size
+  )
+  if double_buffer_B:
+    result.b_next = assume_aligned cast[ptr UncheckedArray[T]](
+      cast[ByteAddress](workspace) +% partition.bufA_size +% partition.bufB_size
+    )
+
+# ############################################################
+#
+#                    Thread-cached workspace
+#
+# ############################################################
+
+# Allocating the packing buffers on each GEMM call is costly for medium shapes.
+# Instead each thread keeps a workspace that grows as needed
+# and is only freed on request.
+#
+# With `--threads:off` the workspace is a global shared by all threads
+# and GEMM must not be called concurrently from multiple threads.
+# Compile with `-d:GEMM_NO_CACHED_WORKSPACE` to allocate and free
+# the workspace on each call instead.
+
+var
+  gemm_workspace_mem {.threadvar.}: pointer
+  gemm_workspace_size {.threadvar.}: int
+
+proc gemm_cached_workspace*(size: Natural): pointer =
+  ## Returns a workspace of at least `size` bytes
+  ## aligned on LASER_MEM_ALIGN and private to the calling thread.
+  ## It is invalidated by the next call from the same thread.
+  ##
+  ## Workspaces of at least LASER_HUGE_PAGE_SIZE bytes are backed by
+  ## LaserHugePages at the time they are allocated.
+  if gemm_workspace_size < size:
+    deallocLarge gemm_workspace_mem
+    gemm_workspace_mem = allocLarge(size)
+    gemm_workspace_size = size
+  result = gemm_workspace_mem
+
+proc gemm_release_workspace*() =
+  ## Frees the workspace cached by the calling thread
+  deallocLarge gemm_workspace_mem
+  gemm_workspace_mem = nil
+  gemm_workspace_size = 0
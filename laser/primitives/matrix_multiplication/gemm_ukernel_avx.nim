@@ -25,7 +25,8 @@ ukernel_generator(
       simd_store_unaligned = mm256_storeu_ps,
       simd_mul = mm256_mul_ps,
       simd_add = mm256_add_ps,
-      simd_fma = float32x8_muladd_unfused
+      simd_fma = float32x8_muladd_unfused,
+      simd_max = mm256_max_ps
     )
 
 ukernel_generator(
@@ -40,5 +41,34 @@ ukernel_generator(
       simd_store_unaligned = mm256_storeu_pd,
       simd_mul = mm256_mul_pd,
       simd_add = mm256_add_pd,
-      simd_fma = float64x4_muladd_unfused
+      simd_fma = float64x4_muladd_unfused,
+      simd_max = mm256_max_pd
+    )
+
+gemv_kernels_generator(
+      dot_avx, axpy_avx,
+      float32, nb_scalars = 8,
+      mm256_setzero_ps, mm256_set1_ps, mm256_loadu_ps, mm256_storeu_ps,
+      mm256_add_ps, float32x8_muladd_unfused
+    )
+
+gemv_kernels_generator(
+      dot_avx, axpy_avx,
+      float64, nb_scalars = 4,
+      mm256_setzero_pd, mm256_set1_pd, mm256_loadu_pd, mm256_storeu_pd,
+      mm256_add_pd, float64x4_muladd_unfused
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_avx,
+      float32, m256, nb_scalars = 8,
+      mm256_setzero_ps, mm256_set1_ps, mm256_loadu_ps, mm256_storeu_ps,
+      float32x8_muladd_unfused
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_avx,
+      float64, m256d, nb_scalars = 4,
+      mm256_setzero_pd, mm256_set1_pd, mm256_loadu_pd, mm256_storeu_pd,
+      float64x4_muladd_unfused
     )
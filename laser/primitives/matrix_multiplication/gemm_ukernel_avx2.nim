@@ -31,5 +31,6 @@ ukernel_generator(
       simd_store_unaligned = int32x8_storeu,
       simd_mul = mm256_mullo_epi32,
       simd_add = mm256_add_epi32,
-      simd_fma = int32x8_muladd_unfused_avx2
+      simd_fma = int32x8_muladd_unfused_avx2,
+      simd_max = mm256_max_epi32
     )
@@ -19,7 +19,8 @@ ukernel_generator(
     simd_store_unaligned = mm512_storeu_ps,
     simd_mul = mm512_mul_ps,
     simd_add = mm512_add_ps,
-    simd_fma = mm512_fmadd_ps
+    simd_fma = mm512_fmadd_ps,
+    simd_max = mm512_max_ps
   )
 
 ukernel_generator(
@@ -34,7 +35,8 @@ ukernel_generator(
     simd_store_unaligned = mm512_storeu_pd,
     simd_mul = mm512_mul_pd,
     simd_add = mm512_add_pd,
-    simd_fma = mm512_fmadd_pd
+    simd_fma = mm512_fmadd_pd,
+    simd_max = mm512_max_pd
   )
 
 template int32x16_muladd_unfused_avx512(a, b, c: m512i): m512i =
@@ -52,7 +54,8 @@ ukernel_generator(
     simd_store_unaligned = mm512_storeu_si512,
     simd_mul = mm512_mullo_epi32,
     simd_add = mm512_add_epi32,
-    simd_fma = int32x16_muladd_unfused_avx512
+    simd_fma = int32x16_muladd_unfused_avx512,
+    simd_max = mm512_max_epi32
     )
 
 template int64x8_muladd_unfused_avx512(a, b, c: m512i): m512i =
@@ -70,5 +73,34 @@ ukernel_generator(
     simd_store_unaligned = mm512_storeu_si512,
     simd_mul = mm512_mullo_epi64,
     simd_add = mm512_add_epi64,
-    simd_fma = int64x8_muladd_unfused_avx512
-    )
\ No newline at end of file
+    simd_fma = int64x8_muladd_unfused_avx512,
+    simd_max = mm512_max_epi64
+    )
+
+gemv_kernels_generator(
+    dot_avx512, axpy_avx512,
+    float32, nb_scalars = 16,
+    mm512_setzero_ps, mm512_set1_ps, mm512_loadu_ps, mm512_storeu_ps,
+    mm512_add_ps, mm512_fmadd_ps
+  )
+
+gemv_kernels_generator(
+    dot_avx512, axpy_avx512,
+    float64, nb_scalars = 8,
+    mm512_setzero_pd, mm512_set1_pd, mm512_loadu_pd, mm512_storeu_pd,
+    mm512_add_pd, mm512_fmadd_pd
+  )
+
+gemm_small_kernel_generator(
+    gemm_small_avx512,
+    float32, m512, nb_scalars = 16,
+    mm512_setzero_ps, mm512_set1_ps, mm512_loadu_ps, mm512_storeu_ps,
+    mm512_fmadd_ps
+  )
+
+gemm_small_kernel_generator(
+    gemm_small_avx512,
+    float64, m512d, nb_scalars = 8,
+    mm512_setzero_pd, mm512_set1_pd, mm512_loadu_pd, mm512_storeu_pd,
+    mm512_fmadd_pd
+  )
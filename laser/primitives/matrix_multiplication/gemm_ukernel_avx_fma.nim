@@ -19,7 +19,8 @@ ukernel_generator(
       simd_store_unaligned = mm256_storeu_ps,
       simd_mul = mm256_mul_ps,
       simd_add = mm256_add_ps,
-      simd_fma = mm256_fmadd_ps
+      simd_fma = mm256_fmadd_ps,
+      simd_max = mm256_max_ps
     )
 
 ukernel_generator(
@@ -35,4 +36,33 @@ ukernel_generator(
       simd_mul = mm256_mul_pd,
       simd_add = mm256_add_pd,
       simd_fma = mm256_fmadd_pd,
+      simd_max = mm256_max_pd,
+    )
+
+gemv_kernels_generator(
+      dot_avx_fma, axpy_avx_fma,
+      float32, nb_scalars = 8,
+      mm256_setzero_ps, mm256_set1_ps, mm256_loadu_ps, mm256_storeu_ps,
+      mm256_add_ps, mm256_fmadd_ps
+    )
+
+gemv_kernels_generator(
+      dot_avx_fma, axpy_avx_fma,
+      float64, nb_scalars = 4,
+      mm256_setzero_pd, mm256_set1_pd, mm256_loadu_pd, mm256_storeu_pd,
+      mm256_add_pd, mm256_fmadd_pd
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_avx_fma,
+      float32, m256, nb_scalars = 8,
+      mm256_setzero_ps, mm256_set1_ps, mm256_loadu_ps, mm256_storeu_ps,
+      mm256_fmadd_ps
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_avx_fma,
+      float64, m256d, nb_scalars = 4,
+      mm256_setzero_pd, mm256_set1_pd, mm256_loadu_pd, mm256_storeu_pd,
+      mm256_fmadd_pd
     )
@@ -47,7 +47,8 @@ macro dispatch_general(
     ukernel: static MicroKernel,
     kc: int,
     alpha: typed, packedA, packedB: ptr UncheckedArray[typed],
-    beta: typed, vC: MatrixView[typed]
+    beta: typed, vC: MatrixView[typed],
+    epilogue: typed
   ): untyped =
 
   dispatch_common()
@@ -58,7 +59,8 @@ macro dispatch_general(
       gebb_ukernel_fallback[`symT`, ukernel]( # Hack: ukernel is generic from the calling proc
               `kc`,
         `alpha`, `packedA`, `packedB`,
-        `beta`, `vC`
+        `beta`, `vC`,
+        `epilogue`
       )
     return
 
@@ -69,16 +71,18 @@ macro dispatch_general(
     `ukernel_name`[ukernel]( # Hack: ukernel is generic from the calling proc
       `kc`,
       `alpha`, `packedA`, `packedB`,
-      `beta`, `vC`
+      `beta`, `vC`,
+      `epilogue`
     )
 
 proc gebb_ukernel*[T; ukernel: static MicroKernel](
       kc: int,
       alpha: T, packedA, packedB: ptr UncheckedArray[T],
-      beta: T, vC: MatrixView[T]
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
     ){.inline.} =
 
-  ukernel.dispatch_general(kc, alpha, packedA, packedB, beta, vC)
+  ukernel.dispatch_general(kc, alpha, packedA, packedB, beta, vC, epilogue)
 
 
 # ############################################################
@@ -91,7 +95,8 @@ macro dispatch_edge(
     ukernel: static MicroKernel,
     mr, nr, kc: int,
     alpha: typed, packedA, packedB: ptr UncheckedArray[typed],
-    beta: typed, vC: MatrixView[typed]
+    beta: typed, vC: MatrixView[typed],
+    epilogue: typed
   ): untyped =
 
   dispatch_common()
@@ -102,7 +107,8 @@ macro dispatch_edge(
       gebb_ukernel_edge_fallback[`symT`, ukernel]( # Hack: ukernel is generic from the calling proc
         `mr`, `nr`, `kc`,
         `alpha`, `packedA`, `packedB`,
-        `beta`, `vC`
+        `beta`, `vC`,
+        `epilogue`
       )
     return
 
@@ -113,13 +119,15 @@ macro dispatch_edge(
     `ukernel_name`[ukernel]( # Hack: ukernel is generic from the calling proc
       `mr`, `nr`, `kc`,
       `alpha`, `packedA`, `packedB`,
-      `beta`, `vC`
+      `beta`, `vC`,
+      `epilogue`
     )
 
 proc gebb_ukernel_edge*[T; ukernel: static MicroKernel](
       mr, nr, kc: int,
       alpha: T, packedA, packedB: ptr UncheckedArray[T],
-      beta: T, vC: MatrixView[T]
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
     ){.inline.} =
 
-  ukernel.dispatch_edge(mr, nr, kc, alpha, packedA, packedB, beta, vC)
+  ukernel.dispatch_edge(mr, nr, kc, alpha, packedA, packedB, beta, vC, epilogue)
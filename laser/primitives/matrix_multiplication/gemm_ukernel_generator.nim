@@ -6,6 +6,7 @@
 import
   ../../compiler_optim_hints,
   ../../simd,
+  ../../private/align_unroller,
   ./gemm_tiling, ./gemm_utils,
   ./gemm_ukernel_generic,
   macros
@@ -23,12 +24,15 @@ import
 # #############################################################
 
 template ukernel_simd_proc(ukernel_name, epilogue_name: NimNode, edge: bool) {.dirty.} =
+  # Interpolated so that it is not bound to the `epilogue` template below
+  let fused = newIdentNode("epilogue")
   if edge:
     result.add quote do:
       proc `ukernel_name`*[ukernel: static MicroKernel](
             mr, nr, kc: int,
             alpha: `T`, packedA, packedB: ptr UncheckedArray[`T`],
-            beta: `T`, vC: MatrixView[`T`]
+            beta: `T`, vC: MatrixView[`T`],
+            `fused`: Epilogue[`T`]
           ) =
 
         let AB{.align_variable.} = ukernel_simd_impl(
@@ -42,14 +46,16 @@ template ukernel_simd_proc(ukernel_name, epilogue_name: NimNode, edge: bool) {.d
 
         gebb_ukernel_edge_epilogue(
                 alpha, to_ptr(AB, MR, NR, `T`),
-                beta, vC, mr, nr
+                beta, vC, mr, nr,
+                `fused`
               )
   else:
     result.add quote do:
       proc `ukernel_name`*[ukernel: static MicroKernel](
             kc: int,
             alpha: `T`, packedA, packedB: ptr UncheckedArray[`T`],
-            beta: `T`, vC: MatrixView[`T`]
+            beta: `T`, vC: MatrixView[`T`],
+            `fused`: Epilogue[`T`]
           ) =
         let AB{.align_variable.} = ukernel_simd_impl(
           ukernel, `V`, packedA, packedB, kc,
@@ -60,43 +66,59 @@ template ukernel_simd_proc(ukernel_name, epilogue_name: NimNode, edge: bool) {.d
           MR = ukernel.extract_mr()
           NR = ukernel.extract_nr()
 
-        # when is_c_unit_stride:
-        #   `epilogue_name`(alpha, AB, beta, vC)
-        # else:
+        # Bias and activation are fused here on the last pc iteration
+        when is_c_unit_stride:
+          if not `fused`.isNoOp and `fused`.isSimd:
+            `epilogue_name`(alpha, AB, beta, vC, `fused`)
+            return
         gebb_ukernel_epilogue_fallback(
           alpha, to_ptr(AB, MR, NR, `T`),
-          beta, vC)
+          beta, vC, `fused`)
 
 # #############################################################
 
 template epilogue() {.dirty.} =
+  # Interpolated so that it is not bound to the `epilogue` template
+  let fused = newIdentNode("epilogue")
   result.add quote do:
     proc `epilogue_name`[MR, NbVecs: static int](
             alpha: `T`, AB: array[MR, array[NbVecs, `V`]],
-            beta: `T`, vC: MatrixView[`T`]
-          ) =
+            beta: `T`, vC: MatrixView[`T`],
+            `fused`: Epilogue[`T`]
+          ) {.inline.} =
+      ## C = activation(αAB + βC + bias) on the registers of the tile,
+      ## each vector of a unit-stride C is written once.
+      ## C is not read if β = 0.
+      ## Only for the epilogues that pass `isSimd`.
       template C(i,j: int): untyped {.dirty.} =
         vC.buffer[i*vC.rowStride + j*`nb_scalars`]
 
-      if beta == 0.`T`:
-        for i in 0 ..< MR:
-          for j in 0 ..< NbVecs:
-            `simd_store_unaligned`(C(i,j).addr, `simd_setZero`())
-      elif beta != 1.`T`:
-        let beta_vec = `simd_broadcast_value`(beta)
-        for i in 0 ..< MR:
-          for j in 0 ..< NbVecs:
-            `simd_store_unaligned`(C(i,j).addr, `simd_mul`(beta_vec, C(i,j).addr.`simd_load_unaligned`))
-
-      if alpha == 1.`T`:
-        for i in 0 ..< MR:
-          for j in 0 ..< NbVecs:
-            `simd_store_unaligned`(C(i,j).addr, `simd_add`(AB[i][j], C(i,j).addr.`simd_load_unaligned`))
-      else:
-        let alpha_vec = `simd_broadcast_value`(alpha)
-        for i in 0 ..< MR:
-          for j in 0 ..< NbVecs:
-            `simd_store_unaligned`(C(i,j).addr, `simd_fma`(alpha_vec, AB[i][j], C(i,j).addr.`simd_load_unaligned`))
+      let
+        alpha_vec = `simd_broadcast_value`(alpha)
+        beta_vec = `simd_broadcast_value`(beta)
+        zero = `simd_setZero`()
+        has_bias = not `fused`.bias.buffer.isNil
+        row_bias = has_bias and `fused`.bias.colStride == 0
+        relu = `fused`.activation == actRelu
+
+      for i in 0 ..< MR:
+        # A per-row bias is broadcast, a per-column bias is loaded
+        var bias_i = zero
+        if row_bias:
+          bias_i = `simd_broadcast_value`(`fused`.bias[i, 0])
+        for j in 0 ..< NbVecs:
+          var x = `simd_mul`(alpha_vec, AB[i][j])
+          if beta != 0.`T`:
+            x = `simd_fma`(beta_vec, C(i,j).addr.`simd_load_unaligned`, x)
+          if row_bias:
+            x = `simd_add`(x, bias_i)
+          elif has_bias:
+            x = `simd_add`(x, `fused`.bias[i, j*`nb_scalars`].addr.`simd_load_unaligned`)
+          if relu:
+            # maxps/maxpd return their second operand if either is NaN:
+            # x is second so that NaN propagates, like the scalar ReLU
+            x = `simd_max`(zero, x)
+          `simd_store_unaligned`(C(i,j).addr, x)
 
 # #############################################################
 
@@ -113,6 +135,7 @@ macro ukernel_generator*(
       simd_mul: untyped,
       simd_add: untyped,
       simd_fma: untyped,
+      simd_max: untyped,
     ): untyped =
 
   let T = newIdentNode($typ)
@@ -248,3 +271,107 @@ macro ukernel_simd_impl*(
         `bcast_fma`
       ## Write registers to a MR/NR array
       `rAB`
+
+# ############################################################
+#
+#             GEMV kernels generator
+#
+# ############################################################
+
+# The matrix-vector kernels of gemm_gemv are generated
+# in the same files as the microkernels to reuse their compilation flags.
+
+template gemv_kernels_generator*(
+      dot_name, axpy_name: untyped,
+      T: typedesc, nb_scalars: static int,
+      simd_setZero, simd_broadcast_value,
+      simd_load_unaligned, simd_store_unaligned,
+      simd_add, simd_fma: untyped
+    ) =
+
+  proc dot_name*(x, y: ptr UncheckedArray[T], len: int): T =
+    ## Σ x[i] * y[i] with 4 SIMD accumulators
+    const step = 4 * nb_scalars
+    var
+      acc0 = simd_setZero()
+      acc1 = simd_setZero()
+      acc2 = simd_setZero()
+      acc3 = simd_setZero()
+    let unroll_stop = round_step_down(len, step)
+    for i in countup(0, unroll_stop - 1, step):
+      acc0 = simd_fma(x[i                ].addr.simd_load_unaligned, y[i                ].addr.simd_load_unaligned, acc0)
+      acc1 = simd_fma(x[i +   nb_scalars].addr.simd_load_unaligned, y[i +   nb_scalars].addr.simd_load_unaligned, acc1)
+      acc2 = simd_fma(x[i + 2*nb_scalars].addr.simd_load_unaligned, y[i + 2*nb_scalars].addr.simd_load_unaligned, acc2)
+      acc3 = simd_fma(x[i + 3*nb_scalars].addr.simd_load_unaligned, y[i + 3*nb_scalars].addr.simd_load_unaligned, acc3)
+    acc0 = simd_add(simd_add(acc0, acc1), simd_add(acc2, acc3))
+
+    var tmp: array[nb_scalars, T]
+    simd_store_unaligned(tmp[0].addr, acc0)
+    for s in tmp:
+      result += s
+    for i in unroll_stop ..< len:
+      result += x[i] * y[i]
+
+  proc axpy_name*(y: ptr UncheckedArray[T], a: T, x: ptr UncheckedArray[T], len: int) =
+    ## y += a * x
+    const step = 2 * nb_scalars
+    let va = simd_broadcast_value(a)
+    let unroll_stop = round_step_down(len, step)
+    for i in countup(0, unroll_stop - 1, step):
+      simd_store_unaligned(y[i].addr, simd_fma(
+        va, x[i].addr.simd_load_unaligned, y[i].addr.simd_load_unaligned
+      ))
+      simd_store_unaligned(y[i + nb_scalars].addr, simd_fma(
+        va, x[i + nb_scalars].addr.simd_load_unaligned, y[i + nb_scalars].addr.simd_load_unaligned
+      ))
+    for i in unroll_stop ..< len:
+      y[i] += a * x[i]
+
+# ############################################################
+#
+#             Small matrix kernels generator
+#
+# ############################################################
+
+# The unpacked kernels of gemm_small are generated
+# in the same files as the microkernels to reuse their compilation flags.
+
+template gemm_small_kernel_generator*(
+      name: untyped,
+      T, V: typedesc, nb_scalars: static int,
+      simd_setZero, simd_broadcast_value,
+      simd_load_unaligned, simd_store_unaligned,
+      simd_fma: untyped
+    ) =
+
+  proc name*[MR, NbVecs: static int](
+        K: int,
+        alpha: T, vA, vB: MatrixView[T],
+        beta: T, vC: MatrixView[T],
+        epilogue: Epilogue[T]
+      ) =
+    ## Compute a full [MR, NbVecs * nb_scalars] tile
+    ## of C = activation(αA*B + βC + bias) from the unpacked A and B.
+    ## B must have a unit column stride.
+    ## The MR*NbVecs accumulators stay in SIMD registers.
+    const NR = NbVecs * nb_scalars
+    var acc: array[MR, array[NbVecs, V]]
+    for i in 0 ..< MR:
+      for v in 0 ..< NbVecs:
+        acc[i][v] = simd_setZero()
+
+    for k in 0 ..< K:
+      var b: array[NbVecs, V]
+      for v in 0 ..< NbVecs:
+        b[v] = simd_load_unaligned(vB.buffer[k*vB.rowStride + v*nb_scalars].addr)
+      for i in 0 ..< MR:
+        let a = simd_broadcast_value(vA[i, k])
+        for v in 0 ..< NbVecs:
+          acc[i][v] = simd_fma(a, b[v], acc[i][v])
+
+    var AB{.align_variable.}: array[MR, array[NR, T]]
+    for i in 0 ..< MR:
+      for v in 0 ..< NbVecs:
+        simd_store_unaligned(AB[i][v*nb_scalars].addr, acc[i][v])
+
+    gebb_ukernel_epilogue_fallback(alpha, AB.addr, beta, vC, epilogue)
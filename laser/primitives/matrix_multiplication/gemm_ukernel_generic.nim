@@ -8,7 +8,7 @@
 import
   ../../cpuinfo, ../../compiler_optim_hints,
   ./gemm_tiling, ./gemm_utils,
-  macros
+  macros, math
 
 withCompilerOptimHints()
 
@@ -34,6 +34,77 @@ template ukernel_generic_impl*(){.dirty.} =
       for j in `||`(0, NR-1, "simd"):
         AB[i][j] += A[k*MR+i] * B[k*NR+j]
 
+# ############################################################
+#
+#          Fused operations: bias and activation
+#
+# ############################################################
+
+func activate[T](x: T, act: static Activation): T {.inline.} =
+  when act == actRelu:
+    # NaN is propagated like maxps(0, x) in the SIMD epilogue
+    if x < 0.T: 0.T else: x
+  elif act in {actTanh, actSigmoid} and T isnot SomeFloat:
+    x # Rejected by gemm_strided
+  elif act == actTanh:
+    tanh(x)
+  elif act == actSigmoid:
+    1.T / (1.T + exp(-x))
+  else:
+    x
+
+template dispatch_activation(activation: Activation, act, body: untyped) =
+  ## Expands `body` with `act` the static activation
+  ## so that `activate` is resolved outside of the loops
+  case activation
+  of actNone:
+    const act = actNone
+    body
+  of actRelu:
+    const act = actRelu
+    body
+  of actTanh:
+    const act = actTanh
+    body
+  of actSigmoid:
+    const act = actSigmoid
+    body
+
+func gebb_ukernel_fused_epilogue*[T](
+      vC: MatrixView[T], mr, nr: int,
+      epilogue: Epilogue[T]
+    ){.inline.} =
+  ## Apply C = activation(C + bias) on the [mr, nr] tile of C
+  ## that was already written.
+  ## This must only be called on the last pc iteration
+  ## once C holds the full αAB + βC result.
+  ##
+  ## The microkernels fuse the epilogue before storing the tile,
+  ## this is for the callers that produce C otherwise (split-K reduction, JIT).
+  let has_bias = not epilogue.bias.buffer.isNil
+  dispatch_activation(epilogue.activation, act):
+    for i in 0 ..< mr:
+      for j in 0 ..< nr:
+        var x = vC[i, j]
+        if has_bias:
+          x += epilogue.bias[i, j]
+        vC[i, j] = x.activate(act)
+
+template fused_epilogue_store(mr, nr: int) {.dirty.} =
+  ## C = activation(αAB + βC + bias) in a single pass,
+  ## each element of C is written once.
+  ## C is not read if β = 0.
+  let has_bias = not epilogue.bias.buffer.isNil
+  dispatch_activation(epilogue.activation, act):
+    for i in 0 ..< mr:
+      for j in 0 ..< nr:
+        var x = alpha * pAB[i][j]
+        if beta != 0.T:
+          x += beta * vC[i, j]
+        if has_bias:
+          x += epilogue.bias[i, j]
+        vC[i, j] = x.activate(act)
+
 # ############################################################
 #
 #          Fallback Generic version
@@ -46,17 +117,20 @@ template ukernel_generic_impl*(){.dirty.} =
 # 3. C  = αAB, if β = 0 and α = 1
 # 4. C +=  AB, if α = 1
 # 5. C += αAB, if α = 1
-#
-# TODO: Fused operations like relu/sigmoid/tanh
-#       should be done here as well
+# 6. C = activation(αAB + βC + bias) in a single pass if an epilogue is fused
 
 proc gebb_ukernel_epilogue_fallback*[MR, NR: static int, T](
       alpha: T, AB: ptr array[MR, array[NR, T]],
-      beta: T,  vC: MatrixView[T]
+      beta: T,  vC: MatrixView[T],
+      epilogue: Epilogue[T]
     ){.inline.} =
 
   let pAB{.restrict.} = assume_aligned cast[ptr array[MR, array[NR, T]]](AB[0][0].unsafeAddr)
 
+  if not epilogue.isNoOp:
+    fused_epilogue_store(MR, NR)
+    return
+
   if beta == 0.T:
     for i in 0 ..< MR:
       for j in 0 ..< NR:
@@ -75,18 +149,16 @@ proc gebb_ukernel_epilogue_fallback*[MR, NR: static int, T](
       for j in 0 ..< NR:
         vC[i, j] += alpha * pAB[i][j]
 
-  # TODO: Fused operations like relu/sigmoid/tanh
-  #       should be done here as well
-
 proc gebb_ukernel_fallback*[T; ukernel: static MicroKernel](
       kc: int,
       alpha: T, packedA, packedB: ptr UncheckedArray[T],
-      beta: T, vC: MatrixView[T]
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
     ) =
   ukernel_generic_impl()
 
   const is_c_unit_stride = ukernel.extract_c_unit_stride
-  gebb_ukernel_epilogue_fallback(alpha, to_ptr(AB, MR, NR, T), beta, vC)
+  gebb_ukernel_epilogue_fallback(alpha, to_ptr(AB, MR, NR, T), beta, vC, epilogue)
 
 # ############################################################
 #
@@ -97,11 +169,16 @@ proc gebb_ukernel_fallback*[T; ukernel: static MicroKernel](
 func gebb_ukernel_edge_epilogue*[MR, NR: static int, T](
       alpha: T, AB: ptr array[MR, array[NR, T]],
       beta: T,  vC: MatrixView[T],
-      mr, nr: int # Tail to process
+      mr, nr: int, # Tail to process
+      epilogue: Epilogue[T]
     ){.inline.} =
 
   let pAB{.restrict.} = assume_aligned cast[ptr array[MR, array[NR, T]]](AB[0][0].unsafeAddr)
 
+  if not epilogue.isNoOp:
+    fused_epilogue_store(mr, nr)
+    return
+
   if beta == 0.T:
     if alpha == 1.T:                   # C = AB
       for i in 0 ..< mr:
@@ -125,13 +202,11 @@ func gebb_ukernel_edge_epilogue*[MR, NR: static int, T](
         for j in 0 ..< nr:
           vC[i, j] += alpha * pAB[i][j]
 
-  # TODO: Fused operations like relu/sigmoid/tanh
-  #       should be done here as well
-
 proc gebb_ukernel_edge_fallback*[T; ukernel: static MicroKernel](
       mr, nr, kc: int,
       alpha: T, packedA, packedB: ptr UncheckedArray[T],
-      beta: T, vC: MatrixView[T]
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
     ) =
   ukernel_generic_impl()
-  gebb_ukernel_edge_epilogue(alpha, to_ptr(AB, MR, NR, T), beta, vC, mr, nr)
+  gebb_ukernel_edge_epilogue(alpha, to_ptr(AB, MR, NR, T), beta, vC, mr, nr, epilogue)
@@ -0,0 +1,314 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  tables,
+  ../../photon_jit,
+  ./gemm_tiling, ./gemm_utils
+
+# ############################################################
+#
+#           JIT-generated microkernels for edge tiles
+#
+# ############################################################
+
+# The compile-time microkernels compute full MR*NR tiles.
+# On the edges of C (M mod MR rows, N mod NR columns) gebb_ukernel_edge
+# still computes the full tile, stores it in a temporary
+# and copies the mr*nr part with scalar code.
+#
+# With `-d:GEMM_JIT`, kernels specialized for the exact edge shape
+# are generated at runtime with photon_jit, like libxsmm does:
+#   - only the mr rows and ceil(nr / lanes) vectors of the tile are computed,
+#   - the k loop is unrolled,
+#   - C is loaded and stored directly, the column tail with masked moves,
+#   - α = 1 and β = 0 or β = 1 are specialized.
+# Tiles with a fused epilogue use gebb_ukernel_edge.
+# Kernels are cached per thread by shape.
+#
+# They are available for the float32 and float64 AVX+FMA microkernels
+# with a unit column stride C, on x86-64 with the System V calling convention.
+#
+# Kernels are generated by the thread calling GEMM before the parallel region
+# as allocation is not allowed in OpenMP threads.
+
+const JitKcUnroll = 4
+  ## Unrolling of the k loop of generated kernels
+
+type
+  JitBeta = enum
+    jbZero     # C = αAB
+    jbOne      # C = αAB + C
+    jbGeneral  # C = αAB + βC
+
+  JitUKernelKey = object
+    double: bool            # float64 or float32
+    MR, NR: int             # Packed micropanels
+    mr, nr: int             # Edge tile computed
+    unroll: int
+    alpha_one: bool
+    beta: JitBeta
+
+  JitUKernelArgs[T] = object
+    ## Arguments of generated kernels, passed by pointer in rdi
+    mask: array[32, byte]   # Lane mask of the column tail
+    kc_main: int            # kc div unroll
+    kc_rem: int             # kc mod unroll
+    packedA: pointer
+    packedB: pointer
+    C: pointer
+    c_row_stride: int       # in bytes
+    alpha: T
+    beta: T
+
+  JitUKernelProc[T] = proc(args: ptr JitUKernelArgs[T]) {.nimcall.}
+
+  JitEdgeKernels*[T] = object
+    ## Kernels for the edge tiles of a GEMM.
+    ## Empty if JIT is not available for the microkernel.
+    MR, NR: int
+    mr_tail, nr_tail: int
+    alpha: T
+    fns: array[JitBeta, array[2, array[2, JitUKernelProc[T]]]]
+      # [β][mr != MR][nr != NR], nil for the full tile
+    mask: array[32, byte]
+
+# Offsets in JitUKernelArgs
+const
+  ArgMask = 0
+  ArgKcMain = 32
+  ArgKcRem = 40
+  ArgPackedA = 48
+  ArgPackedB = 56
+  ArgC = 64
+  ArgCRowStride = 72
+  ArgAlpha = 80
+  # ArgBeta = ArgAlpha + sizeof(T)
+
+# ############################################################
+#
+#                    Code generation
+#
+# ############################################################
+
+when defined(amd64) and not defined(windows):
+  proc gen_ukernel(key: JitUKernelKey): JitFunction =
+    ## Generate C[0:mr, 0:nr] = α Ã[0:mr, 0:kc] * ~B[0:kc, 0:nr] + βC
+    ## Ã and ~B are micropanels of MR rows and NR columns.
+    let
+      sz = if key.double: 8 else: 4
+      lanes = 32 div sz
+      nb_vecs = get_num_tiles(key.nr, lanes)
+      tail = key.nr mod lanes
+      ArgBeta = ArgAlpha + sz
+
+    # Registers: accumulators, then the ~B vectors and the broadcasted Ã.
+    # In the epilogue those are reused for α or β, C and the tail mask.
+    let nb_acc = key.mr * nb_vecs
+    doAssert nb_acc + max(nb_vecs + 1, 3) <= 16, "Not enough YMM registers for this tile"
+    template acc(i, v: int): RegYMM = RegYMM(i * nb_vecs + v)
+    template b(v: int): RegYMM = RegYMM(nb_acc + v)
+    let
+      a_reg = RegYMM(nb_acc + nb_vecs)
+      scalar_reg = RegYMM(nb_acc)       # α or β
+      c_reg = RegYMM(nb_acc + 1)
+      mask_reg = RegYMM(nb_acc + 2)
+
+    template vmov(a: var Assembler[X86_64], dst, src: untyped) =
+      if key.double: a.vmovupd(dst, src)
+      else: a.vmovups(dst, src)
+    template vmaskmov(a: var Assembler[X86_64], dst, mask, src: untyped) =
+      if key.double: a.vmaskmovpd(dst, mask, src)
+      else: a.vmaskmovps(dst, mask, src)
+    template vbroadcast(a: var Assembler[X86_64], dst: RegYMM, src: Address) =
+      if key.double: a.vbroadcastsd(dst, src)
+      else: a.vbroadcastss(dst, src)
+    template vfmadd231(a: var Assembler[X86_64], dst, src1, src2: RegYMM) =
+      if key.double: a.vfmadd231pd(dst, src1, src2)
+      else: a.vfmadd231ps(dst, src1, src2)
+    template vmul(a: var Assembler[X86_64], dst, src1, src2: RegYMM) =
+      if key.double: a.vmulpd(dst, src1, src2)
+      else: a.vmulps(dst, src1, src2)
+    template vadd(a: var Assembler[X86_64], dst, src1, src2: RegYMM) =
+      if key.double: a.vaddpd(dst, src1, src2)
+      else: a.vaddps(dst, src1, src2)
+
+    template kstep(a: var Assembler[X86_64], u: int) =
+      # acc[i][v] += Ã[u, i] * ~B[u, v*lanes:(v+1)*lanes]
+      for v in 0 ..< nb_vecs:
+        a.vmov(b(v), mem(rdx, (u * key.NR + v * lanes) * sz))
+      for i in 0 ..< key.mr:
+        a.vbroadcast(a_reg, mem(rsi, (u * key.MR + i) * sz))
+        for v in 0 ..< nb_vecs:
+          a.vfmadd231(acc(i, v), a_reg, b(v))
+
+    result = gen_x86_64(assembler = a, clean_registers = false):
+      # All registers used are caller-saved in the System V ABI
+      for i in 0 ..< key.mr:
+        for v in 0 ..< nb_vecs:
+          a.vxorps(acc(i, v), acc(i, v), acc(i, v))
+
+      a.mov(rsi, mem(rdi, ArgPackedA))
+      a.mov(rdx, mem(rdi, ArgPackedB))
+
+      # Unrolled k loop
+      let main_loop = initLabel()
+      let main_end = initLabel()
+      a.mov(rcx, mem(rdi, ArgKcMain))
+      a.test(rcx, rcx)
+      a.jz(main_end)
+      a.label(main_loop)
+      for u in 0 ..< key.unroll:
+        a.kstep(u)
+      a.add(rsi, int32(key.unroll * key.MR * sz))
+      a.add(rdx, int32(key.unroll * key.NR * sz))
+      a.dec(rcx)
+      a.jnz(main_loop)
+      a.label(main_end)
+
+      # Remainder
+      let rem_loop = initLabel()
+      let rem_end = initLabel()
+      a.mov(rcx, mem(rdi, ArgKcRem))
+      a.test(rcx, rcx)
+      a.jz(rem_end)
+      a.label(rem_loop)
+      a.kstep(0)
+      a.add(rsi, int32(key.MR * sz))
+      a.add(rdx, int32(key.NR * sz))
+      a.dec(rcx)
+      a.jnz(rem_loop)
+      a.label(rem_end)
+
+      # Epilogue
+      if not key.alpha_one:
+        a.vbroadcast(scalar_reg, mem(rdi, ArgAlpha))
+        for i in 0 ..< key.mr:
+          for v in 0 ..< nb_vecs:
+            a.vmul(acc(i, v), acc(i, v), scalar_reg)
+      if key.beta == jbGeneral:
+        a.vbroadcast(scalar_reg, mem(rdi, ArgBeta))
+      if tail > 0:
+        a.vmov(mask_reg, mem(rdi, ArgMask))
+
+      a.mov(r8, mem(rdi, ArgC))
+      a.mov(r9, mem(rdi, ArgCRowStride))
+      for i in 0 ..< key.mr:
+        for v in 0 ..< nb_vecs:
+          let c_adr = mem(r8, v * lanes * sz)
+          let masked = tail > 0 and v == nb_vecs - 1
+          if key.beta != jbZero:
+            if masked: a.vmaskmov(c_reg, mask_reg, c_adr)
+            else: a.vmov(c_reg, c_adr)
+            if key.beta == jbOne: a.vadd(acc(i, v), acc(i, v), c_reg)
+            else: a.vfmadd231(acc(i, v), c_reg, scalar_reg)
+          if masked: a.vmaskmov(c_adr, mask_reg, acc(i, v))
+          else: a.vmov(c_adr, acc(i, v))
+        if i < key.mr - 1:
+          a.add(r8, r9)
+
+      a.vzeroupper()
+      a.ret()
+
+  var
+    jit_cache {.threadvar.}: Table[JitUKernelKey, JitFunction]
+    jit_cache_init {.threadvar.}: bool
+
+  proc jit_ukernel(key: JitUKernelKey): pointer =
+    ## Returns the cached kernel for `key` or generates it.
+    ## Kernels live as long as the thread.
+    if not jit_cache_init:
+      jit_cache = initTable[JitUKernelKey, JitFunction]()
+      jit_cache_init = true
+    if key notin jit_cache:
+      jit_cache[key] = gen_ukernel(key)
+    result = jit_cache[key].entry_point
+
+# ############################################################
+#
+#                    GEMM integration
+#
+# ############################################################
+
+proc jit_edge_kernels*[T; ukernel: static MicroKernel](
+      M, N: int, alpha: T
+    ): JitEdgeKernels[T] =
+  ## Generate or fetch the kernels of the edge tiles
+  ## of a M*N GEMM. This allocates and must not be called from OpenMP threads.
+  const
+    MR = ukernel.extract_mr
+    NR = ukernel.extract_nr
+    simd = ukernel.extract_cpu_simd
+    c_unit_stride = ukernel.extract_c_unit_stride
+
+  when defined(amd64) and not defined(windows) and
+      T is SomeFloat and simd == x86_AVX_FMA and c_unit_stride:
+    result.MR = MR
+    result.NR = NR
+    result.mr_tail = M mod MR
+    result.nr_tail = N mod NR
+    result.alpha = alpha
+    if result.mr_tail == 0 and result.nr_tail == 0:
+      return
+
+    const lanes = 32 div T.sizeof
+    for lane in 0 ..< result.nr_tail mod lanes:
+      for byt in 0 ..< T.sizeof:
+        result.mask[lane * T.sizeof + byt] = 0xFF
+
+    for beta in JitBeta:
+      for mr_is_tail in 0 .. 1:
+        for nr_is_tail in 0 .. 1:
+          let mr = if mr_is_tail == 1: result.mr_tail else: MR
+          let nr = if nr_is_tail == 1: result.nr_tail else: NR
+          if mr == 0 or nr == 0 or (mr == MR and nr == NR):
+            continue
+          let key = JitUKernelKey(
+            double: T is float64,
+            MR: MR, NR: NR, mr: mr, nr: nr,
+            unroll: JitKcUnroll,
+            alpha_one: alpha == 1.T,
+            beta: beta
+          )
+          result.fns[beta][mr_is_tail][nr_is_tail] =
+            cast[JitUKernelProc[T]](jit_ukernel(key))
+
+proc gebb_ukernel_edge_jit*[T](
+      jit: JitEdgeKernels[T],
+      mr, nr, kc: int,
+      alpha: T, packedA, packedB: ptr UncheckedArray[T],
+      beta: T, vC: MatrixView[T],
+      epilogue: Epilogue[T]
+    ): bool {.inline.} =
+  ## Compute an edge tile with a JIT kernel.
+  ## Returns false if there is none for this tile.
+  ##
+  ## Generated kernels have no epilogue: with a bias or an activation
+  ## the static edge kernel is used as it applies them before its store.
+  if not epilogue.isNoOp or alpha != jit.alpha or
+      not ((mr == jit.MR or mr == jit.mr_tail) and (nr == jit.NR or nr == jit.nr_tail)):
+    return false
+
+  let beta_kind = if beta == 0.T: jbZero
+                  elif beta == 1.T: jbOne
+                  else: jbGeneral
+  let mr_is_tail = int(mr != jit.MR)
+  let nr_is_tail = int(nr != jit.NR)
+  let fn = jit.fns[beta_kind][mr_is_tail][nr_is_tail]
+  if fn.isNil:
+    return false
+
+  var args {.noInit.}: JitUKernelArgs[T]
+  args.mask = jit.mask
+  args.kc_main = kc div JitKcUnroll
+  args.kc_rem = kc mod JitKcUnroll
+  args.packedA = packedA
+  args.packedB = packedB
+  args.C = vC.buffer
+  args.c_row_stride = vC.rowStride * T.sizeof
+  args.alpha = alpha
+  args.beta = beta
+  fn(args.addr)
+  result = true
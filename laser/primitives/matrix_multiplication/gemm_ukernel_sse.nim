@@ -22,5 +22,20 @@ ukernel_generator(
       simd_store_unaligned = mm_storeu_ps,
       simd_mul = mm_mul_ps,
       simd_add = mm_add_ps,
-      simd_fma = float32x4_muladd_unfused
+      simd_fma = float32x4_muladd_unfused,
+      simd_max = mm_max_ps
+    )
+
+gemv_kernels_generator(
+      dot_sse, axpy_sse,
+      float32, nb_scalars = 4,
+      mm_setzero_ps, mm_set1_ps, mm_loadu_ps, mm_storeu_ps,
+      mm_add_ps, float32x4_muladd_unfused
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_sse,
+      float32, m128, nb_scalars = 4,
+      mm_setzero_ps, mm_set1_ps, mm_loadu_ps, mm_storeu_ps,
+      float32x4_muladd_unfused
     )
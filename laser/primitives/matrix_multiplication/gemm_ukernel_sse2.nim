@@ -22,7 +22,8 @@ ukernel_generator(
       simd_store_unaligned = mm_storeu_pd,
       simd_mul = mm_mul_pd,
       simd_add = mm_add_pd,
-      simd_fma = float64x2_muladd_unfused
+      simd_fma = float64x2_muladd_unfused,
+      simd_max = mm_max_pd
     )
 
 #######################################
@@ -64,6 +65,9 @@ template fma_int32_sse2_fallback(a, b, c: Int32x2): Int32x2 =
   ## By mistake I had c[0] instead of c[1] and twice the speed
   [c[0] + a[0]*b[0], c[1] + a[1]*b[1]]
 
+template max_int32_sse2_fallback(a, b: Int32x2): Int32x2 =
+  [max(a[0], b[0]), max(a[1], b[1])]
+
 ukernel_generator(
       x86_SSE2,
       typ = int32,
@@ -76,7 +80,8 @@ ukernel_generator(
       simd_store_unaligned = store_int32_sse2_fallback,
       simd_mul = mul_int32_sse2_fallback,
       simd_add = add_int32_sse2_fallback,
-      simd_fma = fma_int32_sse2_fallback
+      simd_fma = fma_int32_sse2_fallback,
+      simd_max = max_int32_sse2_fallback
     )
 
 
@@ -113,6 +118,9 @@ template fma_int64_sse2_fallback(a, b, c: Int64x2): Int64x2 =
   ## By mistake I had c[0] instead of c[1] and twice the speed
   [c[0] + a[0]*b[0], c[1] + a[1]*b[1]]
 
+template max_int64_sse2_fallback(a, b: Int64x2): Int64x2 =
+  [max(a[0], b[0]), max(a[1], b[1])]
+
 ukernel_generator(
       x86_SSE2,
       typ = int64,
@@ -125,5 +133,20 @@ ukernel_generator(
       simd_store_unaligned = store_int64_sse2_fallback,
       simd_mul = mul_int64_sse2_fallback,
       simd_add = add_int64_sse2_fallback,
-      simd_fma = fma_int64_sse2_fallback
+      simd_fma = fma_int64_sse2_fallback,
+      simd_max = max_int64_sse2_fallback
+    )
+
+gemv_kernels_generator(
+      dot_sse2, axpy_sse2,
+      float64, nb_scalars = 2,
+      mm_setzero_pd, mm_set1_pd, mm_loadu_pd, mm_storeu_pd,
+      mm_add_pd, float64x2_muladd_unfused
+    )
+
+gemm_small_kernel_generator(
+      gemm_small_sse2,
+      float64, m128d, nb_scalars = 2,
+      mm_setzero_pd, mm_set1_pd, mm_loadu_pd, mm_storeu_pd,
+      float64x2_muladd_unfused
     )
@@ -32,5 +32,6 @@ ukernel_generator(
       simd_store_unaligned = int32x4_storeu,
       simd_mul = mm_mullo_epi32,
       simd_add = mm_add_epi32,
-      simd_fma = int32x4_muladd_unfused_sse4_1
+      simd_fma = int32x4_muladd_unfused_sse4_1,
+      simd_max = mm_max_epi32
     )
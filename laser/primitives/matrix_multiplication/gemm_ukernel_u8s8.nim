@@ -0,0 +1,164 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../../compiler_optim_hints,
+  ./gemm_tiling, ./gemm_utils
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#     Quantized microkernels: uint8 * int8 -> int32
+#
+# ############################################################
+
+# x86 computes u8*s8 dot products on groups of 4 consecutive k:
+#   - AVX2 and AVX512BW: the even and odd bytes are widened to int16 in place
+#                        (zero-extended for A, sign-extended for B)
+#                        and vpmaddwd multiplies and adds adjacent int16 pairs into int32
+#   - AVX512 VNNI:       vpdpbusd multiplies u8 by s8 and accumulates groups of 4 into int32
+#
+# So the packed panels interleave K by groups of 4:
+#   - Ã: for each k4, MR rows of 4 uint8, broadcasted as an int32
+#   - ~B: for each k4, NR columns of 4 int8, loaded as NR int32 lanes
+# and kc is padded to a multiple of 4 with zeros.
+#
+# vpmaddubsw is not used: it saturates the sum of 2 adjacent products to int16
+# when A has values of 128 or more, results would depend on the ISA.
+# All microkernels are exact for the full uint8 range.
+
+func x86_ukernel_u8s8*(cpu: CPUFeatureX86): MicroKernel =
+  ## Microkernel configuration for uint8 * int8 -> int32
+  ## with nb_scalars the number of int32 lanes per SIMD vector.
+  result.cpu_simd = cpu
+  result.pt = 128
+  case cpu
+  of x86_AVX512:
+    result.nb_scalars = 16
+    result.nb_vecs_nr = 2
+    result.mr = 8         # 16 accumulators + 2 for ~B + 1 for Ã out of 32 ZMM registers
+  of x86_AVX2:
+    result.nb_scalars = 8
+    result.nb_vecs_nr = 2
+    result.mr = 4         # 8 accumulators + 2 for ~B + 1 for Ã + 2 temporaries out of 16 YMM registers
+  else:
+    result.nb_scalars = 1
+    result.nb_vecs_nr = 8
+    result.mr = 4
+  result.nr = result.nb_vecs_nr * result.nb_scalars
+
+# ############################################################
+#
+#                    Packing
+#
+# ############################################################
+
+proc pack_A_u8s8*[MR: static int](
+      dst: ptr UncheckedArray[uint8],
+      mc, kc: int,
+      A: MatrixView[uint8]) =
+  ## Pack a [mc, kc] block of A into micropanels of MR rows
+  ## with k interleaved by groups of 4
+  let dst{.restrict.} = dst
+  let kc4 = get_num_tiles(kc, 4)
+  for ip in 0 ..< get_num_tiles(mc, MR):
+    let upanel = dst + ip * kc4 * MR * 4
+    let mr = min(mc - ip * MR, MR)
+    for k4 in 0 ..< kc4:
+      for i in 0 ..< MR:
+        for q in 0 ..< 4:
+          let k = k4 * 4 + q
+          upanel[(k4 * MR + i) * 4 + q] =
+            if i < mr and k < kc: A[ip * MR + i, k]
+            else: 0'u8
+
+proc pack_B_u8s8*[NR: static int](
+      dst: ptr UncheckedArray[int8],
+      kc, nc: int,
+      B: MatrixView[int8]) =
+  ## Pack a [kc, nc] panel of B into micropanels of NR columns
+  ## with k interleaved by groups of 4
+  ##
+  ## Packing is shared between the threads of the enclosing
+  ## parallel region, if any, and ends with a barrier.
+  let dst{.restrict.} = dst
+  let kc4 = get_num_tiles(kc, 4)
+  for jp in `||`(0, get_num_tiles(nc, NR) - 1, "for"):
+    let upanel = dst + jp * kc4 * NR * 4
+    let nr = min(nc - jp * NR, NR)
+    for k4 in 0 ..< kc4:
+      for j in 0 ..< NR:
+        for q in 0 ..< 4:
+          let k = k4 * 4 + q
+          upanel[(k4 * NR + j) * 4 + q] =
+            if j < nr and k < kc: B[k, jp * NR + j]
+            else: 0'i8
+
+# ############################################################
+#
+#                    Microkernels
+#
+# ############################################################
+
+# The SIMD microkernels are generated by `ukernel_u8s8_generator`
+# in gemm_ukernel_u8s8_avx2, gemm_ukernel_u8s8_avx512bw and gemm_ukernel_u8s8_avx512vnni
+# so that flags like "-mavx512vnni" are isolated: with them the compiler may fuse
+# vpmaddwd and vpaddd into vpdpwssd, which does not exist on AVX512BW-only CPUs.
+# Add the corresponding compilation flags to "nim.cfg"
+
+template ukernel_u8s8_generator*(
+      name: untyped, V: typedesc, lanes: static int,
+      simd_setZero, simd_broadcast_int32,
+      simd_load, simd_store, simd_dot4: untyped
+    ) =
+  proc name*[MR, NR: static int](
+        kc4: int,
+        packedA: ptr UncheckedArray[uint8],
+        packedB: ptr UncheckedArray[int8],
+        AB: var array[MR, array[NR, int32]]
+      ) =
+    ## AB = Ã[MR, kc] * ~B[kc, NR]
+    const NbVecs = NR div lanes
+    let A = assume_aligned packedA
+    let B = assume_aligned packedB
+
+    var acc: array[MR, array[NbVecs, V]]
+    for i in 0 ..< MR:
+      for v in 0 ..< NbVecs:
+        acc[i][v] = simd_setZero()
+
+    for k4 in 0 ..< kc4:
+      prefetch(B[(k4+1)*NR*4].addr, Read, LowTemporalLocality)
+      var b: array[NbVecs, V]
+      for v in 0 ..< NbVecs:
+        b[v] = simd_load(B[(k4*NR + v*lanes)*4].addr)
+      for i in 0 ..< MR:
+        let a = simd_broadcast_int32(cast[ptr int32](A[(k4*MR + i)*4].addr)[])
+        for v in 0 ..< NbVecs:
+          acc[i][v] = simd_dot4(acc[i][v], a, b[v])
+
+    for i in 0 ..< MR:
+      for v in 0 ..< NbVecs:
+        simd_store(AB[i][v*lanes].addr, acc[i][v])
+
+proc gebb_ukernel_u8s8_fallback*[MR, NR: static int](
+      kc4: int,
+      packedA: ptr UncheckedArray[uint8],
+      packedB: ptr UncheckedArray[int8],
+      AB: var array[MR, array[NR, int32]]
+    ) =
+  let A{.restrict.} = assume_aligned packedA
+  let B{.restrict.} = assume_aligned packedB
+  for i in 0 ..< MR:
+    for j in 0 ..< NR:
+      AB[i][j] = 0
+  for k4 in 0 ..< kc4:
+    for i in 0 ..< MR:
+      for j in 0 ..< NR:
+        var dot4 = 0'i32
+        for q in 0 ..< 4:
+          dot4 += int32(A[(k4*MR + i)*4 + q]) * int32(B[(k4*NR + j)*4 + q])
+        AB[i][j] += dot4
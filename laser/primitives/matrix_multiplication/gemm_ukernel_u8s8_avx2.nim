@@ -0,0 +1,35 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ./gemm_ukernel_u8s8, ./gemm_utils,
+  ../../compiler_optim_hints, ../../simd
+
+template load_u8s8_avx2(p: ptr int8): m256i =
+  mm256_loadu_si256(cast[ptr m256i](p))
+
+template store_u8s8_avx2(p: ptr int32, v: m256i) =
+  mm256_storeu_si256(cast[ptr m256i](p), v)
+
+template dot4_u8s8_avx2(acc, a, b: m256i): m256i =
+  # Even bytes: a[0]*b[0] + a[2]*b[2], odd bytes: a[1]*b[1] + a[3]*b[3]
+  # each product fits in int16 and vpmaddwd sums the pairs in int32, without saturation
+  let a_even = mm256_and_si256(a, mm256_set1_epi16(0x00FF'i16))
+  let a_odd = mm256_srli_epi16(a, 8)
+  let b_even = mm256_srai_epi16(mm256_slli_epi16(b, 8), 8)
+  let b_odd = mm256_srai_epi16(b, 8)
+  mm256_add_epi32(
+    acc,
+    mm256_add_epi32(mm256_madd_epi16(a_even, b_even), mm256_madd_epi16(a_odd, b_odd))
+  )
+
+ukernel_u8s8_generator(
+      gebb_ukernel_u8s8_avx2, m256i, lanes = 8,
+      simd_setZero = mm256_setzero_si256,
+      simd_broadcast_int32 = mm256_set1_epi32,
+      simd_load = load_u8s8_avx2,
+      simd_store = store_u8s8_avx2,
+      simd_dot4 = dot4_u8s8_avx2
+    )
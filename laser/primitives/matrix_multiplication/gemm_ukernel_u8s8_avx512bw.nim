@@ -0,0 +1,28 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ./gemm_ukernel_u8s8, ./gemm_utils,
+  ../../compiler_optim_hints, ../../simd
+
+template dot4_u8s8_avx512bw(acc, a, b: m512i): m512i =
+  # See dot4_u8s8_avx2
+  let a_even = mm512_and_si512(a, mm512_set1_epi16(0x00FF'i16))
+  let a_odd = mm512_srli_epi16(a, 8)
+  let b_even = mm512_srai_epi16(mm512_slli_epi16(b, 8), 8)
+  let b_odd = mm512_srai_epi16(b, 8)
+  mm512_add_epi32(
+    acc,
+    mm512_add_epi32(mm512_madd_epi16(a_even, b_even), mm512_madd_epi16(a_odd, b_odd))
+  )
+
+ukernel_u8s8_generator(
+      gebb_ukernel_u8s8_avx512bw, m512i, lanes = 16,
+      simd_setZero = mm512_setzero_si512,
+      simd_broadcast_int32 = mm512_set1_epi32,
+      simd_load = mm512_loadu_si512,
+      simd_store = mm512_storeu_si512,
+      simd_dot4 = dot4_u8s8_avx512bw
+    )
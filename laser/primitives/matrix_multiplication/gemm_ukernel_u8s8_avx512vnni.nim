@@ -0,0 +1,17 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ./gemm_ukernel_u8s8, ./gemm_utils,
+  ../../compiler_optim_hints, ../../simd
+
+ukernel_u8s8_generator(
+      gebb_ukernel_u8s8_avx512vnni, m512i, lanes = 16,
+      simd_setZero = mm512_setzero_si512,
+      simd_broadcast_int32 = mm512_set1_epi32,
+      simd_load = mm512_loadu_si512,
+      simd_store = mm512_storeu_si512,
+      simd_dot4 = mm512_dpbusd_epi32
+    )
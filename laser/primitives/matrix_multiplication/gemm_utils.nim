@@ -58,3 +58,237 @@ func stride*[T](view: MatrixView[T], row, col: Natural): MatrixView[T]{.inline.}
   )
   result.rowStride = view.rowStride
   result.colStride = view.colStride
+
+# ############################################################
+#
+#                 Quantized Matrix View
+#
+# ############################################################
+
+# Weights may be stored as int8 or as 4-bit integers
+# and dequantized to float32 while being packed:
+#   B[k, j] = (q[k, j] - zero_point[g, j]) * scale[g, j]    with g = k div group_size
+#
+# Scales and zero points are [ceil(K / group_size), N] row-major matrices.
+
+type
+  UInt4* = distinct uint8
+    ## 2 unsigned 4-bit integers (0..15) per byte, the even element in the low nibble.
+    ## Strides of UInt4 matrices are in elements, not bytes.
+
+  QuantizedMatrixView*[Q] = object
+    data*: ptr UncheckedArray[uint8]
+    rowStride*, colStride*: int
+    scales*: ptr UncheckedArray[float32]
+    zero_points*: ptr UncheckedArray[int8]   # nil for symmetric quantization
+    group_size*: int
+    groupStride*: int                         # row stride of scales and zero points
+    row*, col*: int                           # offset of the view in the quantized matrix
+
+func toQuantizedMatrixView*[Q: int8 or UInt4](
+      data: ptr Q, rowStride, colStride: int,
+      scales: ptr float32, zero_points: ptr int8,
+      group_size, groupStride: int): QuantizedMatrixView[Q] {.inline.} =
+  result.data = cast[ptr UncheckedArray[uint8]](data)
+  result.rowStride = rowStride
+  result.colStride = colStride
+  result.scales = cast[ptr UncheckedArray[float32]](scales)
+  result.zero_points = cast[ptr UncheckedArray[int8]](zero_points)
+  result.group_size = group_size
+  result.groupStride = groupStride
+
+func quantized*[Q](view: QuantizedMatrixView[Q], row, col: int): int32 {.inline.} =
+  ## Integer at absolute position [row, col], without the view offset
+  let idx = row * view.rowStride + col * view.colStride
+  when Q is UInt4:
+    int32((view.data[idx shr 1] shr ((idx and 1) shl 2)) and 0xF)
+  else:
+    int32(cast[int8](view.data[idx]))
+
+func zero_point*[Q](view: QuantizedMatrixView[Q], group_idx: int): int32 {.inline.} =
+  ## Zero point at index `group_idx` of the zero points matrix.
+  ## Without zero points, UInt4 is centered on 8 and int8 on 0.
+  if view.zero_points.isNil:
+    when Q is UInt4: 8'i32 else: 0'i32
+  else:
+    int32(view.zero_points[group_idx])
+
+func stride*[Q](view: QuantizedMatrixView[Q], row, col: Natural): QuantizedMatrixView[Q]{.inline.}=
+  ## Returns a new view offset by the row and column stride.
+  ## 4-bit elements are not addressable, the offset is kept in the view.
+  result = view
+  result.row += row
+  result.col += col
+
+# ############################################################
+#
+#                    Im2col Matrix View
+#
+# ############################################################
+
+# The convolution of an image [C, H, W] by kernels [C_out, C, kH, kW]
+# is the product of the kernels seen as a [C_out, C*kH*kW] matrix
+# by the im2col matrix [C*kH*kW, outH*outW] of the sliding windows of the image:
+#   im2col[(c*kH + kr)*kW + kc, oh*outW + ow] = image[c, oh*strideH - padH + kr, ow*strideW - padW + kc]
+# and 0 in the padding.
+#
+# The im2col matrix is kH*kW times larger than the image,
+# it is not materialized but read from the image while packing B.
+
+type
+  Im2ColView*[T] = object
+    image*: ptr UncheckedArray[T]   # [C, H, W] contiguous
+    H*, W*: int
+    kH*, kW*: int
+    padH*, padW*: int
+    strideH*, strideW*: int
+    outW*: int
+    row*, col*: int                 # offset of the view in the im2col matrix
+
+func toIm2ColView*[T](
+      image: ptr T, H, W: int,
+      kH, kW: int,
+      padH, padW: int,
+      strideH, strideW: int): Im2ColView[T] {.inline.} =
+  result.image = cast[ptr UncheckedArray[T]](image)
+  result.H = H
+  result.W = W
+  result.kH = kH
+  result.kW = kW
+  result.padH = padH
+  result.padW = padW
+  result.strideH = strideH
+  result.strideW = strideW
+  result.outW = 1 + (W + 2*padW - kW) div strideW
+
+func `[]`*[T](view: Im2ColView[T], row, col: Natural): T {.inline.} =
+  ## Access like a 2D matrix
+  let r = view.row + row
+  let c = view.col + col
+  let kHkW = view.kH * view.kW
+  let ih = (c div view.outW) * view.strideH - view.padH + (r mod kHkW) div view.kW
+  let iw = (c mod view.outW) * view.strideW - view.padW + r mod view.kW
+  if ih <% view.H and iw <% view.W: # Unsigned '<' does 0 <= x < H.
+    result = view.image[((r div kHkW) * view.H + ih) * view.W + iw]
+
+func stride*[T](view: Im2ColView[T], row, col: Natural): Im2ColView[T]{.inline.}=
+  ## Returns a new view offset by the row and column stride.
+  ## The view is not strided in memory, the offset is kept in the view.
+  result = view
+  result.row += row
+  result.col += col
+
+# ############################################################
+#
+#                  Fused epilogue operations
+#
+# ############################################################
+
+type
+  Activation* = enum
+    ## Unary operation applied elementwise to C
+    ## after C = αAB + βC + bias
+    actNone, actRelu, actTanh, actSigmoid
+
+  Epilogue*[T] = object
+    ## Operations fused at the end of the matrix multiplication
+    ## while the C tile is still hot in the microkernel.
+    ##
+    ## The bias is stored as a broadcasted view so that it can be
+    ## offset exactly like C when tiling:
+    ##   - per-row bias (length M):    rowStride = 1, colStride = 0
+    ##   - per-column bias (length N): rowStride = 0, colStride = 1
+    ## A nil bias buffer means no bias.
+    bias*: MatrixView[T]
+    activation*: Activation
+
+func activationEpilogue*[T](activation: Activation): Epilogue[T] {.inline.} =
+  ## Fuse only an activation, without bias
+  result.activation = activation
+
+func rowBiasEpilogue*[T](bias: ptr T, activation = actNone): Epilogue[T] {.inline.} =
+  ## Fuse C[i, j] = activation(C[i, j] + bias[i]), bias of length M
+  result.bias = bias.toMatrixView(rowStride = 1, colStride = 0)
+  result.activation = activation
+
+func colBiasEpilogue*[T](bias: ptr T, activation = actNone): Epilogue[T] {.inline.} =
+  ## Fuse C[i, j] = activation(C[i, j] + bias[j]), bias of length N
+  ## This is the Dense/Linear layer case with C = X * W
+  result.bias = bias.toMatrixView(rowStride = 0, colStride = 1)
+  result.activation = activation
+
+func isNoOp*[T](epilogue: Epilogue[T]): bool {.inline.} =
+  epilogue.bias.buffer.isNil and epilogue.activation == actNone
+
+func isSimd*[T](epilogue: Epilogue[T]): bool {.inline.} =
+  ## The SIMD microkernels apply the epilogue on their registers
+  ## for ReLU and a per-row or per-column bias.
+  ## Tanh and sigmoid go through the scalar fallback.
+  epilogue.activation in {actNone, actRelu} and (
+    epilogue.bias.buffer.isNil or epilogue.bias.colStride in {0, 1})
+
+func stride*[T](epilogue: Epilogue[T], row, col: Natural): Epilogue[T] {.inline.} =
+  ## Returns a new epilogue with the bias offset like C
+  result = epilogue
+  if not epilogue.bias.buffer.isNil:
+    result.bias = epilogue.bias.stride(row, col)
+
+# ############################################################
+#
+#                  Fused prologue operations
+#
+# ############################################################
+
+type
+  PrologueKind* = enum
+    ## Elementwise transform applied to A or B while packing
+    proNone,        # x
+    proScale,       # x * scale
+    proReluGrad,    # x * relu'(y)    = x * (y > 0)
+    proTanhGrad,    # x * tanh'(y)    = x * (1 - y²)
+    proSigmoidGrad, # x * sigmoid'(y) = x * y * (1 - y)
+    proCustom       # fn(x)
+
+  Prologue*[T] = object
+    ## Operations fused in the packing of A or B.
+    ## As packing already reads and reorders each element
+    ## this avoids materializing the transformed matrix.
+    ##
+    ## For the activation derivatives, `fwd` is a view over
+    ## the forward activation output y = f(z) which must have the
+    ## same shape as the operand. It is offset like the operand when tiling.
+    kind*: PrologueKind
+    scale*: T
+    fwd*: MatrixView[T]
+    fn*: proc(x: T): T {.nimcall, noSideEffect.}
+
+func scalePrologue*[T](scale: T): Prologue[T] {.inline.} =
+  ## Fuse x * scale
+  result.kind = proScale
+  result.scale = scale
+
+func reluGradPrologue*[T](fwd: ptr T, rowStride, colStride: int): Prologue[T] {.inline.} =
+  ## Fuse x * relu'(y) with y the output of the forward ReLU
+  result.kind = proReluGrad
+  result.fwd = fwd.toMatrixView(rowStride, colStride)
+
+func tanhGradPrologue*[T](fwd: ptr T, rowStride, colStride: int): Prologue[T] {.inline.} =
+  ## Fuse x * tanh'(z) = x * (1 - y²) with y = tanh(z) the output of the forward tanh
+  result.kind = proTanhGrad
+  result.fwd = fwd.toMatrixView(rowStride, colStride)
+
+func sigmoidGradPrologue*[T](fwd: ptr T, rowStride, colStride: int): Prologue[T] {.inline.} =
+  ## Fuse x * sigmoid'(z) = x * y * (1 - y) with y = sigmoid(z) the output of the forward sigmoid
+  result.kind = proSigmoidGrad
+  result.fwd = fwd.toMatrixView(rowStride, colStride)
+
+func customPrologue*[T](fn: proc(x: T): T {.nimcall, noSideEffect.}): Prologue[T] {.inline.} =
+  ## Fuse fn(x). This has the overhead of an indirect call per element.
+  result.kind = proCustom
+  result.fn = fn
+
+func stride*[T](prologue: Prologue[T], row, col: Natural): Prologue[T] {.inline.} =
+  ## Returns a new prologue with the forward activation offset like the operand
+  result = prologue
+  if not prologue.fwd.buffer.isNil:
+    result.fwd = prologue.fwd.stride(row, col)
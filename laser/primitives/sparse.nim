@@ -0,0 +1,443 @@
+# Laser
+# Copyright (c) 2018 Mamy André-Ratsimbazafy
+# Distributed under the Apache v2 License (license terms are at http://www.apache.org/licenses/LICENSE-2.0).
+# This file may not be copied, modified, or distributed except according to those terms.
+
+import
+  ../compiler_optim_hints, ../openmp,
+  ../private/align_unroller,
+  ./matrix_multiplication/[gemm_tiling, gemm_utils, gemm_gemv]
+
+withCompilerOptimHints()
+
+# ############################################################
+#
+#      Sparse x Dense Matrix Multiplication (SpMM, SpMV)
+#
+# ############################################################
+
+# C = αA*B + βC with A sparse [M, K] and B, C dense [K, N], [M, N]
+# for sparse matrices of low density, for example one-hot or multi-hot
+# features of recommendation models, instead of densifying A for gemm_strided.
+#
+# Formats, with 0-based indices:
+#   - CSR (Compressed Sparse Row):
+#       rowPtr[M+1], the non-zeros of row i are at rowPtr[i] ..< rowPtr[i+1]
+#       colIdx[nnz], the column of each non-zero
+#       values[nnz]
+#   - BSR (Block Sparse Row): CSR of dense blocks [R, S], for pruned weights
+#       blockRowPtr[M/R + 1], blockColIdx[nnzb] in blocks
+#       values[nnzb*R*S], each block is row-major
+#
+# Dense-row accumulation:
+#   C[i, :] = βC[i, :] + α Σp A[i, colIdx[p]] * B[colIdx[p], :]
+# each non-zero is an axpy on a row of B, vectorized with the GEMV SIMD kernels
+# when B has unit column stride. The rows of C are accumulated by tiles of N
+# that stay in L1.
+#
+# Rows have very different numbers of non-zeros so they are not split evenly
+# between threads: each thread gets a contiguous range of rows
+# with about the same number of non-zeros (see `balanced_rows`).
+
+const SPMM_TILE = 1024
+  ## Number of elements of C accumulated in L1
+  ## before applying α and β
+
+# ############################################################
+#
+#                    Partitioning
+#
+# ############################################################
+
+proc balanced_rows[I: SomeInteger](
+      rowPtr: ptr UncheckedArray[I], M: int,
+      chunk_id, nb_chunks: int
+    ): tuple[start, stop: int] =
+  ## Returns the range of rows of chunk `chunk_id`
+  ## so that all chunks have about the same cost.
+  ## The cost of rows start ..< stop is rowPtr[stop] - rowPtr[start] + stop - start:
+  ## the non-zeros and a constant per row for α and β.
+  let total = int(rowPtr[M] - rowPtr[0]) + M
+
+  template first_row(target: int): int =
+    # First row whose cumulative cost is at least target
+    var lo = 0
+    var hi = M
+    while lo < hi:
+      let mid = (lo + hi) div 2
+      if int(rowPtr[mid] - rowPtr[0]) + mid < target:
+        lo = mid + 1
+      else:
+        hi = mid
+    lo
+
+  result.start = if chunk_id == 0: 0
+                 else: first_row(total * chunk_id div nb_chunks)
+  result.stop = if chunk_id == nb_chunks - 1: M
+                else: first_row(total * (chunk_id + 1) div nb_chunks)
+
+template omp_parallel_rows(
+      rowPtr: untyped, M, work: int,
+      start, stop: untyped,
+      body: untyped
+    ) =
+  ## Each thread processes a range of rows start ..< stop
+  ## balanced with `balanced_rows`
+  omp_parallel_if(work > OMP_MEMORY_BOUND_GRAIN_SIZE * omp_get_max_threads()):
+    let (start, stop) = balanced_rows(
+      rowPtr, M,
+      omp_get_thread_num().int, omp_get_num_threads().int
+    )
+    body
+
+# ############################################################
+#
+#                    Kernels
+#
+# ############################################################
+
+proc store_tile[T](
+      alpha: T, acc: ptr UncheckedArray[T],
+      beta: T, C: MatrixView[T], nt: int
+    ) {.inline.} =
+  ## C[0, 0:nt] = α acc[0:nt] + βC[0, 0:nt]
+  ## β = 0 does not read C, it may be uninitialized.
+  if beta == 0.T:
+    for j in 0 ..< nt:
+      C[0, j] = alpha * acc[j]
+  else:
+    for j in 0 ..< nt:
+      C[0, j] = alpha * acc[j] + beta * C[0, j]
+
+proc spmm_csr_rows[T; I: SomeInteger; simd: static CPUFeatureX86](
+      start, stop, N: int,
+      alpha: T,
+      rowPtr, colIdx: ptr UncheckedArray[I], values: ptr UncheckedArray[T],
+      B: MatrixView[T],
+      beta: T, C: MatrixView[T]
+    ) =
+  ## Compute the rows start ..< stop of C
+  var Acc{.align_variable.}: array[SPMM_TILE, T]
+  let acc = cast[ptr UncheckedArray[T]](Acc[0].addr)
+
+  for i in start ..< stop:
+    for n in countup(0, N-1, SPMM_TILE):
+      let nt = min(N - n, SPMM_TILE)
+      zeroMem(acc, nt * T.sizeof)
+      for p in int(rowPtr[i]) ..< int(rowPtr[i+1]):
+        let k = int(colIdx[p])
+        if B.colStride == 1:
+          axpy[T, simd](
+            acc, values[p],
+            cast[ptr UncheckedArray[T]](B.buffer[k * B.rowStride + n].addr), nt
+          )
+        else:
+          for j in 0 ..< nt:
+            acc[j] += values[p] * B[k, n+j]
+      store_tile(alpha, acc, beta, C.stride(i, n), nt)
+
+proc spmm_bsr_rows[T; I: SomeInteger; simd: static CPUFeatureX86](
+      start, stop, N: int,
+      R, S: int,
+      alpha: T,
+      blockRowPtr, blockColIdx: ptr UncheckedArray[I], values: ptr UncheckedArray[T],
+      B: MatrixView[T],
+      beta: T, C: MatrixView[T]
+    ) =
+  ## Compute the block rows start ..< stop of C
+  ## The tile is R rows of `width` elements
+  var Acc{.align_variable.}: array[SPMM_TILE, T]
+  let acc = cast[ptr UncheckedArray[T]](Acc[0].addr)
+  let width = SPMM_TILE div R
+
+  for ib in start ..< stop:
+    for n in countup(0, N-1, width):
+      let nt = min(N - n, width)
+      zeroMem(acc, R * width * T.sizeof)
+      for p in int(blockRowPtr[ib]) ..< int(blockRowPtr[ib+1]):
+        let kb = int(blockColIdx[p]) * S
+        let blk = cast[ptr UncheckedArray[T]](values[p * R * S].addr)
+        for s in 0 ..< S:
+          # The row of B is reused for the R rows of the block
+          let rowB = cast[ptr UncheckedArray[T]](B.buffer[(kb + s) * B.rowStride + n * B.colStride].addr)
+          for r in 0 ..< R:
+            let accR = cast[ptr UncheckedArray[T]](acc[r * width].addr)
+            if B.colStride == 1:
+              axpy[T, simd](accR, blk[r * S + s], rowB, nt)
+            else:
+              for j in 0 ..< nt:
+                accR[j] += blk[r * S + s] * rowB[j * B.colStride]
+      for r in 0 ..< R:
+        store_tile(
+          alpha, cast[ptr UncheckedArray[T]](acc[r * width].addr),
+          beta, C.stride(ib * R + r, n), nt
+        )
+
+proc spmv_csr_rows[T; I: SomeInteger](
+      start, stop: int,
+      alpha: T,
+      rowPtr, colIdx: ptr UncheckedArray[I], values: ptr UncheckedArray[T],
+      x: ptr UncheckedArray[T], incx: int,
+      beta: T, y: ptr UncheckedArray[T], incy: int
+    ) =
+  ## Compute y[start ..< stop]
+  ## x is gathered so we use 4 scalar accumulators
+  ## to break the dependency chain of the additions.
+  for i in start ..< stop:
+    let p0 = int(rowPtr[i])
+    let p1 = int(rowPtr[i+1])
+    var acc0, acc1, acc2, acc3: T
+    let unroll_stop = p0 + round_step_down(p1 - p0, 4)
+    for p in countup(p0, unroll_stop - 1, 4):
+      acc0 += values[p  ] * x[int(colIdx[p  ]) * incx]
+      acc1 += values[p+1] * x[int(colIdx[p+1]) * incx]
+      acc2 += values[p+2] * x[int(colIdx[p+2]) * incx]
+      acc3 += values[p+3] * x[int(colIdx[p+3]) * incx]
+    var acc = (acc0 + acc1) + (acc2 + acc3)
+    for p in unroll_stop ..< p1:
+      acc += values[p] * x[int(colIdx[p]) * incx]
+
+    if beta == 0.T:
+      y[i * incy] = alpha * acc
+    else:
+      y[i * incy] = alpha * acc + beta * y[i * incy]
+
+# ############################################################
+#
+#   Exported functions and dispatch with CPU runtime detection
+#
+# ############################################################
+
+proc spmv_csr*[T: SomeNumber; I: SomeInteger](
+      M, K: int,
+      alpha: T,
+      rowPtr, colIdx: ptr I, values: ptr T,
+      x: ptr T, incx: int,
+      beta: T,
+      y: ptr T, incy: int) =
+  ## Compute y = αA*x + βy
+  ## with A a sparse [M, K] CSR matrix,
+  ## x a dense vector of K elements separated by `incx`
+  ## and y a dense vector of M elements separated by `incy`.
+  ##
+  ## If β is 0, y is not read and may be uninitialized.
+  let rowPtr = cast[ptr UncheckedArray[I]](rowPtr)
+  let colIdx{.restrict.} = cast[ptr UncheckedArray[I]](colIdx)
+  let values{.restrict.} = cast[ptr UncheckedArray[T]](values)
+  let x{.restrict.} = cast[ptr UncheckedArray[T]](x)
+  let y{.restrict.} = cast[ptr UncheckedArray[T]](y)
+
+  let nnz = int(rowPtr[M] - rowPtr[0])
+  omp_parallel_rows(rowPtr, M, nnz + M, start, stop):
+    spmv_csr_rows(
+      start, stop,
+      alpha, rowPtr, colIdx, values,
+      x, incx,
+      beta, y, incy
+    )
+
+proc spmm_csr*[T: SomeNumber; I: SomeInteger](
+      M, N, K: int,
+      alpha: T,
+      rowPtr, colIdx: ptr I, values: ptr T,
+      B: ptr T, rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T, rowStrideC, colStrideC: int) =
+  ## Compute C = αA*B + βC
+  ## with A a sparse [M, K] CSR matrix,
+  ## B a dense [K, N] matrix and C a dense [M, N] matrix.
+  ##
+  ## If β is 0, C is not read and may be uninitialized.
+  ## B with unit column stride uses SIMD.
+  if N == 1:
+    spmv_csr(
+      M, K, alpha,
+      rowPtr, colIdx, values,
+      B, rowStrideB,
+      beta, C, rowStrideC
+    )
+    return
+
+  let rowPtr = cast[ptr UncheckedArray[I]](rowPtr)
+  let colIdx{.restrict.} = cast[ptr UncheckedArray[I]](colIdx)
+  let values{.restrict.} = cast[ptr UncheckedArray[T]](values)
+  let vB = B.toMatrixView(rowStrideB, colStrideB)
+  let vC = C.toMatrixView(rowStrideC, colStrideC)
+
+  let nnz = int(rowPtr[M] - rowPtr[0])
+
+  template dispatch(simd: static CPUFeatureX86): untyped =
+    omp_parallel_rows(rowPtr, M, (nnz + M) * N, start, stop):
+      spmm_csr_rows[T, I, simd](
+        start, stop, N,
+        alpha, rowPtr, colIdx, values,
+        vB,
+        beta, vC
+      )
+    return
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+proc spmm_bsr*[T: SomeNumber; I: SomeInteger](
+      M, N, K: int,
+      R, S: int,
+      alpha: T,
+      blockRowPtr, blockColIdx: ptr I, values: ptr T,
+      B: ptr T, rowStrideB, colStrideB: int,
+      beta: T,
+      C: ptr T, rowStrideC, colStrideC: int) =
+  ## Compute C = αA*B + βC
+  ## with A a sparse [M, K] BSR matrix of dense row-major [R, S] blocks,
+  ## B a dense [K, N] matrix and C a dense [M, N] matrix.
+  ##
+  ## M must be a multiple of R and K a multiple of S.
+  ## If β is 0, C is not read and may be uninitialized.
+  ## B with unit column stride uses SIMD.
+  doAssert M mod R == 0 and K mod S == 0,
+    "M and K must be multiples of the block dimensions"
+  doAssert R <= SPMM_TILE, "Blocks must have at most " & $SPMM_TILE & " rows"
+
+  let blockRowPtr = cast[ptr UncheckedArray[I]](blockRowPtr)
+  let blockColIdx{.restrict.} = cast[ptr UncheckedArray[I]](blockColIdx)
+  let values{.restrict.} = cast[ptr UncheckedArray[T]](values)
+  let vB = B.toMatrixView(rowStrideB, colStrideB)
+  let vC = C.toMatrixView(rowStrideC, colStrideC)
+
+  let MB = M div R
+  let nnzb = int(blockRowPtr[MB] - blockRowPtr[0])
+
+  template dispatch(simd: static CPUFeatureX86): untyped =
+    omp_parallel_rows(blockRowPtr, MB, (nnzb * S + MB) * R * N, start, stop):
+      spmm_bsr_rows[T, I, simd](
+        start, stop, N,
+        R, S,
+        alpha, blockRowPtr, blockColIdx, values,
+        vB,
+        beta, vC
+      )
+    return
+
+  dispatch_cpu_simd(T, gemm_cpu_simd(T), dispatch)
+
+# ############################################################
+#
+#                       Private tests
+#
+# ############################################################
+
+when isMainModule:
+  proc dense_gemm[T](M, N, K: int, alpha: T, A, B: seq[T], beta: T, C: var seq[T]) =
+    for i in 0 ..< M:
+      for j in 0 ..< N:
+        var acc: T
+        for k in 0 ..< K:
+          acc += A[i*K + k] * B[k*N + j]
+        C[i*N + j] = alpha * acc + beta * C[i*N + j]
+
+  proc toCSR[T](M, K: int, A: seq[T]): tuple[rowPtr, colIdx: seq[int32], values: seq[T]] =
+    result.rowPtr.add 0
+    for i in 0 ..< M:
+      for k in 0 ..< K:
+        if A[i*K + k] != 0.T:
+          result.colIdx.add int32(k)
+          result.values.add A[i*K + k]
+      result.rowPtr.add int32(result.values.len)
+
+  proc toBSR[T](M, K, R, S: int, A: seq[T]): tuple[rowPtr, colIdx: seq[int32], values: seq[T]] =
+    result.rowPtr.add 0
+    for ib in 0 ..< M div R:
+      for kb in 0 ..< K div S:
+        var nonzero = false
+        for r in 0 ..< R:
+          for s in 0 ..< S:
+            nonzero = nonzero or A[(ib*R + r)*K + kb*S + s] != 0.T
+        if nonzero:
+          result.colIdx.add int32(kb)
+          for r in 0 ..< R:
+            for s in 0 ..< S:
+              result.values.add A[(ib*R + r)*K + kb*S + s]
+      result.rowPtr.add int32(result.colIdx.len)
+
+  # A has empty rows, a dense row and about 5% density elsewhere
+  const M = 60
+  const N = 1100 # More than a tile
+  const K = 90
+  var a = newSeq[float64](M*K)
+  var b = newSeq[float64](K*N)
+  var c0 = newSeq[float64](M*N)
+  for i in 0 ..< M:
+    for k in 0 ..< K:
+      if i == 7 or (i mod 5 != 3 and (i * 31 + k * 17) mod 20 == 0):
+        a[i*K + k] = float64((i + k) mod 7) - 3
+  for k in 0 ..< K:
+    for j in 0 ..< N:
+      b[k*N + j] = float64((k * 3 + j) mod 11) - 5
+  for i in 0 ..< M*N:
+    c0[i] = float64(i mod 13)
+
+  block:
+    echo "\n## CSR SpMM, with B row-major then column-major"
+    let csr = toCSR(M, K, a)
+    var expected = c0
+    dense_gemm(M, N, K, 2.0, a, b, 0.5, expected)
+
+    var res = c0
+    spmm_csr(
+      M, N, K,
+      2.0, csr.rowPtr[0].unsafeAddr, csr.colIdx[0].unsafeAddr, csr.values[0].unsafeAddr,
+      b[0].addr, N, 1,
+      0.5, res[0].addr, N, 1
+    )
+    doAssert res == expected
+
+    var bT = newSeq[float64](K*N)
+    for k in 0 ..< K:
+      for j in 0 ..< N:
+        bT[j*K + k] = b[k*N + j]
+    res = c0
+    spmm_csr(
+      M, N, K,
+      2.0, csr.rowPtr[0].unsafeAddr, csr.colIdx[0].unsafeAddr, csr.values[0].unsafeAddr,
+      bT[0].addr, 1, K,
+      0.5, res[0].addr, N, 1
+    )
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## BSR SpMM with 3x2 blocks and β = 0"
+    let bsr = toBSR(M, K, 3, 2, a)
+    var expected = c0
+    dense_gemm(M, N, K, 1.0, a, b, 0.0, expected)
+
+    var res = newSeq[float64](M*N)
+    spmm_bsr(
+      M, N, K,
+      3, 2,
+      1.0, bsr.rowPtr[0].unsafeAddr, bsr.colIdx[0].unsafeAddr, bsr.values[0].unsafeAddr,
+      b[0].addr, N, 1,
+      0.0, res[0].addr, N, 1
+    )
+    doAssert res == expected
+    echo "SUCCESS\n"
+
+  block:
+    echo "\n## CSR SpMV with strided x"
+    let csr = toCSR(M, K, a)
+    var expected = newSeq[float64](M)
+    var res = newSeq[float64](M)
+    for i in 0 ..< M:
+      res[i] = float64(i)
+      expected[i] = -float64(i)
+      for k in 0 ..< K:
+        expected[i] += 3.0 * a[i*K + k] * b[k*N + 2]
+
+    # x = B[:, 2]
+    spmv_csr(
+      M, K,
+      3.0, csr.rowPtr[0].unsafeAddr, csr.colIdx[0].unsafeAddr, csr.values[0].unsafeAddr,
+      b[2].addr, N,
+      -1.0, res[0].addr, 1
+    )
+    doAssert res == expected
+    echo "SUCCESS\n"
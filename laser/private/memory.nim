@@ -18,3 +18,108 @@ func align_raw_data*(T: typedesc, p: pointer): ptr UncheckedArray[T] =
       let offset = LASER_MEM_ALIGN - remainder
       assume_aligned cast[ptr UncheckedArray[T]](address +% offset)
   return aligned_ptr
+
+# ############################################################
+#
+#                  Huge pages allocation
+#
+# ############################################################
+
+# With 4 KiB pages, the 1536 entries of a Skylake second-level DTLB cover 6 MiB.
+# Packing buffers of GEMM and tensors of weights are larger than that
+# and their strided accesses miss the TLB on each row.
+# A 2 MiB page covers 512 times more memory with a single TLB entry.
+#
+# Large allocations can be backed by huge pages:
+#   - hpTransparent: anonymous mmap of a 2 MiB-aligned range with madvise(MADV_HUGEPAGE).
+#     The kernel backs it with huge pages if transparent huge pages are
+#     in "always" or "madvise" mode (/sys/kernel/mm/transparent_hugepage/enabled)
+#     and falls back to 4 KiB pages otherwise.
+#   - hpReserved: mmap with MAP_HUGETLB from the pages reserved in /proc/sys/vm/nr_hugepages.
+#     If there are not enough reserved pages this falls back to hpTransparent.
+#
+# This is only supported on Linux, other OSes always use 4 KiB pages.
+
+type HugePages* = enum
+  hpNone = "4 KiB pages"
+  hpTransparent = "transparent huge pages"
+  hpReserved = "reserved huge pages"
+
+const LASER_HUGE_PAGE_SIZE* = 2 * 1024 * 1024
+
+var LaserHugePages* = when defined(LASER_HUGE_PAGES): hpTransparent
+                      else: hpNone
+  ## Pages backing the allocations of at least LASER_HUGE_PAGE_SIZE bytes
+  ## of allocLarge. Compile with -d:LASER_HUGE_PAGES for transparent huge pages by default.
+
+when defined(linux):
+  var
+    PROT_READ {.importc, header: "<sys/mman.h>".}: cint
+    PROT_WRITE {.importc, header: "<sys/mman.h>".}: cint
+    MAP_PRIVATE {.importc, header: "<sys/mman.h>".}: cint
+    MAP_ANONYMOUS {.importc, header: "<sys/mman.h>".}: cint
+    MAP_HUGETLB {.importc, header: "<sys/mman.h>".}: cint
+    MADV_HUGEPAGE {.importc, header: "<sys/mman.h>".}: cint
+
+  proc mmap(adr: pointer, len: int, prot, flags, fd: cint, offset: int): pointer {.importc, header: "<sys/mman.h>".}
+  proc munmap(adr: pointer, len: int): cint {.importc, header: "<sys/mman.h>".}
+  proc madvise(adr: pointer, len: int, advice: cint): cint {.importc, header: "<sys/mman.h>".}
+
+  proc map_anonymous(len: int, flags: cint): pointer =
+    ## Returns nil on failure
+    result = mmap(nil, len, PROT_READ or PROT_WRITE, MAP_PRIVATE or MAP_ANONYMOUS or flags, -1, 0)
+    if cast[int](result) == -1: # MAP_FAILED
+      result = nil
+
+type LargeAllocHeader = object
+  ## Stored just before the pointer returned by allocLarge
+  base: pointer  # Start of the allocation
+  mapped: int    # Length of the mapping, 0 if allocated with allocShared
+
+proc allocLarge*(size: Natural, zero = false): pointer =
+  ## Allocate `size` bytes aligned on LASER_MEM_ALIGN.
+  ## If `size` is at least LASER_HUGE_PAGE_SIZE, memory is backed by `LaserHugePages`.
+  ## Memory backed by huge pages is always zero-initialized.
+  ##
+  ## The memory must be freed with deallocLarge.
+  const offset = max(LASER_MEM_ALIGN, sizeof(LargeAllocHeader))
+  var header: LargeAllocHeader
+
+  when defined(linux):
+    if LaserHugePages != hpNone and size >= LASER_HUGE_PAGE_SIZE:
+      let len = (size + offset + LASER_HUGE_PAGE_SIZE - 1) and not (LASER_HUGE_PAGE_SIZE - 1)
+      if LaserHugePages == hpReserved:
+        # Huge page mappings are aligned on the huge page size
+        header.base = map_anonymous(len, MAP_HUGETLB)
+        header.mapped = len
+      if header.base.isNil:
+        # Over-allocate to align on a huge page boundary
+        header.mapped = len + LASER_HUGE_PAGE_SIZE
+        header.base = map_anonymous(header.mapped, 0)
+        if not header.base.isNil:
+          let address = cast[ByteAddress](header.base)
+          let aligned = (address + LASER_HUGE_PAGE_SIZE - 1) and not (LASER_HUGE_PAGE_SIZE - 1)
+          # If madvise fails, the mapping stays backed by 4 KiB pages
+          discard madvise(cast[pointer](aligned), len, MADV_HUGEPAGE)
+          result = cast[pointer](aligned +% offset)
+      else:
+        result = cast[pointer](cast[ByteAddress](header.base) +% offset)
+
+  if result.isNil:
+    header.base = if zero: allocShared0(size + offset + LASER_MEM_ALIGN - 1)
+                  else: allocShared(size + offset + LASER_MEM_ALIGN - 1)
+    header.mapped = 0
+    result = align_raw_data(byte, cast[pointer](cast[ByteAddress](header.base) +% offset))
+
+  cast[ptr LargeAllocHeader](cast[ByteAddress](result) -% sizeof(LargeAllocHeader))[] = header
+
+proc deallocLarge*(p: pointer) =
+  ## Free memory allocated by allocLarge
+  if p.isNil:
+    return
+  let header = cast[ptr LargeAllocHeader](cast[ByteAddress](p) -% sizeof(LargeAllocHeader))[]
+  when defined(linux):
+    if header.mapped != 0:
+      discard munmap(header.base, header.mapped)
+      return
+  deallocShared(header.base)
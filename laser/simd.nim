@@ -102,6 +102,7 @@ when defined(i386) or defined(amd64):
   func mm_add_pd*(a, b: m128d): m128d {.importc: "_mm_add_pd", x86.}
   func mm_sub_pd*(a, b: m128d): m128d {.importc: "_mm_sub_pd", x86.}
   func mm_mul_pd*(a, b: m128d): m128d {.importc: "_mm_mul_pd", x86.}
+  func mm_max_pd*(a, b: m128d): m128d {.importc: "_mm_max_pd", x86.}
 
   # ############################################################
   #
@@ -207,6 +208,9 @@ when defined(i386) or defined(amd64):
     ## Multiply element-wise 2 vectors of 4 32-bit ints
     ## into intermediate 4 64-bit ints, and keep the low 32-bit parts
 
+  func mm_max_epi32*(a, b: m128i): m128i {.importc: "_mm_max_epi32", x86.}
+    ## Element-wise maximum of 2 vectors of 4 signed 32-bit ints
+
   # ############################################################
   #
   #                    AVX - float32 - packed
@@ -249,6 +253,7 @@ when defined(i386) or defined(amd64):
   func mm256_storeu_pd*(mem_addr: ptr float64, a: m256d) {.importc: "_mm256_storeu_pd", x86.}
   func mm256_add_pd*(a, b: m256d): m256d {.importc: "_mm256_add_pd", x86.}
   func mm256_mul_pd*(a, b: m256d): m256d {.importc: "_mm256_mul_pd", x86.}
+  func mm256_max_pd*(a, b: m256d): m256d {.importc: "_mm256_max_pd", x86.}
 
   # ############################################################
   #
@@ -259,6 +264,15 @@ when defined(i386) or defined(amd64):
   func mm256_fmadd_ps*(a, b, c: m256): m256 {.importc: "_mm256_fmadd_ps", x86.}
   func mm256_fmadd_pd*(a, b, c: m256d): m256d {.importc: "_mm256_fmadd_pd", x86.}
 
+  # ############################################################
+  #
+  #                 F16C - float16 conversion
+  #
+  # ############################################################
+
+  func mm256_cvtph_ps*(a: m128i): m256 {.importc: "_mm256_cvtph_ps", x86.}
+    ## Convert 8 packed fp16 to float32
+
   # ############################################################
   #
   #                   AVX - integers - packed
@@ -307,6 +321,9 @@ when defined(i386) or defined(amd64):
     ## Multiply element-wise 2 vectors of 8x 32-bit ints
     ## into intermediate 8x 64-bit ints, and keep the low 32-bit parts
 
+  func mm256_max_epi32*(a, b: m256i): m256i {.importc: "_mm256_max_epi32", x86.}
+    ## Element-wise maximum of 2 vectors of 8 signed 32-bit ints
+
   func mm256_shuffle_epi32*(a: m256i, imm8: cint): m256i {.importc: "_mm256_shuffle_epi32", x86.}
     ## Shuffle 32-bit integers in a according to the control in imm8
     ## Formula is in big endian representation
@@ -334,8 +351,15 @@ when defined(i386) or defined(amd64):
   func mm256_cmpgt_epi32*(a, b: m256i): m256i {.importc: "_mm256_cmpgt_epi32", x86.}
     ## Compare a greater than b
 
+  func mm256_madd_epi16*(a, b: m256i): m256i {.importc: "_mm256_madd_epi16", x86.}
+    ## Multiply 16-bit ints and add adjacent pairs into 32-bit ints
+
   func mm256_srli_epi32*(a: m256i, count: int32): m256i {.importc: "_mm256_srli_epi32", x86.}
   func mm256_slli_epi32*(a: m256i, count: int32): m256i {.importc: "_mm256_slli_epi32", x86.}
+  func mm256_srli_epi16*(a: m256i, count: int32): m256i {.importc: "_mm256_srli_epi16", x86.}
+  func mm256_slli_epi16*(a: m256i, count: int32): m256i {.importc: "_mm256_slli_epi16", x86.}
+  func mm256_srai_epi16*(a: m256i, count: int32): m256i {.importc: "_mm256_srai_epi16", x86.}
+    ## Shift right the 16-bit ints of `a` and fill with the sign bit
 
   func mm_i32gather_epi32*(m: ptr (uint32 or int32), i: m128i, s: int32): m128i {.importc: "_mm_i32gather_epi32", x86.}
   func mm256_i32gather_epi32*(m: ptr (uint32 or int32), i: m256i, s: int32): m256i {.importc: "_mm256_i32gather_epi32", x86.}
@@ -377,6 +401,7 @@ when defined(i386) or defined(amd64):
   func mm512_add_pd*(a, b: m512d): m512d {.importc: "_mm512_add_pd", x86.}
   func mm512_mul_pd*(a, b: m512d): m512d {.importc: "_mm512_mul_pd", x86.}
   func mm512_fmadd_pd*(a, b, c: m512d): m512d {.importc: "_mm512_fmadd_pd", x86.}
+  func mm512_max_pd*(a, b: m512d): m512d {.importc: "_mm512_max_pd", x86.}
 
   # # ############################################################
   # #
@@ -398,6 +423,11 @@ when defined(i386) or defined(amd64):
   func mm512_add_epi32*(a, b: m512i): m512i {.importc: "_mm512_add_epi32", x86.}
   func mm512_add_epi64*(a, b: m512i): m512i {.importc: "_mm512_add_epi64", x86.}
 
+  func mm512_max_epi32*(a, b: m512i): m512i {.importc: "_mm512_max_epi32", x86.}
+    ## Element-wise maximum of 2 vectors of 16 signed 32-bit ints
+  func mm512_max_epi64*(a, b: m512i): m512i {.importc: "_mm512_max_epi64", x86.}
+    ## Element-wise maximum of 2 vectors of 8 signed 64-bit ints
+
   func mm512_mullo_epi32*(a, b: m512i): m512i {.importc: "_mm512_mullo_epi32", x86.}
     ## Multiply element-wise 2 vectors of 16 32-bit ints
     ## into intermediate 16 32-bit ints, and keep the low 32-bit parts
@@ -423,8 +453,20 @@ when defined(i386) or defined(amd64):
     ## Returns the most significant bit
     ## of each 8-bit elements in `a`
 
+  func mm512_madd_epi16*(a, b: m512i): m512i {.importc: "_mm512_madd_epi16", x86.}
+    ## AVX512BW: Multiply 16-bit ints and add adjacent pairs into 32-bit ints
+  func mm512_dpbusd_epi32*(src, a, b: m512i): m512i {.importc: "_mm512_dpbusd_epi32", x86.}
+    ## AVX512 VNNI: Multiply groups of 4 unsigned 8-bit ints of a with
+    ## the signed 8-bit ints of b and accumulate their sum in the 32-bit ints of src
+
   func mm512_srli_epi32*(a: m512i, count: int32): m512i {.importc: "_mm512_srli_epi32", x86.}
   func mm512_slli_epi32*(a: m512i, count: int32): m512i {.importc: "_mm512_slli_epi32", x86.}
+  func mm512_srli_epi16*(a: m512i, count: int32): m512i {.importc: "_mm512_srli_epi16", x86.}
+    ## AVX512BW
+  func mm512_slli_epi16*(a: m512i, count: int32): m512i {.importc: "_mm512_slli_epi16", x86.}
+    ## AVX512BW
+  func mm512_srai_epi16*(a: m512i, count: int32): m512i {.importc: "_mm512_srai_epi16", x86.}
+    ## AVX512BW: Shift right the 16-bit ints of `a` and fill with the sign bit
 
   func mm512_i32gather_epi32*(i: m512i, m: ptr (uint32 or int32), s: int32): m512i {.importc: "_mm512_i32gather_epi32", x86.}
     ## Warning ⚠: Argument are switched compared to mm256_i32gather_epi32
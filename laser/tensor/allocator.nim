@@ -12,18 +12,20 @@ proc finalizer[T](storage: CpuStorage[T]) =
   static: assert T.supportsCopyMem, "Tensors of seq, strings, ref types and types with non-trivial destructors cannot be finalized by this proc"
 
   if storage.memowner and not storage.memalloc.isNil:
-    storage.memalloc.deallocShared()
+    storage.memalloc.deallocLarge()
 
 proc allocCpuStorage*[T](storage: var CpuStorage[T], size: int) =
   ## Allocate aligned memory to hold `size` elements of type T.
   ## If T does not supports copyMem, it is also zero-initialized.
   ## I.e. Tensors of seq, strings, ref types or types with non-trivial destructors
   ## are always zero-initialized. This prevents potential GC issues.
+  ##
+  ## Storages of at least LASER_HUGE_PAGE_SIZE bytes are backed by LaserHugePages.
   when T.supportsCopyMem:
     new(storage, finalizer[T])
-    storage.memalloc = allocShared0(sizeof(T) * size + LASER_MEM_ALIGN - 1)
+    storage.memalloc = allocLarge(sizeof(T) * size, zero = true)
     storage.memowner = true
-    storage.raw_buffer = align_raw_data(T, storage.memalloc)
+    storage.raw_buffer = assume_aligned cast[ptr UncheckedArray[T]](storage.memalloc)
   else: # Always 0-initialize Tensors of seq, strings, ref types and types with non-trivial destructors
     new(storage)
     newSeq[T](storage.raw_buffer, size)